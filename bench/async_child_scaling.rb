@@ -0,0 +1,69 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+# measures popen3_async with increasing numbers of concurrently supervised
+# children, reporting total wall time and peak open descriptors in the parent.
+# uses the epoll reactor backend when supported by the kernel.
+#
+# usage: ruby bench/async_child_scaling.rb [max_children]
+
+require ::File.expand_path('../bench_helper', __FILE__)
+require 'eventmachine'
+
+helper = ::RightScale::RightPopen::BenchHelper
+max_children = (ARGV[0] || 1000).to_i
+command = ['sh', '-c', 'echo stdout; echo stderr 1>&2; sleep 1']
+
+# @return [Integer] count of open descriptors in this process
+def open_descriptor_count
+  ::Dir.glob('/proc/self/fd/*').size
+rescue ::SystemCallError
+  0
+end
+
+::EM.epoll
+child_count = 10
+while child_count <= max_children
+  completed = 0
+  peak_descriptors = 0
+  started_at = helper.now
+  ::EM.run do
+    child_count.times do
+      target = helper::CountingTarget.new
+      target.define_singleton_method(:on_exit) do |status|
+        completed += 1
+        ::EM.stop if completed == child_count
+      end
+      ::RightScale::RightPopen.popen3_async(command, target.handler_options)
+    end
+    ::EM.add_periodic_timer(0.1) do
+      peak_descriptors = [peak_descriptors, open_descriptor_count].max
+    end
+  end
+  elapsed = helper.now - started_at
+  helper.report(
+    "children=#{child_count}",
+    'seconds'          => elapsed,
+    'peak_descriptors' => peak_descriptors)
+  child_count *= 10
+end
@@ -0,0 +1,109 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+$:.unshift(::File.expand_path('../../lib', __FILE__))
+
+require 'rubygems'
+require 'right_popen'
+require 'rbconfig'
+
+module RightScale::RightPopen
+  module BenchHelper
+
+    RUBY_CMD = ::RbConfig.respond_to?(:ruby) ? ::RbConfig.ruby : 'ruby'
+
+    MEGABYTE = 1024 * 1024
+
+    # @return [String] path to the given script from the spec scripts directory
+    def self.script_path_for(name)
+      name += '.rb' if ::File.extname(name).empty?
+      ::File.expand_path(::File.join('..', '..', 'spec', 'right_popen', 'scripts', name), __FILE__)
+    end
+
+    # @return [Array] command to run the given spec script with arguments
+    def self.script_command(name, *args)
+      [RUBY_CMD, script_path_for(name)] + args.map { |arg| arg.to_s }
+    end
+
+    # @return [Integer] total objects allocated by this process so far
+    def self.allocated_objects
+      stat = ::GC.stat
+      stat[:total_allocated_objects] || stat[:total_allocated_object]
+    end
+
+    # @return [Float] monotonic seconds
+    def self.now
+      ::Process.clock_gettime(::Process::CLOCK_MONOTONIC)
+    end
+
+    # @return [Float] value at the given percentile (0..100) of samples
+    def self.percentile(samples, percent)
+      sorted = samples.sort
+      sorted[[((percent / 100.0) * sorted.size).ceil - 1, 0].max]
+    end
+
+    # @return [String] commit of the working tree or nil if unknown
+    def self.git_commit
+      root = ::File.expand_path('../..', __FILE__)
+      commit = `git -C "#{root}" rev-parse HEAD 2>/dev/null`.strip
+      commit.empty? ? nil : commit
+    rescue ::SystemCallError
+      nil
+    end
+
+    # Prints a row of labelled results.
+    def self.report(label, values)
+      formatted = values.map { |k, v| "#{k}=#{v.kind_of?(::Float) ? ('%.3f' % v) : v}" }
+      puts "#{label.ljust(32)} #{formatted.join('  ')}"
+    end
+
+    # Minimal target that discards (or counts) child output.
+    class CountingTarget
+      attr_reader :byte_count, :call_count, :status
+
+      def initialize
+        @byte_count = 0
+        @call_count = 0
+        @status = nil
+      end
+
+      def on_output(data)
+        @byte_count += data.bytesize
+        @call_count += 1
+      end
+
+      def on_exit(status)
+        @status = status
+      end
+
+      def handler_options
+        {
+          :target         => self,
+          :stdout_handler => :on_output,
+          :stderr_handler => :on_output,
+          :exit_handler   => :on_exit,
+        }
+      end
+    end
+  end
+end
@@ -0,0 +1,76 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+# compares RightPopen.capture against the equivalent handler-based
+# popen3_sync for both trivial commands and large outputs.
+#
+# usage: ruby bench/capture.rb [iterations] [megabytes]
+
+require ::File.expand_path('../bench_helper', __FILE__)
+
+helper = ::RightScale::RightPopen::BenchHelper
+iterations = (ARGV[0] || 50).to_i
+megabytes = (ARGV[1] || 16).to_i
+
+# handler-based equivalent of capture as typically written by callers.
+class CollectingTarget
+  attr_reader :stdout_text, :stderr_text, :status
+  def initialize; @stdout_text = ''; @stderr_text = ''; end
+  def on_stdout(data); @stdout_text << data; end
+  def on_stderr(data); @stderr_text << data; end
+  def on_exit(status); @status = status; end
+end
+
+runners = {
+  'popen3_sync handlers' => lambda do |command|
+    target = CollectingTarget.new
+    ::RightScale::RightPopen.popen3_sync(
+      command,
+      :target         => target,
+      :stdout_handler => :on_stdout,
+      :stderr_handler => :on_stderr,
+      :exit_handler   => :on_exit)
+    [target.stdout_text, target.stderr_text, target.status]
+  end,
+  'capture' => lambda do |command|
+    ::RightScale::RightPopen.capture(command)
+  end,
+}
+
+[
+  ['trivial', ['true'], iterations],
+  ["#{megabytes}MB output", helper.script_command('produce_bytes', megabytes * helper::MEGABYTE), 1],
+].each do |scenario, command, count|
+  runners.each do |label, runner|
+    ::GC.start
+    allocated = helper.allocated_objects
+    started_at = helper.now
+    count.times { runner.call(command) }
+    elapsed = helper.now - started_at
+    allocated = helper.allocated_objects - allocated
+    helper.report(
+      "#{scenario}: #{label}",
+      'ms_per_run'         => (elapsed * 1000) / count,
+      'allocations_per_run' => allocated / count)
+  end
+end
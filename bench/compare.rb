@@ -0,0 +1,45 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+# compares two sets of results written by bench/suite.rb, printing the change
+# in each metric from the baseline.
+#
+# usage: ruby bench/compare.rb baseline.json current.json
+
+require 'json'
+
+unless ARGV.size == 2
+  abort 'usage: ruby bench/compare.rb baseline.json current.json'
+end
+baseline, current = ARGV.map { |path| ::JSON.parse(::File.read(path)) }
+puts "baseline #{baseline['commit'] || '?'} (#{baseline['recorded_at']})"
+puts "current  #{current['commit'] || '?'} (#{current['recorded_at']})"
+current['results'].each do |scenario, cases|
+  cases.each do |label, metrics|
+    metrics.each do |metric, value|
+      before = ((baseline['results'][scenario] || {})[label] || {})[metric]
+      change = (before && before != 0) ? ('%+.1f%%' % (((value - before) * 100.0) / before)) : 'new'
+      puts "#{"#{scenario}: #{label}".ljust(48)} #{metric.ljust(20)} #{('%.3f' % value).rjust(12)} #{change.rjust(8)}"
+    end
+  end
+end
@@ -0,0 +1,63 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+# compares RightPopen.capture against the equivalent handler-based
+# compares a new ruby child per request (capture) against one long-lived
+# coprocess and a small coprocess pool serving the same requests. note that
+# the figures include starting each child once.
+#
+# usage: ruby bench/coprocess.rb [requests]
+
+require ::File.expand_path('../bench_helper', __FILE__)
+
+helper = ::RightScale::RightPopen::BenchHelper
+requests = (ARGV[0] || 50).to_i
+command = helper.script_command('coprocess')
+
+runners = {
+  'capture per request' => lambda do |count|
+    count.times do |i|
+      ::RightScale::RightPopen.capture(command, :input => "request #{i}\n")
+    end
+  end,
+  'coprocess' => lambda do |count|
+    coprocess = ::RightScale::RightPopen::Coprocess.new(command)
+    count.times { |i| coprocess.request("request #{i}") }
+    coprocess.close
+  end,
+  'coprocess pool (4 threads)' => lambda do |count|
+    pool = ::RightScale::RightPopen::CoprocessPool.new(command, :pool_size => 4)
+    (0...4).map do |t|
+      ::Thread.new { (count / 4).times { |i| pool.request("request #{t}.#{i}") } }
+    end.each { |thread| thread.join }
+    pool.close
+  end,
+}
+
+runners.each do |label, runner|
+  ::GC.start
+  started_at = helper.now
+  runner.call(requests)
+  elapsed = helper.now - started_at
+  helper.report(label, 'ms_per_request' => (elapsed * 1000) / requests)
+end
@@ -0,0 +1,53 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+# measures ruby object allocations per megabyte of child output delivered to a
+# sync stdout handler, first with a newly allocated String per chunk and then
+# with a reusable :stdout_buffer.
+#
+# usage: ruby bench/output_allocations.rb [megabytes]
+
+require ::File.expand_path('../bench_helper', __FILE__)
+
+helper = ::RightScale::RightPopen::BenchHelper
+megabytes = (ARGV[0] || 16).to_i
+command = helper.script_command('produce_bytes', megabytes * helper::MEGABYTE)
+
+{
+  'allocating handler' => {},
+  'reusable buffer'    => { :stdout_buffer => '' },
+}.each do |label, extra_options|
+  target = helper::CountingTarget.new
+  options = target.handler_options.merge(extra_options)
+  ::GC.start
+  allocated = helper.allocated_objects
+  started_at = helper.now
+  ::RightScale::RightPopen.popen3_sync(command, options)
+  elapsed = helper.now - started_at
+  allocated = helper.allocated_objects - allocated
+  helper.report(
+    label,
+    'allocations_per_mb' => allocated / megabytes,
+    'handler_calls'      => target.call_count,
+    'mb_per_sec'         => megabytes / elapsed)
+end
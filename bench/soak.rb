@@ -0,0 +1,181 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+# runs tens of thousands of mixed commands (output, input, large output,
+# timeouts, size-limit interrupts and spawn failures) through popen3_sync,
+# popen3_reactor and (when eventmachine loads) popen3_async at the given
+# concurrency while sampling the open file descriptors, RSS, live objects and
+# zombie children of this process. exits nonzero if any of these grow beyond
+# an allowance once warmed up, which indicates a leak.
+#
+# usage: ruby bench/soak.rb [runs] [concurrency]
+#
+# set SOAK_SAMPLES to change how many times the process is sampled (default
+# 20); samples are taken between batches of runs with no child running.
+
+require ::File.expand_path('../bench_helper', __FILE__)
+require 'thread'
+
+helper = ::RightScale::RightPopen::BenchHelper
+runs = (ARGV[0] || ::ENV['SOAK_RUNS'] || 20000).to_i
+concurrency = [(ARGV[1] || ::ENV['SOAK_CONCURRENCY'] || 8).to_i, 1].max
+sample_count = [(::ENV['SOAK_SAMPLES'] || 20).to_i, 4].max
+
+begin
+  require 'eventmachine'
+rescue ::LoadError
+  puts 'NOTE: eventmachine is not available; skipping popen3_async'
+end
+::RightScale::RightPopen.require_popen3_impl(:popen3_sync)
+::RightScale::RightPopen.require_popen3_impl(:popen3_reactor)
+
+# target that also signals the waiting worker on exit.
+class SoakTarget < ::RightScale::RightPopen::BenchHelper::CountingTarget
+  def initialize(exited)
+    super()
+    @exited = exited
+  end
+
+  def on_exit(status)
+    super
+    @exited << status if @exited
+  end
+end
+
+# command, options and expected outcome of each kind of run; each appears in
+# proportion to its weight.
+output_bytes = 256 * 1024
+cases = [
+  [10, :output, ['sh', '-c', 'echo out; echo err 1>&2'], {}],
+  [3,  :input, ['cat'], { :input => 'x' * 1000 }],
+  [3,  :large_output, helper.script_command('produce_bytes', output_bytes), {}],
+  [1,  :timeout, ['sleep', '5'], { :timeout_seconds => 0.05 }],
+  [1,  :size_limit, helper.script_command('produce_bytes', output_bytes * 4), { :size_limit_bytes => output_bytes }],
+  [2,  :spawn_failure, ['nosuchexecutable'], {}],
+].map { |weight, name, command, options| [[name, command, options]] * weight }.flatten(1)
+
+modes = [:sync, :reactor]
+if defined?(::EM)
+  ::Thread.new { ::EM.run }
+  sleep 0.01 until ::EM.reactor_running?
+  modes << :async
+end
+
+outcomes = ::Hash.new(0)
+outcomes_mutex = ::Mutex.new
+
+# runs one command and blocks until it has exited.
+run_one = lambda do |index|
+  mode = modes[index % modes.size]
+  name, command, options = cases[(index / modes.size) % cases.size]
+  exited = (mode == :sync) ? nil : ::Queue.new
+  target = SoakTarget.new(exited)
+  options = target.handler_options.merge(options)
+  outcome = begin
+    case mode
+    when :sync
+      ::RightScale::RightPopen.popen3_sync(command, options)
+    when :reactor
+      ::RightScale::RightPopen.popen3_reactor(command, options)
+      exited.pop
+    when :async
+      ::EM.schedule { ::RightScale::RightPopen.popen3_async(command, options) }
+      exited.pop
+    end
+    target.status && target.status.success? ? 'success' : 'failure'
+  rescue ::RightScale::RightPopen::ProcessError
+    'error'
+  end
+  outcomes_mutex.synchronize { outcomes["#{mode} #{name} #{outcome}"] += 1 }
+end
+
+# @return [Hash] metrics of this process with no child running
+sample = lambda do
+  ::GC.start
+  status = ::File.read('/proc/self/status')
+  zombies = ::Dir.glob('/proc/[0-9]*/stat').count do |path|
+    state, ppid = (::File.read(path) rescue '').split(') ').last.to_s.split(' ', 3)
+    state == 'Z' && ppid.to_i == ::Process.pid
+  end
+  {
+    'fds'         => ::Dir.entries('/proc/self/fd').size - 3,  # ., .. and the Dir itself
+    'rss_kb'      => status[/^VmRSS:\s+(\d+)/, 1].to_i,
+    'zombies'     => zombies,
+    'IO'          => ::ObjectSpace.each_object(::IO).count,
+    'String'      => ::ObjectSpace.each_object(::String).count,
+    'Process'     => ::ObjectSpace.each_object(::RightScale::RightPopen::Process).count,
+    'TargetProxy' => ::ObjectSpace.each_object(::RightScale::RightPopen::TargetProxy).count,
+  }
+end
+
+samples = []
+batch_size = [(runs + sample_count - 1) / sample_count, 1].max
+started_at = helper.now
+(0...runs).each_slice(batch_size) do |indexes|
+  queue = ::Queue.new
+  indexes.each { |index| queue << index }
+  concurrency.times.map do
+    ::Thread.new do
+      while index = (queue.pop(true) rescue nil)
+        run_one.call(index)
+      end
+    end
+  end.each { |thread| thread.join }
+  samples << sample.call
+  helper.report("runs=#{indexes.last + 1}", samples.last)
+end
+elapsed = helper.now - started_at
+puts "#{runs} runs in #{'%.1f' % elapsed}s (#{'%.1f' % (runs / elapsed)} runs/sec)"
+outcomes.keys.sort.each { |key| puts "  #{key.ljust(36)} #{outcomes[key]}" }
+
+# compares the peak of each metric over the second half of the samples after
+# warm up with the peak over the first half; growth beyond the allowance (or
+# any zombie left behind) is taken as unbounded.
+retained = samples[(samples.size / 4)..-1]
+first_half = retained[0, retained.size / 2]
+second_half = retained[(retained.size / 2)..-1]
+failures = []
+samples.first.keys.each do |metric|
+  before = first_half.map { |s| s[metric] }.max
+  after = second_half.map { |s| s[metric] }.max
+  allowance = case metric
+              when 'fds', 'zombies' then 0
+              when 'rss_kb' then [8192, before / 10].max
+              when 'String' then 1000 + before / 20
+              when 'IO' then 16
+              else concurrency
+              end
+  growth = after - before
+  per_thousand = ((samples.last[metric] - retained.first[metric]) * 1000.0) / runs
+  helper.report(metric, 'peak_growth' => growth, 'allowance' => allowance, 'per_1000_runs' => per_thousand)
+  failures << "#{metric} grew by #{growth} (allowed #{allowance})" if growth > allowance
+end
+failures << "#{samples.last['zombies']} zombie(s) remain" if samples.last['zombies'] > 0
+::EM.stop if defined?(::EM) && ::EM.reactor_running?
+
+if failures.empty?
+  puts 'PASSED'
+else
+  puts "FAILED: #{failures.join('; ')}"
+  exit 1
+end
@@ -0,0 +1,245 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+# runs the performance benchmark suite (spawn latency, output throughput,
+# handler overhead, interrupt latency and concurrency scaling) for the sync,
+# capture and async implementations alongside Open3 and Process.spawn
+# baselines. results are printed and also written as JSON for comparison
+# across commits (see bench/compare.rb).
+#
+# usage: ruby bench/suite.rb [results_path]
+#
+# set BENCH_SCALE to multiply iterations and output sizes (default 1.0).
+
+require ::File.expand_path('../bench_helper', __FILE__)
+require 'fileutils'
+require 'json'
+require 'open3'
+require 'thread'
+require 'time'
+
+helper = ::RightScale::RightPopen::BenchHelper
+scale = (::ENV['BENCH_SCALE'] || 1).to_f
+results_path = ARGV[0] ||
+  ::File.join('measurement', 'bench', "#{::Time.now.utc.strftime('%Y%m%dT%H%M%SZ')}.json")
+results = {}
+
+begin
+  require 'eventmachine'
+rescue ::LoadError
+  puts 'NOTE: eventmachine is not available; skipping popen3_async'
+end
+
+# @return [Integer] scaled count (at least one)
+scaled = lambda { |count| [(count * scale).round, 1].max }
+
+# records and prints the metrics of one case of a scenario.
+record = lambda do |scenario, label, metrics|
+  (results[scenario] ||= {})[label] = metrics
+  helper.report("#{scenario}: #{label}", metrics)
+end
+
+# each runner runs the command the given number of times in sequence and
+# returns the elapsed seconds, bytes read and handler calls of each run.
+runners = {
+  'popen3_sync' => lambda do |command, count, options|
+    count.times.map do
+      target = helper::CountingTarget.new
+      started_at = helper.now
+      ::RightScale::RightPopen.popen3_sync(command, target.handler_options.merge(options))
+      [helper.now - started_at, target.byte_count, target.call_count]
+    end
+  end,
+  'capture' => lambda do |command, count, options|
+    count.times.map do
+      started_at = helper.now
+      stdout, stderr, _ = ::RightScale::RightPopen.capture(command, options)
+      [helper.now - started_at, stdout.bytesize + stderr.bytesize, 0]
+    end
+  end,
+  'popen3_reactor' => lambda do |command, count, options|
+    exited = ::Queue.new
+    count.times.map do
+      target = helper::CountingTarget.new
+      target.define_singleton_method(:on_exit) { |status| exited << status }
+      started_at = helper.now
+      ::RightScale::RightPopen.popen3_reactor(command, target.handler_options.merge(options))
+      exited.pop
+      [helper.now - started_at, target.byte_count, target.call_count]
+    end
+  end,
+  'open3' => lambda do |command, count, options|
+    count.times.map do
+      started_at = helper.now
+      stdout, stderr, _ = ::Open3.capture3(*command)
+      [helper.now - started_at, stdout.bytesize + stderr.bytesize, 0]
+    end
+  end,
+  'process_spawn' => lambda do |command, count, options|
+    count.times.map do
+      started_at = helper.now
+      byte_count = 0
+      stdout_r, stdout_w = ::IO.pipe
+      stderr_r, stderr_w = ::IO.pipe
+      pid = ::Process.spawn(*command, :in => :close, :out => stdout_w, :err => stderr_w)
+      stdout_w.close
+      stderr_w.close
+      readers = [stdout_r, stderr_r]
+      until readers.empty?
+        ::IO.select(readers)[0].each do |io|
+          begin
+            byte_count += io.readpartial(::RightScale::RightPopen::ProcessBase::READ_BUFFER_SIZE).bytesize
+          rescue ::EOFError
+            readers.delete(io)
+            io.close
+          end
+        end
+      end
+      ::Process.wait(pid)
+      [helper.now - started_at, byte_count, 0]
+    end
+  end,
+}
+if defined?(::EM)
+  runners['popen3_async'] = lambda do |command, count, options|
+    runs = []
+    ::EM.run do
+      run_next = lambda do
+        target = helper::CountingTarget.new
+        started_at = helper.now
+        target.define_singleton_method(:on_exit) do |status|
+          runs << [helper.now - started_at, target.byte_count, target.call_count]
+          runs.size < count ? ::EM.next_tick { run_next.call } : ::EM.stop
+        end
+        ::RightScale::RightPopen.popen3_async(command, target.handler_options.merge(options))
+      end
+      run_next.call
+    end
+    runs
+  end
+end
+::RightScale::RightPopen.require_popen3_impl(:popen3_sync)
+
+# spawn-to-exit latency of a trivial command.
+count = scaled.call(200)
+runners.each do |label, runner|
+  runner.call(['true'], 5, {})  # warm up
+  elapsed = runner.call(['true'], count, {}).map { |run| run[0] }
+  record.call(
+    'spawn_latency', label,
+    'p50_ms'       => helper.percentile(elapsed, 50) * 1000,
+    'p90_ms'       => helper.percentile(elapsed, 90) * 1000,
+    'p99_ms'       => helper.percentile(elapsed, 99) * 1000,
+    'runs_per_sec' => count / elapsed.inject(0) { |sum, seconds| sum + seconds })
+end
+
+# throughput of a large output (best of a few runs).
+megabytes = scaled.call(64)
+command = helper.script_command('produce_bytes', megabytes * helper::MEGABYTE, 'stdout', 4096)
+runners.each do |label, runner|
+  runs = runner.call(command, 3, {})
+  runs.each do |run|
+    raise "#{label} read #{run[1]} bytes" unless run[1] == megabytes * helper::MEGABYTE
+  end
+  record.call('throughput', label, 'mb_per_sec' => megabytes / runs.map { |run| run[0] }.min)
+end
+
+# cost of each handler call when output arrives in many small chunks.
+chunk_count = scaled.call(20000)
+command = helper.script_command('produce_chunks', chunk_count, 64)
+runners.each do |label, runner|
+  elapsed, _, call_count = runner.call(command, 1, {}).first
+  metrics = { 'seconds' => elapsed }
+  if call_count > 0
+    metrics['handler_calls'] = call_count
+    metrics['us_per_handler_call'] = (elapsed * 1_000_000) / call_count
+  end
+  record.call('chunked_output', label, metrics)
+end
+
+# dispatch through the handler target proxy alone.
+call_count = scaled.call(1_000_000)
+target = helper::CountingTarget.new
+proxy = ::RightScale::RightPopen::TargetProxy.new(target.handler_options)
+data = 'x' * 64
+{
+  'direct'       => lambda { target.on_output(data) },
+  'target_proxy' => lambda { proxy.stdout_handler(data) },
+}.each do |label, call|
+  started_at = helper.now
+  call_count.times { call.call }
+  record.call('handler_dispatch', label, 'ns_per_call' => ((helper.now - started_at) * 1_000_000_000) / call_count)
+end
+
+# delay from timeout to exit for a child that dies on the first interrupt.
+timeout_seconds = 0.1
+count = scaled.call(10)
+runners.each do |label, runner|
+  next unless label.start_with?('popen3')
+  late = runner.call(['sleep', '10'], count, :timeout_seconds => timeout_seconds).map do |run|
+    (run[0] - timeout_seconds) * 1000
+  end
+  record.call(
+    'interrupt_latency', label,
+    'p50_ms' => helper.percentile(late, 50),
+    'max_ms' => late.max)
+end
+
+# aggregate throughput with increasing numbers of concurrent children.
+command = ['sh', '-c', 'echo stdout; echo stderr 1>&2; sleep 0.05']
+runs_per_child = scaled.call(10)
+[1, 8, 32, 64].each do |concurrency|
+  started_at = helper.now
+  concurrency.times.map do
+    ::Thread.new { runners['popen3_sync'].call(command, runs_per_child, {}) }
+  end.each { |thread| thread.join }
+  record.call(
+    'concurrency', "popen3_sync threads=#{concurrency}",
+    'runs_per_sec' => (concurrency * runs_per_child) / (helper.now - started_at))
+
+  exited = ::Queue.new
+  started_at = helper.now
+  (concurrency * runs_per_child).times do |index|
+    # keep at most the given count of children running at once.
+    exited.pop if index >= concurrency
+    target = helper::CountingTarget.new
+    target.define_singleton_method(:on_exit) { |status| exited << status }
+    ::RightScale::RightPopen.popen3_reactor(command, target.handler_options)
+  end
+  concurrency.times { exited.pop }
+  record.call(
+    'concurrency', "popen3_reactor children=#{concurrency}",
+    'runs_per_sec' => (concurrency * runs_per_child) / (helper.now - started_at))
+end
+
+::FileUtils.mkdir_p(::File.dirname(results_path))
+::File.open(results_path, 'w') do |f|
+  f.puts(::JSON.pretty_generate(
+    'ruby'        => ::RUBY_DESCRIPTION,
+    'platform'    => ::RUBY_PLATFORM,
+    'commit'      => helper.git_commit,
+    'recorded_at' => ::Time.now.utc.iso8601,
+    'scale'       => scale,
+    'results'     => results))
+end
+puts "Results written to #{results_path}"
@@ -0,0 +1,53 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+# measures aggregate throughput of popen3_sync when run concurrently from
+# 1 to N ruby threads.
+#
+# usage: ruby bench/sync_thread_scaling.rb [runs_per_thread] [max_threads]
+
+require ::File.expand_path('../bench_helper', __FILE__)
+
+helper = ::RightScale::RightPopen::BenchHelper
+runs_per_thread = (ARGV[0] || 20).to_i
+max_threads = (ARGV[1] || 16).to_i
+command = ['sh', '-c', 'echo stdout; echo stderr 1>&2; sleep 0.01']
+
+thread_count = 1
+while thread_count <= max_threads
+  started_at = helper.now
+  threads = (1..thread_count).map do
+    ::Thread.new do
+      runs_per_thread.times do
+        target = helper::CountingTarget.new
+        ::RightScale::RightPopen.popen3_sync(command, target.handler_options)
+      end
+    end
+  end
+  threads.each { |thread| thread.join }
+  elapsed = helper.now - started_at
+  helper.report(
+    "threads=#{thread_count}",
+    'runs_per_sec' => (thread_count * runs_per_thread) / elapsed)
+  thread_count *= 2
+end
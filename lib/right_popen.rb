@@ -25,32 +25,78 @@ module RightScale
   module RightPopen
 
     # exceptions
-    class ProcessError < Exception; end
+    class ProcessError < Exception
+      # stage (see ExecFailure::STAGES) and errno at which a child failed
+      # before exec or else nil.
+      attr_accessor :stage, :errno
+    end
 
     # autoloads
+    autoload :CaptureTarget, 'right_popen/capture_target'
+    autoload :CompressedOutputBuffer, 'right_popen/compressed_output_buffer'
+    autoload :Coprocess, 'right_popen/coprocess'
+    autoload :CoprocessPool, 'right_popen/coprocess_pool'
+    autoload :ExecFailure, 'right_popen/exec_failure'
+    autoload :Governor, 'right_popen/governor'
+    autoload :Instrumentation, 'right_popen/instrumentation'
+    autoload :Pipeline, 'right_popen/pipeline'
     autoload :ProcessStatus, 'right_popen/process_status'
+    autoload :ResultCache, 'right_popen/result_cache'
     autoload :SafeOutputBuffer, 'right_popen/safe_output_buffer'
+    autoload :SpillingOutputBuffer, 'right_popen/spilling_output_buffer'
     autoload :TargetProxy, 'right_popen/target_proxy'
+    autoload :TimerWheel, 'right_popen/timer_wheel'
+    autoload :Tracer, 'right_popen/tracer'
+    autoload :Utf8ChunkAligner, 'right_popen/utf8_chunk_aligner'
+
+    # linux only; not packaged for windows.
+    unless RUBY_PLATFORM =~ /mswin|mingw|win32|dos|cygwin/
+      autoload :Cgroup, 'right_popen/linux/cgroup'
+    end
 
     # see popen3_async for details.
     DEFAULT_POPEN3_OPTIONS = {
-      :directory        => nil,
-      :environment      => nil,
-      :exit_handler     => nil,
-      :group            => nil,
-      :inherit_io       => false,
-      :input            => nil,
-      :locale           => true,
-      :pid_handler      => nil,
-      :size_limit_bytes => nil,
-      :stderr_handler   => nil,
-      :stdout_handler   => nil,
-      :target           => nil,
-      :timeout_seconds  => nil,
-      :umask            => nil,
-      :user             => nil,
-      :watch_handler    => nil,
-      :watch_directory  => nil,
+      :cache                   => nil,
+      :cgroup                  => nil,
+      :cgroup_limits           => nil,
+      :cpu_affinity            => nil,
+      :directory               => nil,
+      :environment             => nil,
+      :executor                => nil,
+      :exit_handler            => nil,
+      :governor                => nil,
+      :group                   => nil,
+      :inherit_io              => false,
+      :input                   => nil,
+      :instrumentation         => nil,
+      :io_priority             => nil,
+      :locale                  => true,
+      :max_cpu_seconds         => nil,
+      :max_io_bytes            => nil,
+      :max_rss_bytes           => nil,
+      :merged_output           => nil,
+      :merged_output_handler   => nil,
+      :nice                    => nil,
+      :pid_handler             => nil,
+      :priority                => 0,
+      :resource_handler        => nil,
+      :resource_limit_handler  => nil,
+      :rlimits                 => nil,
+      :sample_interval_seconds => nil,
+      :sample_process_tree     => false,
+      :sched_policy            => nil,
+      :size_limit_bytes        => nil,
+      :stderr_buffer           => nil,
+      :stderr_handler          => nil,
+      :stdout_buffer           => nil,
+      :stdout_handler          => nil,
+      :target                  => nil,
+      :timeout_seconds         => nil,
+      :umask                   => nil,
+      :user                    => nil,
+      :utf8_chunks             => false,
+      :watch_handler           => nil,
+      :watch_directory         => nil,
     }
 
     # Loads the specified implementation.
@@ -83,6 +129,15 @@ module RightScale
         sync_module = 'popen3_sync'
       when :popen3_async
         sync_module = ::File.join(platform_subdir, 'popen3_async')
+      when :popen3_fiber
+        # pipes from the native Windows implementation cannot be read without
+        # blocking so fiber scheduling is not supported there.
+        raise NotImplementedError if 'windows' == platform_subdir
+        sync_module = 'popen3_fiber'
+      when :popen3_reactor
+        # see above.
+        raise NotImplementedError if 'windows' == platform_subdir
+        sync_module = 'popen3_reactor'
       else
         fail 'unexpected synchronicity'
       end
@@ -98,7 +153,9 @@ module RightScale
     # Does not require any evented library to use.
     #
     # Streams the command's stdout and stderr to the given handlers. Time-
-    # ordering of bytes sent to stdout and stderr is not preserved.
+    # ordering of bytes sent to stdout and stderr is not preserved; give a
+    # :merged_output_handler instead to receive both in the order read with
+    # each chunk tagged by stream, sequence number and read time.
     #
     # Calls given exit handler upon command process termination, passing in the
     # resulting Process::Status.
@@ -111,41 +168,117 @@ module RightScale
     # === Returns
     # @return [TrueClass] always true
     def self.popen3_sync(cmd, options)
+      started_at = options[:instrumentation] && monotonic_time
+      options = DEFAULT_POPEN3_OPTIONS.dup.merge(options)
+      instrumentation = ::RightScale::RightPopen::Instrumentation.attach(options, started_at) if started_at
+      require_popen3_impl(:popen3_sync)
+      target = ::RightScale::RightPopen::TargetProxy.new(options)
+      target = instrumentation.wrap(target) if instrumentation
+      if options[:cache]
+        return ::RightScale::RightPopen::ResultCache.coalesce(:popen3_sync, cmd, target, options) do |recording_target|
+          ::RightScale::RightPopen.popen3_sync_impl(cmd, recording_target, options)
+        end
+      end
+      ::RightScale::RightPopen.popen3_sync_impl(cmd, target, options)
+    end
+
+    # Spawns a process to run given command synchronously and collects all of
+    # its output. This is the simple run-and-collect case of popen3_sync, which
+    # avoids any handler target and reads output in bulk.
+    #
+    # === Parameters
+    # @param [String|Array] cmd as shell command or binary to execute
+    # @param [Hash] options see popen3_async for details; handler options are ignored
+    #
+    # === Returns
+    # @return [Array] tuple of [stdout_text, stderr_text, status]
+    def self.capture(cmd, options = {})
+      started_at = options[:instrumentation] && monotonic_time
       options = DEFAULT_POPEN3_OPTIONS.dup.merge(options)
+      ::RightScale::RightPopen::Instrumentation.attach(options, started_at) if started_at
       require_popen3_impl(:popen3_sync)
-      ::RightScale::RightPopen.popen3_sync_impl(
-        cmd, ::RightScale::RightPopen::TargetProxy.new(options), options)
+      ::RightScale::RightPopen.capture_impl(cmd, options)
+    end
+
+    # Spawns a pipeline of processes (as in cmd1 | cmd2 | cmd3) synchronously
+    # with the stdout of each stage connected to the stdin of the next by a
+    # kernel pipe so that data between stages never passes through ruby. The
+    # timeout and size limit apply to the whole pipeline. Use Pipeline
+    # directly to interrupt a pipeline from another thread.
+    #
+    # === Parameters
+    # @param [Array] cmds as shell command or binary to execute for each stage
+    # @param [Hash] options see popen3_async for details; :input is streamed to the first stage and handler options are ignored
+    #
+    # === Returns
+    # @return [Pipeline::Result] with stdout of last stage plus the stderr and status of each stage
+    def self.pipeline(cmds, options = {})
+      ::RightScale::RightPopen::Pipeline.new(cmds, options).run
     end
 
     # Spawns a process to run given command asynchronously, hooking all three
-    # standard streams of the child process. Implementation requires the
-    # eventmachine gem.
+    # standard streams of the child process. Implementation requires either a
+    # running eventmachine reactor or else (for ruby 3.0+ on Linux) a
+    # Fiber.scheduler for the current thread, in which case the command runs on
+    # a non-blocking fiber and eventmachine is not required.
     #
     # Streams the command's stdout and stderr to the given handlers. Time-
-    # ordering of bytes sent to stdout and stderr is not preserved.
+    # ordering of bytes sent to stdout and stderr is not preserved; give a
+    # :merged_output_handler instead to receive both in the order read with
+    # each chunk tagged by stream, sequence number and read time.
     #
     # Calls given exit handler upon command process termination, passing in the
     # resulting Process::Status.
     #
     # All handlers must be methods exposed by the given target.
     #
+    # Each child holds up to three descriptors in the reactor (stdout, stderr
+    # and, until exec, a status pipe) plus stdin only when :input is given.
+    # When supervising hundreds of children on Linux, call EM.epoll before
+    # EM.run because the default select backend is limited to 1024
+    # descriptors.
+    #
     # === Parameters
     # @param [Hash] options for execution
+    # @option options [Hash] :cache to share one child among concurrent identical invocations (same command, environment, directory, user and input, all sync or all async) and to replay its handler events to every caller; :ttl as seconds to serve a completed result from cache (default 0 for sharing only), :key to replace the computed key, :store as a ResultCache (default shared); output beyond the store's max_entry_bytes is neither cached nor shared with later callers; cannot be combined with :watch_handler
+    # @option options [String|Cgroup] :cgroup as path of a delegated cgroup (v2) under which to create a cgroup for the child (removed once it exits) or else a Cgroup from Cgroup.create to share among a batch of children; the child joins before exec, ProcessStatus#cgroup_stats reports the usage accounted by the cgroup and an interrupt kills the whole tree with cgroup.kill. children run without a cgroup (interrupted by signals alone) when cgroups are unavailable or not writable (linux only)
+    # @option options [Hash] :cgroup_limits as limits written to the child's own cgroup (raises without a :cgroup path) keyed by :cpu_max (String or a Float count of CPUs), :cpu_weight, :io_max, :memory_high, :memory_max, :memory_swap_max or :pids_max; the child runs without a cgroup if a limit cannot be applied (as for a controller not enabled in the parent) (linux only)
+    # @option options [Integer|Array] :cpu_affinity as CPU number(s) on which the child process may run (linux only)
     # @option options [String] :directory as initial working directory for child process or nil to inherit current working directory
     # @option options [Hash] :environment variables values keyed by name
+    # @option options [Object] :executor responding to post(&task) on which to run handler callbacks or nil for the reactor's own dispatch thread (reactor only)
     # @option options [Symbol] :exit_handler target method called on exit
+    # @option options [Governor] :governor to wait for admission (shared by all processes on the machine using the same governor name) before spawning; blocks the calling thread (or fiber) except for eventmachine, where admission is awaited on timers (linux only)
     # @option options [Integer|String] :group or gid for forked process (linux only)
     # @option options [TrueClass|FalseClass] :inherit_io set to true to share all IO objects with forked process or false to close shared IO objects (default) (linux only)
     # @option options [String] :input string that will get streamed into child's process stdin
+    # @option options [Object] :instrumentation responding to call(event) to receive an Instrumentation::Event with a monotonic timestamp for each phase of running the child process (see Instrumentation) or else a Tracer shared by all children to be traced
+    # @option options [Symbol|Array] :io_priority as I/O scheduling class :realtime, :best_effort or :idle or else [class, level] with level from 0 (highest) to 7 (linux only)
     # @option options [TrueClass|FalseClass] :locale set to true to export LC_ALL=C in the forked environment (default) or false to use default locale (linux only)
+    # @option options [Numeric] :max_cpu_seconds of user plus system time used by the child process (and its descendants that have exited and been waited for) after which it will be interrupted (linux only)
+    # @option options [Integer] :max_io_bytes read from and written to storage after which child process will be interrupted (linux only)
+    # @option options [Integer] :max_rss_bytes of resident memory after which child process will be interrupted (linux only)
+    # @option options [Array] :merged_output to receive a CaptureTarget::OutputChunk (stream, sequence, timestamp_ns, data) for each chunk of output in the order read, in addition to the usual result (capture only)
+    # @option options [Symbol] :merged_output_handler target method called with (stream, sequence, timestamp_ns, data) for each chunk of either stream in the order read, where stream is :stdout or :stderr, sequence counts from 1 (skipping any chunk held back by :utf8_chunks) and timestamp_ns is the monotonic time of the read in nanoseconds; cannot be combined with :stdout_handler or :stderr_handler
+    # @option options [Integer] :nice as scheduling priority of child process from -20 (highest) to 19 (linux only)
     # @option options [Symbol] :pid_handler target method called with process ID (PID)
+    # @option options [Integer] :priority for admission by the :governor where higher is admitted before lower (default 0)
+    # @option options [Symbol] :resource_handler target method called with each ResourceSampler::Sample of the memory, CPU and I/O usage of the child process (linux only)
+    # @option options [Symbol] :resource_limit_handler target method called with the ResourceSampler::Sample that exceeded a resource limit before the exit handler (linux only)
+    # @option options [Hash] :rlimits as kernel-enforced limits set in the child before exec, keyed by :as, :core, :cpu (seconds), :fsize, :nofile or :nproc with a limit (Integer or :infinity) for both soft and hard or else [soft, hard]; a child killed by SIGXCPU or SIGXFSZ (or a shell command exiting with 128 plus either signal, as when the shell reports a command it ran was killed) is reported to the timeout_handler or size_limit_handler, respectively (linux only)
+    # @option options [Numeric] :sample_interval_seconds between samples of resource usage when a :resource_handler or resource limit is given (default 1)
+    # @option options [TrueClass|FalseClass] :sample_process_tree set to true to include all descendants of the child process in samples and limits or false to sample only the child process (default)
+    # @option options [Symbol] :sched_policy as CPU scheduling policy :other, :batch or :idle (linux only)
     # @option options [Integer] :size_limit_bytes for total size of watched directory after which child process will be interrupted
+    # @option options [String] :stderr_buffer reused for every chunk passed to stderr_handler instead of allocating a new String; valid only for the duration of the call (sync only)
     # @option options [Symbol] :stderr_handler target method called as error text is received
+    # @option options [String] :stdout_buffer reused for every chunk passed to stdout_handler instead of allocating a new String; valid only for the duration of the call (sync only)
     # @option options [Symbol] :stdout_handler target method called as output text is received
     # @option options [Object] :target object defining handler methods to be called (no handlers can be defined if not specified)
     # @option options [Numeric] :timeout_seconds after which child process will be interrupted
     # @option options [Integer|String] :umask for files created by process (linux only)
     # @option options [Integer|String] :user or uid for forked process (linux only)
+    # @option options [TrueClass|FalseClass] :utf8_chunks set to true to never split a UTF-8 sequence between output chunks and to tag each chunk as UTF-8 when valid or else binary (default false)
     # @option options [Symbol] :watch_handler called periodically with process during watch; return true to continue, false to abandon (sync only)
     # @option options [String] :watch_directory to monitor for child process writing files
     # @option options [Symbol] :async_exception_handler target method called if an exception is handled (on another thread)
@@ -153,13 +286,96 @@ module RightScale
     # === Returns
     # @return [TrueClass] always true
     def self.popen3_async(cmd, options)
+      started_at = options[:instrumentation] && monotonic_time
       options = DEFAULT_POPEN3_OPTIONS.dup.merge(options)
-      require_popen3_impl(:popen3_async)
-      unless ::EM.reactor_running?
-        raise ::ArgumentError, "EventMachine reactor must be running."
+      instrumentation = ::RightScale::RightPopen::Instrumentation.attach(options, started_at) if started_at
+
+      # prefer EM when running; check for a scheduler before requiring EM.
+      if fiber_scheduler? && !(defined?(::EM) && ::EM.reactor_running?)
+        require_popen3_impl(:popen3_fiber)
+        impl = :popen3_fiber_impl
+      else
+        require_popen3_impl(:popen3_async)
+        unless ::EM.reactor_running?
+          raise ::ArgumentError, "EventMachine reactor must be running."
+        end
+        impl = :popen3_async_impl
+      end
+
+      # raise invalid scheduling options and limits to the caller before
+      # spawning later.
+      if const_defined?(:Scheduling, false) &&
+         ::RightScale::RightPopen::Scheduling.requested?(options)
+        ::RightScale::RightPopen::Scheduling.new(options)
+      end
+      if const_defined?(:ResourceLimits, false) &&
+         ::RightScale::RightPopen::ResourceLimits.requested?(options)
+        ::RightScale::RightPopen::ResourceLimits.new(options)
       end
-      ::RightScale::RightPopen.popen3_async_impl(
-        cmd, ::RightScale::RightPopen::TargetProxy.new(options), options)
+      if options[:cgroup_limits] && const_defined?(:Cgroup, false)
+        raise ::ArgumentError, 'cgroup_limits require a cgroup' unless options[:cgroup]
+        ::RightScale::RightPopen::Cgroup.limit_values_for(options[:cgroup_limits])
+      end
+      target = ::RightScale::RightPopen::TargetProxy.new(options)
+      target = instrumentation.wrap(target) if instrumentation
+      if options[:cache]
+        return ::RightScale::RightPopen::ResultCache.coalesce(:popen3_async, cmd, target, options) do |recording_target|
+          ::RightScale::RightPopen.__send__(impl, cmd, recording_target, options)
+        end
+      end
+      ::RightScale::RightPopen.__send__(impl, cmd, target, options)
+    end
+
+    # Spawns a process to run given command asynchronously without requiring
+    # eventmachine or a Fiber.scheduler. The streams, exit and deadlines of all
+    # such children are serviced by a single background reactor thread so that
+    # the thread count remains constant regardless of how many children are
+    # running. Handler callbacks are posted to the given :executor (or else run
+    # on one dispatch thread) and are called in order for any one child.
+    #
+    # === Parameters
+    # @param [Hash] options see popen3_async for details
+    #
+    # === Returns
+    # @return [TrueClass] always true
+    def self.popen3_reactor(cmd, options)
+      started_at = options[:instrumentation] && monotonic_time
+      options = DEFAULT_POPEN3_OPTIONS.dup.merge(options)
+      instrumentation = ::RightScale::RightPopen::Instrumentation.attach(options, started_at) if started_at
+      require_popen3_impl(:popen3_reactor)
+      target = ::RightScale::RightPopen::TargetProxy.new(options)
+      target = instrumentation.wrap(target) if instrumentation
+      ::RightScale::RightPopen.popen3_reactor_impl(cmd, target, options)
+    end
+
+    # Reads a clock that is unaffected by changes to the system (wall) time
+    # for measuring timeouts and scheduling watches. falls back to wall time
+    # for rubies older than 2.1. monotonic_nanoseconds reads the same clock as
+    # an Integer (for tagging output without rounding).
+    #
+    # === Return
+    # @return [Float] seconds from an arbitrary starting point
+    if defined?(::Process::CLOCK_MONOTONIC)
+      def self.monotonic_time
+        ::Process.clock_gettime(::Process::CLOCK_MONOTONIC)
+      end
+
+      def self.monotonic_nanoseconds
+        ::Process.clock_gettime(::Process::CLOCK_MONOTONIC, :nanosecond)
+      end
+    else
+      def self.monotonic_time
+        ::Time.now.to_f
+      end
+
+      def self.monotonic_nanoseconds
+        (::Time.now.to_r * 1_000_000_000).to_i
+      end
+    end
+
+    # @return [TrueClass|FalseClass] true if the current thread has a Fiber.scheduler
+    def self.fiber_scheduler?
+      ::Fiber.respond_to?(:scheduler) && !::Fiber.scheduler.nil?
     end
   end
 end
@@ -0,0 +1,84 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'eventmachine'
+
+module RightScale::RightPopen
+
+  # Schedules a callback on the EM reactor thread at the given deadline. the
+  # deadlines of all async processes share a timer wheel that is driven by a
+  # single EM timer for the earliest of them instead of each process holding
+  # its own chain of EM timers.
+  #
+  # === Parameters
+  # @param [Float] deadline as monotonic seconds
+  # @param [Proc] callback to call when deadline has passed
+  #
+  # === Return
+  # @return [TimerWheel::Timer] for cancelling
+  def self.schedule_async_timer(deadline, &callback)
+    timer = async_timer_wheel.schedule(deadline, &callback)
+    arm_async_timer
+    timer
+  end
+
+  # @return [TimerWheel] shared by all async processes for the current run of
+  #   the EM reactor
+  def self.async_timer_wheel
+    unless @async_timer_wheel
+      @async_timer_wheel = ::RightScale::RightPopen::TimerWheel.new
+      @async_timer = nil
+      @async_timer_deadline = nil
+
+      # timers do not survive the reactor so start over on the next run.
+      ::EM.add_shutdown_hook do
+        @async_timer_wheel = nil
+        @async_timer = nil
+      end
+    end
+    @async_timer_wheel
+  end
+
+  # (re)arms the one EM timer for the earliest deadline in the shared wheel.
+  #
+  # === Return
+  # true:: Always return true
+  def self.arm_async_timer
+    wheel = async_timer_wheel
+    if deadline = wheel.next_deadline
+      if @async_timer.nil? || deadline < @async_timer_deadline
+        @async_timer.cancel if @async_timer
+        @async_timer_deadline = deadline
+        wait_time = [deadline - ::RightScale::RightPopen.monotonic_time, 0].max
+        @async_timer = ::EM::Timer.new(wait_time) do
+          @async_timer = nil
+          wheel.advance
+          arm_async_timer if wheel.equal?(@async_timer_wheel)
+        end
+      end
+    end
+    true
+  end
+end
@@ -0,0 +1,114 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+
+module RightScale
+  module RightPopen
+
+    # quacks like TargetProxy for the simple run-and-collect case so that
+    # RightPopen.capture can avoid building a proxy and dispatching through
+    # Method objects. output is appended to strings that grow geometrically.
+    class CaptureTarget
+
+      # initial capacity of each capture string (where supported by ruby).
+      INITIAL_CAPACITY = 4096
+
+      # chunk of output from either stream in the order read; see :merged_output.
+      OutputChunk = ::Struct.new(:stream, :sequence, :timestamp_ns, :data)
+
+      attr_reader :stdout_text, :stderr_text, :status
+
+      # === Parameters
+      # @param [Array] chunks to receive an OutputChunk for each chunk of
+      #   output in the order read or nil
+      def initialize(chunks = nil)
+        @stdout_text = self.class.new_capture_string
+        @stderr_text = self.class.new_capture_string
+        @chunks = chunks
+        @output_sequence = 0
+        @status = nil
+        @timed_out = false
+        @size_limit_exceeded = false
+      end
+
+      # @return [TrueClass|FalseClass] true if the child process was timed out
+      def timed_out?; @timed_out; end
+
+      # @return [TrueClass|FalseClass] true if the child process exceeded the size limit
+      def size_limit_exceeded?; @size_limit_exceeded; end
+
+      # @return [Array] tuple of [stdout_text, stderr_text, status]
+      def result
+        [@stdout_text, @stderr_text].each do |text|
+          text.force_encoding(::Encoding.default_external)
+        end
+        [@stdout_text, @stderr_text, @status]
+      end
+
+      def stdout_handler(data)
+        @stdout_text << data
+        merge_output(:stdout, data) if @chunks
+      end
+
+      def stderr_handler(data)
+        @stderr_text << data
+        merge_output(:stderr, data) if @chunks
+      end
+
+      def exit_handler(status); @status = status; end
+      def timeout_handler; @timed_out = true; end
+      def size_limit_handler; @size_limit_exceeded = true; end
+      def resource_handler(sample); true; end
+      def resource_limit_handler(sample); true; end
+      def pid_handler(pid); true; end
+      def watch_handler(process); true; end
+      def async_exception_handler(exception); true; end
+
+      # @return [TrueClass] always true
+      def merge_output(stream, data)
+        @chunks << OutputChunk.new(
+          stream, @output_sequence += 1,
+          ::RightScale::RightPopen.monotonic_nanoseconds,
+          data.dup)  # the scratch buffer is reused for the next read
+        true
+      end
+
+      # @return [String] empty binary string with preallocated capacity
+      def self.new_capture_string
+        text = nil
+        if @supports_capacity.nil? || @supports_capacity
+          begin
+            text = ::String.new('', :capacity => INITIAL_CAPACITY)
+            @supports_capacity = true
+          rescue ::ArgumentError, ::TypeError
+            @supports_capacity = false
+          end
+        end
+        text ||= ''
+        text.force_encoding(::Encoding::BINARY)
+      end
+    end
+  end
+end
@@ -0,0 +1,124 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'zlib'
+
+module RightScale
+
+  module RightPopen
+
+    # Provides an output handler implementation that compresses output (from a
+    # child process) as it is received instead of buffering the raw text and
+    # compressing it later. compressed blocks are written to the given sink,
+    # yielded to the given block or else accumulated in memory.
+    class CompressedOutputBuffer
+
+      FORMATS = [:gzip, :deflate]
+
+      DEFAULT_FORMAT = :gzip
+
+      attr_reader :format, :sink, :raw_byte_count, :compressed_byte_count
+
+      # === Parameters
+      # @param [IO] sink for compressed blocks or nil
+      # @param [Symbol] format as one of FORMATS
+      # @param [Integer] level of compression
+      # @yield [block] called with each compressed block instead of writing to sink (optional)
+      # @yieldparam [String] block of compressed bytes
+      def initialize(sink = nil,
+                     format = DEFAULT_FORMAT,
+                     level = ::Zlib::DEFAULT_COMPRESSION,
+                     &block_handler)
+        raise ArgumentError.new('format is invalid') unless FORMATS.include?(@format = format)
+        @sink = sink
+        @block_handler = block_handler
+        @buffer = ''
+        @buffer.force_encoding(::Encoding::BINARY) if @buffer.respond_to?(:force_encoding)
+        @raw_byte_count = 0
+        @compressed_byte_count = 0
+
+        # note that adding 16 to the window bits selects the gzip header and
+        # trailer instead of the raw zlib format.
+        window_bits = (:gzip == @format) ? (::Zlib::MAX_WBITS + 16) : ::Zlib::MAX_WBITS
+        @deflater = ::Zlib::Deflate.new(level, window_bits)
+      end
+
+      # @return [TrueClass|FalseClass] true if compression has been finished
+      def finished?; @deflater.nil?; end
+
+      # @return [String] compressed bytes accumulated when there is no sink or block
+      def compressed_text; @buffer; end
+
+      # Compresses data and emits any completed blocks.
+      #
+      # === Parameters
+      # @param [String] data of any kind
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def compress_data(data)
+        raise ::RightScale::RightPopen::ProcessError, 'Compression already finished' if finished?
+        data = data.to_s
+        @raw_byte_count += data.bytesize
+        emit(@deflater.deflate(data))
+        true
+      end
+
+      # Flushes any remaining compressed bytes and closes the compression stream.
+      # Must be called (i.e. from an exit handler) before the compressed output
+      # can be considered complete. Does nothing if already finished.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def finish
+        unless finished?
+          begin
+            emit(@deflater.finish)
+          ensure
+            @deflater.close
+            @deflater = nil
+          end
+        end
+        true
+      end
+
+      protected
+
+      def emit(block)
+        unless block.empty?
+          @compressed_byte_count += block.bytesize
+          if @block_handler
+            @block_handler.call(block)
+          elsif @sink
+            @sink.write(block)
+          else
+            @buffer << block
+          end
+        end
+        true
+      end
+    end
+  end
+end
@@ -0,0 +1,323 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'thread'
+
+module RightScale
+
+  module RightPopen
+
+    # Keeps one long-lived child process (an interpreter, a CLI with a REPL,
+    # etc.) running to serve many requests so that process startup is paid
+    # once instead of once per request. each request is written to the
+    # child's stdin and its response read from the child's stdout using one of
+    # the following framings:
+    #
+    #   :line   - request and response are each a single line (newline is
+    #             appended to the request and removed from the response)
+    #   :length - request and response are each preceded by their byte size
+    #             as a 32-bit unsigned big-endian integer
+    #
+    # the child is started on first request and restarted after it crashes,
+    # after a request times out or after a given number of requests. one
+    # request is served at a time; see CoprocessPool for concurrency.
+    class Coprocess
+
+      # raised when a request times out; the child is stopped.
+      class TimeoutError < ::RightScale::RightPopen::ProcessError; end
+
+      FRAMINGS = [:line, :length]
+
+      # seconds to wait for the child to exit after closing its stdin and then
+      # again after interrupting it before killing it.
+      STOP_GRACE_SECONDS = 1
+
+      DEFAULT_OPTIONS = {
+        :framing                 => :line,
+        :max_requests            => nil,
+        :request_timeout_seconds => nil,
+      }
+
+      attr_reader :cmd, :framing, :max_requests, :request_count, :start_count
+
+      # === Parameters
+      # @param [String|Array] cmd as shell command or binary to execute
+      # @param [Hash] options for coprocess and popen3 (see RightScale.popen3_async)
+      # @option options [Symbol] :framing as :line (default) or :length
+      # @option options [Integer] :max_requests served by one child before it is restarted or nil for no limit
+      # @option options [Numeric] :request_timeout_seconds default for each request or nil for no timeout
+      # @option options [Symbol] :pid_handler target method called with process ID (PID) of each child started
+      # @option options [Symbol] :stderr_handler target method called as error text is received
+      # @option options [Symbol] :exit_handler target method called with status of each child that exits
+      def initialize(cmd, options = {})
+        # pipes from the native Windows implementation cannot be read without
+        # blocking.
+        raise ::NotImplementedError if RUBY_PLATFORM =~ /mswin|mingw/
+        @cmd = cmd
+        options = DEFAULT_OPTIONS.merge(options)
+        unless FRAMINGS.include?(@framing = options[:framing])
+          raise ::ArgumentError, "framing must be one of #{FRAMINGS.inspect}"
+        end
+        if (@max_requests = options[:max_requests]) && @max_requests < 1
+          raise ::ArgumentError, 'max_requests is invalid'
+        end
+        @request_timeout_seconds = options[:request_timeout_seconds]
+
+        # the child lives across requests so popen3 limits do not apply.
+        @options = ::RightScale::RightPopen::DEFAULT_POPEN3_OPTIONS.merge(options).merge(
+          :input            => nil,
+          :size_limit_bytes => nil,
+          :timeout_seconds  => nil,
+          :stdout_buffer    => nil,
+          :stderr_buffer    => nil)
+        ::RightScale::RightPopen.require_popen3_impl(:popen3_sync)
+        @target = ::RightScale::RightPopen::TargetProxy.new(
+          @options.reject { |key, value| value.nil? })
+        @lock = ::Mutex.new
+        @process = nil
+        @closed = false
+        @request_count = 0
+        @start_count = 0
+        @buffer = ''
+        @buffer.force_encoding(::Encoding::BINARY)
+      end
+
+      # @return [Integer] PID of running child or nil
+      def pid
+        @process && @process.pid
+      end
+
+      # @return [TrueClass|FalseClass] true if a child is running
+      def alive?
+        @lock.synchronize { running? }
+      end
+
+      # Sends a request to the child (starting it if necessary) and waits for
+      # its response.
+      #
+      # === Parameters
+      # @param [String] data for request
+      # @param [Numeric] timeout_seconds for request or nil for default
+      #
+      # === Return
+      # @return [String] response as binary
+      #
+      # === Raise
+      # @raise [TimeoutError] on timeout
+      # @raise [ProcessError] if child fails to start or exits during request
+      def request(data, timeout_seconds = @request_timeout_seconds)
+        frame = frame_request(data)
+        @lock.synchronize do
+          raise ::RightScale::RightPopen::ProcessError, 'Coprocess is closed' if @closed
+          start unless running?
+          deadline = timeout_seconds ?
+                     ::RightScale::RightPopen.monotonic_time + timeout_seconds :
+                     nil
+          begin
+            response = exchange(frame, deadline)
+          rescue ::Exception
+            # the child is in an unknown state.
+            stop(false)
+            raise
+          end
+          @request_count += 1
+          stop if @max_requests && @request_count >= @max_requests
+          response
+        end
+      end
+
+      # Stops the child, if running, and refuses any further requests.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def close
+        @lock.synchronize do
+          @closed = true
+          stop
+        end
+      end
+
+      protected
+
+      def running?
+        !!(@process && @process.alive?)
+      end
+
+      def start
+        stop if @process
+        @process = ::RightScale::RightPopen::Process.new(@options)
+        @process.spawn(@cmd, @target)
+        @process.wait_for_exec
+        @request_count = 0
+        @start_count += 1
+        @buffer = ''
+        @buffer.force_encoding(::Encoding::BINARY)
+        @target.pid_handler(@process.pid)
+        true
+      rescue ::Exception
+        stop(false) if @process
+        raise
+      end
+
+      # asks the child to exit by closing its stdin (if graceful) and then
+      # interrupts and finally kills it if it does not exit.
+      def stop(graceful = true)
+        return true unless process = @process
+        @process = nil
+        begin
+          process.stdin.close rescue nil
+          if process.alive?
+            wait_for_exit(process) if graceful
+            if process.alive?
+              ::Process.kill(process.signals_for_interrupt.first, process.pid) rescue nil
+              wait_for_exit(process)
+              if process.alive?
+                ::Process.kill(process.signals_for_interrupt.last, process.pid) rescue nil
+              end
+            end
+          end
+          @target.exit_handler(process.wait_for_exit_status)
+        ensure
+          process.safe_close_io
+        end
+        true
+      end
+
+      def wait_for_exit(process)
+        stop_at = ::RightScale::RightPopen.monotonic_time + STOP_GRACE_SECONDS
+        while process.alive? && ::RightScale::RightPopen.monotonic_time < stop_at
+          # discard any response so that the child is not blocked writing.
+          readers = [process.stdout, process.stderr].reject { |io| io.closed? }
+          if ready = ::IO.select(readers, nil, nil, 0.01)
+            ready[0].each do |io|
+              begin
+                data = io.read_nonblock(ProcessBase::READ_BUFFER_SIZE)
+                @target.stderr_handler(data) if io == process.stderr
+              rescue ::IO::WaitReadable
+                # retry on next select
+              rescue ::EOFError, ::IOError
+                io.close rescue nil
+              end
+            end
+          end
+        end
+        true
+      end
+
+      def frame_request(data)
+        data = data.to_s.dup
+        data.force_encoding(::Encoding::BINARY)
+        case @framing
+        when :line
+          raise ::ArgumentError, 'request must be a single line' if data.include?("\n")
+          data << "\n"
+        when :length
+          [data.bytesize].pack('N') << data
+        end
+      end
+
+      # writes the request while reading (in case the child responds before
+      # consuming all of the request) until a complete response is buffered.
+      def exchange(frame, deadline)
+        stdin = @process.stdin
+        stdout = @process.stdout
+        stderr = @process.stderr
+        readers = [stdout]
+        readers << stderr unless stderr.closed?
+        while true
+          if response = parse_response
+            return response
+          end
+          wait_time = nil
+          if deadline
+            wait_time = deadline - ::RightScale::RightPopen.monotonic_time
+            if wait_time <= 0
+              raise TimeoutError, "Coprocess request timed out: #{@cmd.inspect}"
+            end
+          end
+          writers = frame.empty? ? [] : [stdin]
+          ready = ::IO.select(readers, writers, nil, wait_time)
+          next unless ready
+          if ready[1].include?(stdin)
+            begin
+              written = stdin.write_nonblock(frame)
+              frame = frame.byteslice(written, frame.bytesize - written)
+            rescue ::IO::WaitWritable
+              # retry on next select
+            rescue ::Errno::EPIPE
+              raise ::RightScale::RightPopen::ProcessError,
+                    "Coprocess exited during request: #{@cmd.inspect}"
+            end
+          end
+          if ready[0].include?(stderr)
+            readers.delete(stderr) unless read_stderr(stderr)
+          end
+          if ready[0].include?(stdout)
+            begin
+              @buffer << stdout.read_nonblock(ProcessBase::READ_BUFFER_SIZE)
+            rescue ::IO::WaitReadable
+              # retry on next select
+            rescue ::EOFError
+              raise ::RightScale::RightPopen::ProcessError,
+                    "Coprocess exited during request: #{@cmd.inspect}"
+            end
+          end
+        end
+      end
+
+      # @return [TrueClass|FalseClass] false if stderr has closed
+      def read_stderr(stderr)
+        @target.stderr_handler(stderr.read_nonblock(ProcessBase::READ_BUFFER_SIZE))
+        true
+      rescue ::IO::WaitReadable
+        true
+      rescue ::EOFError, ::IOError
+        stderr.close rescue nil
+        false
+      end
+
+      # @return [String] complete response removed from buffer or nil
+      def parse_response
+        case @framing
+        when :line
+          if index = @buffer.index("\n")
+            response = @buffer.byteslice(0, index)
+            @buffer = @buffer.byteslice(index + 1, @buffer.bytesize - index - 1)
+            response
+          end
+        when :length
+          if @buffer.bytesize >= 4
+            size = @buffer.unpack('N').first
+            if @buffer.bytesize >= 4 + size
+              response = @buffer.byteslice(4, size)
+              @buffer = @buffer.byteslice(4 + size, @buffer.bytesize - 4 - size)
+              response
+            end
+          end
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,89 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'thread'
+
+module RightScale
+
+  module RightPopen
+
+    # Serves requests from any number of threads using a small, fixed number of
+    # coprocesses running the same command. each coprocess starts on its first
+    # request; a request waits for an idle coprocess when all are busy.
+    class CoprocessPool
+
+      DEFAULT_POOL_SIZE = 2
+
+      attr_reader :size
+
+      # === Parameters
+      # @param [String|Array] cmd as shell command or binary to execute
+      # @param [Hash] options see Coprocess
+      # @option options [Integer] :pool_size as count of coprocesses
+      def initialize(cmd, options = {})
+        options = options.dup
+        raise ::ArgumentError.new('pool_size is invalid') unless (@size = options.delete(:pool_size) || DEFAULT_POOL_SIZE) > 0
+        @coprocesses = ::Array.new(@size) { ::RightScale::RightPopen::Coprocess.new(cmd, options) }
+        @idle = ::Queue.new
+        @coprocesses.each { |coprocess| @idle << coprocess }
+        @closed = false
+      end
+
+      # Sends a request to an idle coprocess; see Coprocess#request.
+      #
+      # === Parameters
+      # @param [String] data for request
+      # @param [Numeric] timeout_seconds for request or nil for default
+      #
+      # === Return
+      # @return [String] response as binary
+      def request(data, *args)
+        raise ::RightScale::RightPopen::ProcessError, 'Coprocess pool is closed' if @closed
+        coprocess = @idle.pop
+        begin
+          coprocess.request(data, *args)
+        ensure
+          @idle << coprocess
+        end
+      end
+
+      # @return [Array] PIDs of running coprocesses
+      def pids
+        @coprocesses.map { |coprocess| coprocess.pid }.compact
+      end
+
+      # Stops all coprocesses (waiting for any request in progress) and refuses
+      # any further requests.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def close
+        @closed = true
+        @coprocesses.each { |coprocess| coprocess.close }
+        true
+      end
+    end
+  end
+end
@@ -0,0 +1,86 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+
+module RightScale
+
+  module RightPopen
+
+    # Encodes the failure of a child process before (or at) exec as a fixed-size
+    # binary record that the child writes to the status pipe with one write and
+    # the parent decodes into a ProcessError. the record is smaller than
+    # PIPE_BUF so it is never split or interleaved, and decoding neither loads
+    # YAML nor evaluates anything read from the pipe.
+    #
+    # the record is: magic, version, stage (index into STAGES), message length,
+    # errno (zero if not a SystemCallError) and the message ("class: message",
+    # truncated to MESSAGE_SIZE bytes) padded with NULs.
+    module ExecFailure
+
+      # steps of setting up the child in the order they are taken.
+      STAGES = [:unknown, :setup_io, :cgroup, :scheduling, :rlimits, :group,
+                :user, :umask, :directory, :environment, :exec].freeze
+
+      MAGIC = 'RPXF'
+      VERSION = 1
+      MESSAGE_SIZE = 244
+      RECORD_FORMAT = "a4CCnNa#{MESSAGE_SIZE}"
+      RECORD_SIZE = 4 + 1 + 1 + 2 + 4 + MESSAGE_SIZE
+
+      # === Parameters
+      # @param [Symbol] stage at which the child failed (see STAGES)
+      # @param [Exception] exception raised in the child
+      #
+      # === Return
+      # @return [String] record of RECORD_SIZE bytes
+      def self.encode(stage, exception)
+        message = "#{exception.class.name}: #{exception.message}"
+        message = message.dup.force_encoding(::Encoding::BINARY).byteslice(0, MESSAGE_SIZE)
+        errno = exception.respond_to?(:errno) ? exception.errno.to_i : 0
+        [MAGIC, VERSION, STAGES.index(stage) || 0, message.bytesize, errno, message].pack(RECORD_FORMAT)
+      end
+
+      # === Parameters
+      # @param [String] data read from the status pipe
+      #
+      # === Return
+      # @return [ProcessError] error to raise with the stage and errno of the
+      #   failure (if known)
+      def self.decode(data)
+        magic, version, stage_index, length, errno, message = data.unpack(RECORD_FORMAT)
+        if data.bytesize != RECORD_SIZE || magic != MAGIC || version != VERSION
+          return ::RightScale::RightPopen::ProcessError.new(
+            "Child process failed to execute (#{data.bytesize} bytes of unrecognized status)")
+        end
+        message = message.byteslice(0, length).force_encoding(::Encoding::UTF_8)
+        message.force_encoding(::Encoding::BINARY) unless message.valid_encoding?
+        error = ::RightScale::RightPopen::ProcessError.new(message)
+        error.stage = STAGES[stage_index] || :unknown
+        error.errno = errno unless errno == 0
+        error
+      end
+    end
+  end
+end
@@ -0,0 +1,337 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'fileutils'
+require 'tmpdir'
+require 'thread'
+
+module RightScale
+
+  module RightPopen
+
+    # Provides admission control for spawning children that is shared by all
+    # processes on the machine using the same name and directory. caps the
+    # count of concurrent children and (optionally) the rate of spawns.
+    #
+    # each running child holds an exclusive lock on one of max_children slot
+    # files for its lifetime and spawns take tokens from a bucket kept in a
+    # locked file. the kernel drops the locks of a process that dies so
+    # slots are never leaked by a crashed agent. requests waiting in one
+    # process are admitted in priority order (highest first, then FIFO).
+    #
+    # the default directory is private to the current user; cooperating
+    # processes of different users must be given a :directory that they can
+    # all write and be :shared to create their lock files group writable. lock
+    # files are never opened through a symlink.
+    class Governor
+
+      # raised when admission is not granted in time.
+      class AdmissionTimeout < ::RightScale::RightPopen::ProcessError; end
+
+      DEFAULT_NAME = 'default'
+      DEFAULT_DIRECTORY = ::File.join(::Dir.tmpdir, "right_popen_governor-#{::Process.euid}")
+
+      # modes of lock files for one user or shared by a group of users.
+      FILE_MODE = 0600
+      SHARED_FILE_MODE = 0660
+
+      OPEN_FLAGS = ::File::RDWR | ::File::CREAT |
+                   (defined?(::File::NOFOLLOW) ? ::File::NOFOLLOW : 0)
+
+      # seconds between attempts to be admitted while waiting.
+      MIN_POLL_INTERVAL = 0.005
+      MAX_POLL_INTERVAL = 0.05
+
+      # admission to spawn one child; release when the child has exited.
+      class Permit
+        attr_reader :wait_seconds
+
+        def initialize(slot_file, wait_seconds)
+          @slot_file = slot_file
+          @wait_seconds = wait_seconds
+        end
+
+        # @return [TrueClass|FalseClass] true if released
+        def released?; @slot_file.nil?; end
+
+        # Releases the slot held by this permit (idempotent).
+        #
+        # === Return
+        # @return [TrueClass] always true
+        def release
+          if slot_file = @slot_file
+            @slot_file = nil
+            slot_file.close rescue nil
+          end
+          true
+        end
+      end
+
+      # place in the local queue of requests waiting to be admitted.
+      class Ticket
+        attr_reader :priority, :sequence, :enqueued_at
+
+        def initialize(priority, sequence)
+          @priority = priority
+          @sequence = sequence
+          @enqueued_at = ::RightScale::RightPopen.monotonic_time
+        end
+
+        # @return [Array] sort key as highest priority then first come
+        def sort_key; [-@priority, @sequence]; end
+      end
+
+      attr_reader :name, :directory, :max_children, :spawns_per_second, :burst
+
+      # === Parameters
+      # @param [Hash] options for governor
+      # @option options [String] :name shared by cooperating processes
+      # @option options [String] :directory for lock files shared by cooperating processes (default private to the current user)
+      # @option options [TrueClass|FalseClass] :shared as true to create lock files writable by the group of the directory for processes of other users
+      # @option options [Integer] :max_children as count of concurrent children
+      # @option options [Numeric] :spawns_per_second or nil for no rate limit
+      # @option options [Integer] :burst of spawns allowed at once when rate limited (default spawns_per_second rounded up)
+      def initialize(options = {})
+        @name = (options[:name] || DEFAULT_NAME).to_s
+        unless @name =~ /\A[\w.-]+\z/
+          raise ::ArgumentError, 'name is invalid'
+        end
+        @file_mode = options[:shared] ? SHARED_FILE_MODE : FILE_MODE
+        if @directory = options[:directory]
+          ::FileUtils.mkdir_p(@directory)
+        elsif options[:shared]
+          raise ::ArgumentError, 'shared requires a directory'
+        else
+          @directory = self.class.private_directory(DEFAULT_DIRECTORY)
+        end
+        unless (@max_children = options[:max_children]).kind_of?(Integer) && @max_children > 0
+          raise ::ArgumentError, 'max_children is invalid'
+        end
+        if @spawns_per_second = options[:spawns_per_second]
+          raise ::ArgumentError, 'spawns_per_second is invalid' unless @spawns_per_second > 0
+          @burst = options[:burst] || @spawns_per_second.ceil
+          raise ::ArgumentError, 'burst is invalid' unless @burst >= 1
+        end
+        @lock = ::Mutex.new
+        @waiting = []
+        @sequence = 0
+        @bucket_file = nil
+        @bucket_pid = nil
+        @stats = {
+          :admitted           => 0,
+          :timed_out          => 0,
+          :total_wait_seconds => 0.0,
+          :max_wait_seconds   => 0.0,
+        }
+      end
+
+      # Waits to be admitted to spawn a child.
+      #
+      # === Parameters
+      # @param [Integer] priority as higher to be admitted before lower
+      # @param [Numeric] timeout_seconds to wait or nil to wait indefinitely
+      #
+      # === Return
+      # @return [Permit] to release when child has exited
+      #
+      # === Raise
+      # @raise [AdmissionTimeout] on timeout
+      def acquire(priority = 0, timeout_seconds = nil)
+        ticket = enqueue(priority)
+        deadline = timeout_seconds ? ticket.enqueued_at + timeout_seconds : nil
+        poll_interval = MIN_POLL_INTERVAL
+        begin
+          while true
+            if permit = try_acquire(ticket)
+              return permit
+            end
+            now = ::RightScale::RightPopen.monotonic_time
+            if deadline && now >= deadline
+              @lock.synchronize { @stats[:timed_out] += 1 }
+              raise AdmissionTimeout, "Not admitted to spawn within #{timeout_seconds} seconds"
+            end
+            wait_time = deadline ? [poll_interval, deadline - now].min : poll_interval
+            sleep wait_time
+            poll_interval = [poll_interval * 2, MAX_POLL_INTERVAL].min
+          end
+        ensure
+          cancel(ticket) unless permit
+        end
+      end
+
+      # Queues a request to be admitted; see try_acquire.
+      #
+      # === Parameters
+      # @param [Integer] priority as higher to be admitted before lower
+      #
+      # === Return
+      # @return [Ticket] for try_acquire or cancel
+      def enqueue(priority = 0)
+        @lock.synchronize do
+          ticket = Ticket.new(priority.to_i, @sequence += 1)
+          index = @waiting.index { |other| (other.sort_key <=> ticket.sort_key) > 0 }
+          @waiting.insert(index || @waiting.size, ticket)
+          ticket
+        end
+      end
+
+      # Attempts to admit the given request without blocking. only the request
+      # at the head of the local queue can be admitted.
+      #
+      # === Parameters
+      # @param [Ticket] ticket from enqueue
+      #
+      # === Return
+      # @return [Permit] if admitted or nil to try again later
+      def try_acquire(ticket)
+        @lock.synchronize do
+          return nil unless ticket.equal?(@waiting.first)
+          return nil unless slot_file = lock_slot
+          unless take_token
+            slot_file.close rescue nil
+            return nil
+          end
+          @waiting.shift
+          wait_seconds = ::RightScale::RightPopen.monotonic_time - ticket.enqueued_at
+          @stats[:admitted] += 1
+          @stats[:total_wait_seconds] += wait_seconds
+          @stats[:max_wait_seconds] = wait_seconds if wait_seconds > @stats[:max_wait_seconds]
+          Permit.new(slot_file, wait_seconds)
+        end
+      end
+
+      # Withdraws a request that was not admitted.
+      #
+      # === Parameters
+      # @param [Ticket] ticket from enqueue
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def cancel(ticket)
+        @lock.synchronize { @waiting.delete(ticket) }
+        true
+      end
+
+      # Provides wait-time metrics for tuning the limits.
+      #
+      # === Return
+      # @return [Hash] counts of admitted, timed out and currently waiting
+      #   requests plus total, mean and max seconds waited by admitted requests
+      def stats
+        @lock.synchronize do
+          result = @stats.dup
+          result[:waiting] = @waiting.size
+          result[:mean_wait_seconds] = result[:admitted] > 0 ?
+                                       result[:total_wait_seconds] / result[:admitted] :
+                                       0.0
+          result
+        end
+      end
+
+      # Creates the given directory as private to the current user, unless it
+      # exists, and verifies that it is a directory (not a symlink) owned by the
+      # current user and inaccessible to others.
+      #
+      # === Parameters
+      # @param [String] path of directory
+      #
+      # === Return
+      # @return [String] the same path
+      #
+      # === Raise
+      # @raise [ProcessError] if an existing directory is not private
+      def self.private_directory(path)
+        begin
+          ::Dir.mkdir(path, 0700)
+        rescue ::Errno::EEXIST
+          # verified below
+        end
+        stat = ::File.lstat(path)
+        unless stat.directory? && stat.uid == ::Process.euid && 0 == (stat.mode & 077)
+          raise ::RightScale::RightPopen::ProcessError,
+                "Governor directory is not private to the current user: #{path}"
+        end
+        path
+      end
+
+      protected
+
+      def path_for(suffix)
+        ::File.join(@directory, "#{@name}.#{suffix}")
+      end
+
+      # locks any free slot, starting at a random one to spread contention.
+      def lock_slot
+        offset = rand(@max_children)
+        @max_children.times do |i|
+          file = ::File.open(path_for("slot#{(offset + i) % @max_children}"), OPEN_FLAGS, @file_mode)
+          if file.flock(::File::LOCK_EX | ::File::LOCK_NB)
+            return file
+          else
+            file.close
+          end
+        end
+        nil
+      end
+
+      # takes one token from the shared bucket, which is refilled continuously
+      # at spawns_per_second up to burst.
+      def take_token
+        return true unless @spawns_per_second
+        file = bucket_file
+        file.flock(::File::LOCK_EX)
+        begin
+          now = ::RightScale::RightPopen.monotonic_time
+          file.rewind
+          tokens, updated_at = file.read.split.map { |s| s.to_f }
+          if tokens.nil? || updated_at.nil? || updated_at > now
+            tokens = @burst.to_f
+          else
+            tokens = [tokens + (now - updated_at) * @spawns_per_second, @burst.to_f].min
+          end
+          taken = tokens >= 1
+          tokens -= 1 if taken
+          file.rewind
+          file.truncate(0)
+          file.write("#{tokens} #{now}\n")
+          file.flush
+          taken
+        ensure
+          file.flock(::File::LOCK_UN)
+        end
+      end
+
+      # the bucket file is reopened in a forked process so that its lock is
+      # not shared with the parent.
+      def bucket_file
+        if @bucket_file.nil? || @bucket_pid != ::Process.pid
+          @bucket_file = ::File.open(path_for('bucket'), OPEN_FLAGS, @file_mode)
+          @bucket_pid = ::Process.pid
+        end
+        @bucket_file
+      end
+    end
+  end
+end
@@ -0,0 +1,210 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+
+module RightScale
+
+  module RightPopen
+
+    # Reports the phases of running a child process to a subscriber (given as
+    # the :instrumentation option) so that the time spent in each phase can be
+    # measured. nothing is timed or counted unless a subscriber is given.
+    #
+    # the subscriber is called (on whichever thread is running the phase) with
+    # an Event for each of the following phases, in order except that the
+    # reactor may see output before exec, where at is read from the monotonic
+    # clock:
+    #
+    #  :started         - popen3 (or capture) was called
+    #  :options_merged  - options were merged with defaults
+    #  :target_built    - handler target was built
+    #  :spawn_started   - Process#spawn was called
+    #  :admitted        - the :governor (if any) admitted the spawn
+    #  :gc_finished     - garbage was collected before fork
+    #  :forked          - parent returned from fork
+    #  :spawned         - parent finished setting up streams
+    #  :exec_completed  - parent saw the status pipe close on exec, which
+    #                     covers all child setup (user, directory, environment)
+    #  :first_output    - first output was read
+    #  :exit_detected   - exit was detected, with payload :exited_at as when
+    #                     the child was reaped
+    #  :drained         - final output was read
+    #  :finished        - exit handler was called (or queued, for the reactor),
+    #                     with payload of counters for :reads, :bytes and
+    #                     :handler_calls
+    #
+    # plus :interrupted (with payload :signal) whenever the child is signalled
+    # to stop. events from before the spawn have no pid. a child that fails to
+    # execute emits no :exec_completed. the subscriber should be quick and must
+    # not raise.
+    #
+    # a subscriber that responds to record(name, instrumentation, at, detail)
+    # (such as a Tracer) is called with that instead of an Event so that
+    # nothing is allocated per event. such a recorder also receives :stdout
+    # and :stderr (with detail as bytes read) for every read and the name of
+    # each handler (with at as when called and detail as seconds taken) for
+    # every handler call.
+    class Instrumentation
+
+      # one phase of running a child process.
+      Event = ::Struct.new(:name, :pid, :at, :payload)
+
+      # counts the handler calls made for a child process.
+      class CountingTarget
+        def initialize(target, instrumentation)
+          @target = target
+          @instrumentation = instrumentation
+        end
+
+        ::RightScale::RightPopen::TargetProxy::HANDLER_NAME_TO_PARAMETER_COUNT.each do |handler_name, parameter_count|
+          parameter_list = (1..parameter_count).map { |i| "p#{i}" }.join(', ')
+          class_eval <<EOF
+def #{handler_name.to_s}(#{parameter_list})
+  @instrumentation.count_handler_call
+  return @target.#{handler_name.to_s}(#{parameter_list}) unless @instrumentation.recorder
+  called_at = ::RightScale::RightPopen.monotonic_time
+  begin
+    @target.#{handler_name.to_s}(#{parameter_list})
+  ensure
+    @instrumentation.record_handler_call(#{handler_name.inspect}, called_at)
+  end
+end
+EOF
+        end
+
+        def method_missing(name, *args, &block)
+          @target.__send__(name, *args, &block)
+        end
+
+        def respond_to_missing?(name, include_private = false)
+          @target.respond_to?(name, include_private) || super
+        end
+      end
+
+      attr_reader :subscriber, :recorder, :pid
+
+      # Replaces the :instrumentation subscriber in the given options with an
+      # Instrumentation (unless already replaced) so that all parts of running
+      # a child report to one instance. the options must be a copy owned by
+      # the caller of attach, never a hash given by the application.
+      #
+      # === Parameters
+      # @param [Hash] options to modify
+      # @param [Float] started_at as monotonic seconds when popen3 was called to
+      #   emit :started and :options_merged or nil
+      #
+      # === Return
+      # @return [Instrumentation] instrumentation or nil if no subscriber
+      def self.attach(options, started_at = nil)
+        subscriber = options[:instrumentation]
+        return nil if subscriber.nil?
+        return subscriber if subscriber.kind_of?(Instrumentation)
+        instrumentation = options[:instrumentation] = new(subscriber)
+        if started_at
+          instrumentation.emit(:started, nil, nil, started_at)
+          instrumentation.emit(:options_merged, nil)
+        end
+        instrumentation
+      end
+
+      # === Parameters
+      # @param [Object] subscriber responding to call(event)
+      def initialize(subscriber)
+        unless subscriber.respond_to?(:call)
+          raise ::ArgumentError, 'instrumentation must respond to call'
+        end
+        @subscriber = subscriber
+        @recorder = subscriber.respond_to?(:record) ? subscriber : nil
+        @pid = nil
+        @reads = 0
+        @bytes = 0
+        @handler_calls = 0
+      end
+
+      # Emits an event to the subscriber.
+      #
+      # === Parameters
+      # @param [Symbol] name of phase
+      # @param [Integer] pid of child or nil
+      # @param [Hash] payload for phase or nil
+      # @param [Float] at as monotonic seconds
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def emit(name, pid, payload = nil, at = ::RightScale::RightPopen.monotonic_time)
+        @pid ||= pid
+        if @recorder
+          @recorder.record(name, self, at, payload)
+        else
+          @subscriber.call(Event.new(name, pid, at, payload))
+        end
+        true
+      end
+
+      # Wraps the handler target to count handler calls.
+      #
+      # === Parameters
+      # @param [Object] target that implements all handlers (see TargetProxy)
+      #
+      # === Return
+      # @return [CountingTarget] wrapped target
+      def wrap(target)
+        emit(:target_built, nil)
+        CountingTarget.new(target, self)
+      end
+
+      # @return [TrueClass] always true
+      def count_read(handler_name, byte_count)
+        @reads += 1
+        @bytes += byte_count
+        if @recorder
+          @recorder.record(
+            :stdout_handler == handler_name ? :stdout : :stderr,
+            self, ::RightScale::RightPopen.monotonic_time, byte_count)
+        end
+        true
+      end
+
+      # @return [TrueClass] always true
+      def record_handler_call(handler_name, called_at)
+        @recorder.record(
+          handler_name, self, called_at,
+          ::RightScale::RightPopen.monotonic_time - called_at)
+        true
+      end
+
+      # @return [TrueClass] always true
+      def count_handler_call
+        @handler_calls += 1
+        true
+      end
+
+      # @return [Hash] counts of :reads, :bytes and :handler_calls so far
+      def counters
+        { :reads => @reads, :bytes => @bytes, :handler_calls => @handler_calls }
+      end
+    end
+  end
+end
@@ -0,0 +1,275 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'thread'
+
+module RightScale
+  module RightPopen
+
+    # Places child processes in a cgroup (v2) of their own under a delegated
+    # parent cgroup so that their resource usage is accounted by the kernel,
+    # limits (as memory.max or cpu.max) apply to the whole tree of processes
+    # and the whole tree can be killed at once with cgroup.kill.
+    #
+    # give the path of the parent cgroup as the :cgroup option to create a
+    # cgroup for each child (removed once the child exits) or else give a
+    # Cgroup created here to place a batch of children in the same cgroup
+    # (removed by the caller). when cgroup v2 is not mounted or the parent is
+    # not writable (or a limit cannot be applied), children run without a
+    # cgroup and interrupt falls back to signals.
+    class Cgroup
+
+      # usage read from the cgroup's interface files; nil where unavailable.
+      Stats = ::Struct.new(
+        :cpu_usage_usec, :cpu_user_usec, :cpu_system_usec,
+        :memory_current_bytes, :memory_peak_bytes,
+        :io_read_bytes, :io_write_bytes)
+
+      # limits that may be given, by name, as written to the interface file
+      # of the same name (with dots for underscores).
+      LIMIT_NAMES = [:cpu_max, :cpu_weight, :io_max, :memory_high, :memory_max,
+                     :memory_swap_max, :pids_max]
+
+      # cpu.max period when given as a count of CPUs.
+      CPU_PERIOD_USEC = 100_000
+
+      # how long to wait for killed processes to leave before removing.
+      REMOVE_WAIT_SECONDS = 0.05
+
+      @sequence = 0
+      @stale_paths = []
+      @lock = ::Mutex.new
+
+      attr_reader :path
+
+      # @return [String] mount point of the cgroup v2 (unified) hierarchy or
+      #   nil if not mounted
+      def self.mount_point
+        if @mount_point.nil?
+          @mount_point = false
+          begin
+            ::File.foreach('/proc/self/mountinfo') do |line|
+              # optional fields end with a lone hyphen before the type.
+              fields, source = line.split(' - ', 2)
+              if source && 'cgroup2' == source.split(' ').first
+                @mount_point = fields.split(' ')[4]
+                break
+              end
+            end
+          rescue ::SystemCallError
+            # not linux or no /proc
+          end
+        end
+        @mount_point || nil
+      end
+
+      # Creates a new cgroup under the given parent.
+      #
+      # === Parameters
+      # @param [String] parent_path of delegated cgroup as absolute path or as
+      #   path relative to the cgroup v2 mount point
+      # @param [Hash] limits to apply as numbers, strings or (for :cpu_max) a
+      #   count of CPUs as Float; see LIMIT_NAMES
+      #
+      # === Return
+      # @return [Cgroup] new cgroup or nil if cgroups are unavailable
+      #
+      # === Raise
+      # @raise [ArgumentError] for invalid limits
+      def self.create(parent_path, limits = {})
+        limit_values = limit_values_for(limits)
+        return nil unless mount = mount_point
+        parent_path = ::File.expand_path(parent_path.to_s, mount)
+        unless parent_path == mount || parent_path.start_with?(mount + '/')
+          raise ::ArgumentError, "cgroup must be under #{mount}: #{parent_path.inspect}"
+        end
+        remove_stale
+        name = @lock.synchronize { "right_popen-#{::Process.pid}-#{@sequence += 1}" }
+        path = ::File.join(parent_path, name)
+        begin
+          ::Dir.mkdir(path)
+        rescue ::SystemCallError
+          return nil
+        end
+        cgroup = new(path)
+        begin
+          unless ::File.writable?(::File.join(path, 'cgroup.procs'))
+            raise ::Errno::EACCES, path
+          end
+          limit_values.each { |file_name, value| cgroup.write(file_name, value) }
+        rescue ::SystemCallError
+          cgroup.remove
+          return nil
+        end
+        cgroup
+      end
+
+      # === Parameters
+      # @param [String] path of existing cgroup
+      def initialize(path)
+        @path = path
+      end
+
+      # Moves the current process into this cgroup (as the child does before
+      # exec).
+      #
+      # === Return
+      # @return [TrueClass] always true
+      #
+      # === Raise
+      # @raise [SystemCallError] on failure
+      def join
+        write('cgroup.procs', ::Process.pid)
+      end
+
+      # @return [TrueClass|FalseClass] true if any process remains in this
+      #   cgroup (or its descendants)
+      def populated?
+        !!(read('cgroup.events') =~ /^populated 1$/)
+      end
+
+      # Kills all processes in this cgroup (and its descendants) at once.
+      #
+      # === Return
+      # @return [TrueClass|FalseClass] true if killed or else false if
+      #   cgroup.kill is unavailable (before linux 5.14)
+      def kill
+        write('cgroup.kill', 1)
+      rescue ::SystemCallError
+        false
+      end
+
+      # @return [Stats] usage of all processes that have run in this cgroup
+      def stats
+        cpu = keyed_values(read('cpu.stat'))
+        io_read_bytes = io_write_bytes = nil
+        if io = read('io.stat')
+          io_read_bytes = io.scan(/\brbytes=(\d+)/).inject(0) { |sum, bytes| sum + bytes.first.to_i }
+          io_write_bytes = io.scan(/\bwbytes=(\d+)/).inject(0) { |sum, bytes| sum + bytes.first.to_i }
+        end
+        Stats.new(
+          cpu['usage_usec'], cpu['user_usec'], cpu['system_usec'],
+          integer_from(read('memory.current')), integer_from(read('memory.peak')),
+          io_read_bytes, io_write_bytes)
+      end
+
+      # Removes this cgroup, first killing any processes that remain if asked.
+      # a cgroup that cannot be removed yet is retried when the next cgroup is
+      # created.
+      #
+      # === Parameters
+      # @param [TrueClass|FalseClass] kill_remaining as true to kill any process
+      #   left in the cgroup
+      #
+      # === Return
+      # @return [TrueClass|FalseClass] true if removed
+      def remove(kill_remaining = false)
+        if kill_remaining && populated? && kill
+          deadline = ::RightScale::RightPopen.monotonic_time + REMOVE_WAIT_SECONDS
+          while populated? && ::RightScale::RightPopen.monotonic_time < deadline
+            sleep 0.001
+          end
+        end
+        return true if self.class.remove_path(@path)
+        self.class.stale(@path)
+        false
+      end
+
+      # writes a value to the interface file of the given name.
+      def write(file_name, value)
+        ::File.open(::File.join(@path, file_name), ::File::WRONLY) { |f| f.syswrite(value.to_s) }
+        true
+      end
+
+      # @return [Array] pairs of [file_name, value] for the given limits
+      def self.limit_values_for(limits)
+        unless limits.kind_of?(::Hash)
+          raise ::ArgumentError, "cgroup_limits must be a Hash of limit by name: #{limits.inspect}"
+        end
+        limits.map do |name, value|
+          unless LIMIT_NAMES.include?(name)
+            raise ::ArgumentError, "cgroup_limits must be named from #{LIMIT_NAMES.inspect}: #{name.inspect}"
+          end
+          if :cpu_max == name && value.kind_of?(::Float)
+            value = "#{(value * CPU_PERIOD_USEC).round} #{CPU_PERIOD_USEC}"
+          end
+          unless (value.kind_of?(::Integer) && value >= 0) || value.kind_of?(::String)
+            raise ::ArgumentError, "cgroup_limits #{name} must be a non-negative Integer or String: #{value.inspect}"
+          end
+          [name.to_s.tr('_', '.'), value]
+        end
+      end
+
+      # @return [TrueClass|FalseClass] true if removed or already gone
+      def self.remove_path(path)
+        ::Dir.rmdir(path)
+        true
+      rescue ::Errno::ENOENT
+        true
+      rescue ::SystemCallError
+        false
+      end
+
+      # remembers a cgroup to remove later.
+      def self.stale(path)
+        @lock.synchronize { @stale_paths << path }
+        true
+      end
+
+      # retries removal of cgroups whose processes had not yet exited.
+      def self.remove_stale
+        paths = @lock.synchronize do
+          result = @stale_paths
+          @stale_paths = []
+          result
+        end
+        paths.each { |path| stale(path) unless remove_path(path) }
+        true
+      end
+
+      protected
+
+      # @return [String] content of the given interface file or nil if absent
+      def read(file_name)
+        ::File.read(::File.join(@path, file_name))
+      rescue ::SystemCallError
+        nil
+      end
+
+      def keyed_values(text)
+        values = {}
+        text.to_s.each_line do |line|
+          key, value = line.split(' ', 2)
+          values[key] = value.to_i if value
+        end
+        values
+      end
+
+      def integer_from(text)
+        text && text =~ /\A\d+/ ? text.to_i : nil
+      end
+    end
+  end
+end
@@ -24,7 +24,7 @@
 require 'rubygems'
 require 'right_popen'
 require 'eventmachine'
-require 'yaml'
+require 'right_popen/async_timers'
 
 module RightScale::RightPopen
 
@@ -32,13 +32,14 @@ module RightScale::RightPopen
   raise "#{StatusHandler.name} is already defined" if defined?(StatusHandler)
 
   module StatusHandler
-    def initialize(file_handle, target)
+    def initialize(file_handle, target, process = nil)
       # Voodoo to make sure that Ruby doesn't gc the file handle
       # (closing the stream) before we're done with it.  No, oddly
       # enough EventMachine is not good about holding on to this
       # itself.
       @handle = file_handle
       @target = target
+      @process = process
       @data = ""
     end
 
@@ -60,15 +61,12 @@ module RightScale::RightPopen
 
     def unbind
       if @data.size > 0
-        error_data = ::YAML.load(@data)
-        status_fd_error = ::RightScale::RightPopen::ProcessError.new(
-          "#{error_data['class']}: #{error_data['message']}")
-        if error_data['backtrace']
-          status_fd_error.set_backtrace(error_data['backtrace'])
-        end
+        status_fd_error = ::RightScale::RightPopen::ExecFailure.decode(@data)
         if @target
           @target.async_exception_handler(status_fd_error) rescue nil
         end
+      elsif @process
+        @process.instrument(:exec_completed)
       end
     end
   end
@@ -77,17 +75,20 @@ module RightScale::RightPopen
   raise "#{PipeHandler.name} is already defined" if defined?(PipeHandler)
 
   module PipeHandler
-    def initialize(file_handle, target, handler)
+    def initialize(file_handle, target, handler, process = nil)
       # Voodoo to make sure that Ruby doesn't gc the file handle
       # (closing the stream) before we're done with it.  No, oddly
       # enough EventMachine is not good about holding on to this
       # itself.
       @handle = file_handle
       @target = target
+      @handler = handler
+      @process = process
       @data_handler = @target.method(handler)
     end
 
     def receive_data(data)
+      @process.count_output(@handler, data.bytesize) if @process
       @data_handler.call(data)
     end
 
@@ -132,46 +133,110 @@ module RightScale::RightPopen
     # always create eventables on the main EM thread by using next_tick. this
     # prevents synchronization problems between EM threads.
     ::EM.next_tick do
-      process = nil
-      begin
-        # create process.
-        process = ::RightScale::RightPopen::Process.new(options)
-        process.spawn(cmd, target)
-
-        # connect EM eventables to open streams.
-        handlers = []
-        handlers << ::EM.attach(process.status_fd, ::RightScale::RightPopen::StatusHandler, process.status_fd, target)
-        handlers << ::EM.attach(process.stderr, ::RightScale::RightPopen::PipeHandler, process.stderr, target, :stderr_handler)
-        handlers << ::EM.attach(process.stdout, ::RightScale::RightPopen::PipeHandler, process.stdout, target, :stdout_handler)
+      if governor = options[:governor]
+        ticket = governor.enqueue(options[:priority] || 0)
+        await_admission(governor, ticket, ::RightScale::RightPopen::Governor::MIN_POLL_INTERVAL, target) do |permit|
+          popen3_async_spawn(cmd, target, options, permit)
+        end
+      else
+        popen3_async_spawn(cmd, target, options, nil)
+      end
+    end
+    true
+  end
+
+  # polls for admission by the governor on the shared timer wheel instead of
+  # blocking the EM thread.
+  #
+  # === Parameters
+  # @param [Governor] governor for admission
+  # @param [Governor::Ticket] ticket from enqueue
+  # @param [Numeric] poll_interval as seconds to wait before next attempt
+  # @param [Object] target for handler calls
+  # @yield [permit] called once admitted
+  #
+  # === Return
+  # true:: Always return true
+  def self.await_admission(governor, ticket, poll_interval, target, &callback)
+    if permit = governor.try_acquire(ticket)
+      callback.call(permit)
+    else
+      deadline = ::RightScale::RightPopen.monotonic_time + poll_interval
+      poll_interval = [poll_interval * 2, ::RightScale::RightPopen::Governor::MAX_POLL_INTERVAL].min
+      schedule_async_timer(deadline) do
+        await_admission(governor, ticket, poll_interval, target, &callback)
+      end
+    end
+    true
+  rescue Exception => e
+    governor.cancel(ticket) rescue nil
+    if target
+      target.async_exception_handler(e) rescue nil
+      target.exit_handler(::RightScale::RightPopen::ProcessStatus.new(nil, 1)) rescue nil
+    end
+    true
+  end
+
+  # spawns the process and attaches its streams; see popen3_async_impl.
+  #
+  # === Parameters
+  # @param [String|Array] cmd as shell command or binary to execute
+  # @param [Object] target for handler calls
+  # @param [Hash] options see RightScale.popen3_async for details
+  # @param [Governor::Permit] permit granted by governor or nil
+  #
+  # === Return
+  # true:: Always return true
+  def self.popen3_async_spawn(cmd, target, options, permit)
+    process = nil
+    begin
+      # create process.
+      process = ::RightScale::RightPopen::Process.new(options)
+      process.admit(permit) if permit
+      process.spawn(cmd, target)
+
+      # connect EM eventables to open streams.
+      handlers = []
+      handlers << ::EM.attach(process.status_fd, ::RightScale::RightPopen::StatusHandler, process.status_fd, target, process)
+      handlers << ::EM.attach(process.stderr, ::RightScale::RightPopen::PipeHandler, process.stderr, target, :stderr_handler, process)
+      handlers << ::EM.attach(process.stdout, ::RightScale::RightPopen::PipeHandler, process.stdout, target, :stdout_handler, process)
+
+      # only attach stdin when streaming input; otherwise close it now to
+      # save an eventable and a descriptor for the life of each child.
+      if options[:input]
         handlers << ::EM.attach(process.stdin, ::RightScale::RightPopen::InputHandler, process.stdin, options[:input])
+      else
+        process.stdin.close
+      end
 
-        target.pid_handler(process.pid)
+      target.pid_handler(process.pid)
 
-        # initial watch callback.
-        #
-        # note that we cannot abandon async watch; callback needs to interrupt
-        # in this case
-        target.watch_handler(process)
+      # initial watch callback.
+      #
+      # note that we cannot abandon async watch; callback needs to interrupt
+      # in this case
+      target.watch_handler(process)
 
-        # periodic watcher.
-        watch_process(process, 0.1, target, handlers)
-      rescue Exception => e
-        # we can't raise from the main EM thread or it will stop EM.
-        # the spawn method will signal the exit handler but not the
-        # pid handler in this case since there is no pid. any action
-        # (logging, etc.) associated with the failure will have to be
-        # driven by the exit handler.
-        if target
-          target.async_exception_handler(e) rescue nil
-          target.exit_handler(process.status) rescue nil if process
-        end
+      # periodic watcher.
+      watch_process(process, 0.1, target, handlers)
+    rescue Exception => e
+      # we can't raise from the main EM thread or it will stop EM.
+      # the spawn method will signal the exit handler but not the
+      # pid handler in this case since there is no pid. any action
+      # (logging, etc.) associated with the failure will have to be
+      # driven by the exit handler.
+      if target
+        target.async_exception_handler(e) rescue nil
+        target.exit_handler(process.status) rescue nil if process
       end
     end
     true
   end
 
   # watches process for exit or interrupt criteria. doubles the wait time up to
-  # a maximum of 1 second for next wait.
+  # a maximum of 1 second for next wait. the watches of all processes share a
+  # timer wheel driven by a single EM timer for the earliest deadline instead
+  # of each process holding its own chain of EM timers.
   #
   # === Parameters
   # @param [Process] process that was run
@@ -182,10 +247,13 @@ module RightScale::RightPopen
   # === Return
   # true:: Always return true
   def self.watch_process(process, wait_time, target, handlers)
-    ::EM::Timer.new(wait_time) do
+    ::RightScale::RightPopen.schedule_async_timer(process.next_check_time(wait_time)) do
       begin
         if process.alive?
-          if process.timer_expired? || process.size_limit_exceeded?
+          if sample = process.sample_resources
+            target.resource_handler(sample)
+          end
+          if process.timer_expired? || process.size_limit_exceeded? || process.resource_limit_exceeded?
             process.interrupt
           else
             # cannot abandon async watch; callback needs to interrupt in this case
@@ -194,10 +262,13 @@ module RightScale::RightPopen
           watch_process(process, [wait_time * 2, 1].min, target, handlers)
         else
           handlers.each { |h| h.drain_and_close rescue nil }
+          process.instrument(:drained)
           process.wait_for_exit_status
           target.timeout_handler rescue nil if process.timer_expired?
           target.size_limit_handler rescue nil if process.size_limit_exceeded?
+          target.resource_limit_handler(process.resource_limit_sample) rescue nil if process.resource_limit_exceeded?
           target.exit_handler(process.status) rescue nil
+          process.instrument_finished
         end
       rescue Exception => e
         # we can't raise from the main EM thread or it will stop EM.
@@ -24,16 +24,67 @@
 require 'rubygems'
 require 'etc'
 require 'fcntl'
-require 'yaml'
+require 'io/wait'
 require 'right_popen'
+require 'right_popen/exec_failure'
 require 'right_popen/process_base'
+require 'right_popen/linux/cgroup'
+require 'right_popen/linux/scheduling'
+require 'right_popen/linux/resource_limits'
+require 'right_popen/linux/resource_sampler'
 
 module RightScale
   module RightPopen
     class Process < ::RightScale::RightPopen::ProcessBase
 
+      # struct rusage is two timevals followed by fourteen longs.
+      RUSAGE_LONG_COUNT = 18
+
+      # pidfd_open has the same number on all architectures (linux 5.3+).
+      PIDFD_OPEN_SYSCALL = 434
+
+      # @return [Cgroup] cgroup in which the child was placed or nil
+      attr_reader :cgroup
+
       def initialize(options={})
         super(options)
+        @rlimit_signals = ::RightScale::RightPopen::ResourceLimits.signals_for(@options[:rlimits])
+        @cgroup = nil
+        @owns_cgroup = false
+      end
+
+      # @return [Fiddle::Function] wait4 from libc or nil if unavailable
+      def self.wait4_function
+        if @wait4_function.nil?
+          @wait4_function = false
+          begin
+            require 'fiddle'
+            @wait4_function = ::Fiddle::Function.new(
+              ::Fiddle.dlopen(nil)['wait4'],
+              [::Fiddle::TYPE_INT, ::Fiddle::TYPE_VOIDP, ::Fiddle::TYPE_INT, ::Fiddle::TYPE_VOIDP],
+              ::Fiddle::TYPE_INT)
+          rescue ::LoadError, ::StandardError
+            # fall back to waitpid2 without resource usage.
+          end
+        end
+        @wait4_function || nil
+      end
+
+      # @return [Fiddle::Function] syscall from libc or nil if unavailable
+      def self.syscall_function
+        if @syscall_function.nil?
+          @syscall_function = false
+          begin
+            require 'fiddle'
+            @syscall_function = ::Fiddle::Function.new(
+              ::Fiddle.dlopen(nil)['syscall'],
+              [::Fiddle::TYPE_LONG, ::Fiddle::TYPE_LONG, ::Fiddle::TYPE_LONG],
+              ::Fiddle::TYPE_LONG)
+          rescue ::LoadError, ::StandardError
+            # fall back to waitpid2 without resource usage.
+          end
+        end
+        @syscall_function || nil
       end
 
       # Determines if the process is still running.
@@ -45,16 +96,51 @@ module RightScale
           raise ::RightScale::RightPopen::ProcessError, 'Process not started'
         end
         unless @status
-          begin
-            ignored, status = ::Process.waitpid2(@pid, ::Process::WNOHANG)
-            @status = status
-          rescue
-            wait_for_exit_status
+          if @wait_thread
+            # exit is being awaited by the exit notification thread, which
+            # may still be finishing after it has signalled exit.
+            wait_for_exit_status if @exit_signalled || !@wait_thread.alive?
+          else
+            begin
+              @status = reap(::Process::WNOHANG)
+              on_exit_detected if @status
+            rescue
+              wait_for_exit_status
+            end
           end
         end
         @status.nil?
       end
 
+      # Linux waits for exit on a separate thread (which can be killed, as at
+      # interpreter shutdown, because it waits on a pidfd or in waitpid) and
+      # then closes a pipe to wake up any IO.select on the notification.
+      #
+      # === Return
+      # @return [IO] exit notification or nil if already exited
+      def exit_notification
+        unless @pid
+          raise ::RightScale::RightPopen::ProcessError, 'Process not started'
+        end
+        if @exit_notification.nil? && @wait_thread.nil? && @status.nil?
+          exit_r, exit_w = ::IO.pipe
+          @exit_notification = exit_r
+          @wait_thread = ::Thread.new do
+            status = nil
+            begin
+              status = reap
+            rescue
+              # ignored
+            ensure
+              @exit_signalled = true
+              exit_w.close rescue nil
+            end
+            status
+          end
+        end
+        @exit_notification
+      end
+
       # Linux must only read streams that are selected for read, even on child
       # death. the issue is that a child process can (inexplicably) close one of
       # the streams but continue writing to the other and this will cause the
@@ -71,6 +157,24 @@ module RightScale
         ['INT', 'TERM', 'KILL']
       end
 
+      # Waits until the child has exited (without reaping it) by waiting for
+      # its pidfd to become readable. the wait goes through the Fiber.scheduler
+      # when the current thread has one and can otherwise be interrupted as
+      # any other IO wait.
+      #
+      # === Parameters
+      # @param [Numeric] timeout in seconds or nil to wait indefinitely
+      #
+      # === Return
+      # @return [TrueClass|FalseClass] true if exited, false on timeout or nil
+      #   if pidfd is unavailable (before linux 5.3) and caller must wait by
+      #   other means
+      def await_exit(timeout = nil)
+        return true if @status
+        return nil unless pidfd = exit_pidfd
+        !!(timeout ? pidfd.wait_readable(timeout) : pidfd.wait_readable)
+      end
+
       # blocks waiting for process exit status.
       #
       # === Return
@@ -80,12 +184,16 @@ module RightScale
           raise ::RightScale::RightPopen::ProcessError, 'Process not started'
         end
         unless @status
-          begin
-            ignored, status = ::Process.waitpid2(@pid)
-            @status = status
-          rescue
-            # ignored
+          if @wait_thread
+            @status = @wait_thread.value
+          else
+            begin
+              @status = reap
+            rescue
+              # ignored
+            end
           end
+          on_exit_detected
         end
         @status
       end
@@ -103,27 +211,49 @@ module RightScale
       # @return [TrueClass] always true
       def spawn(cmd, target)
         super(cmd, target)
+        @exit_signalled = false
+        @exit_pidfd = nil
+
+        # validate before fork so that invalid options raise to the caller.
+        if ::RightScale::RightPopen::Scheduling.requested?(@options)
+          scheduling = ::RightScale::RightPopen::Scheduling.new(@options)
+        end
+        if ::RightScale::RightPopen::ResourceLimits.requested?(@options)
+          rlimits = ::RightScale::RightPopen::ResourceLimits.new(@options)
+        end
+        if ::RightScale::RightPopen::ResourceSampler.requested?(@options)
+          sampler = ::RightScale::RightPopen::ResourceSampler.new(@options)
+        end
+        acquire_permit
+        instrument(:admitted) if @permit
 
         # garbage collect any open file descriptors from past executions before
         # forking to prevent them being inherited. also reduces memory footprint
         # since forking will duplicate everything in memory for child process.
         ::GC.start
+        instrument(:gc_finished)
 
-        # create pipes.
-        stdin_r, stdin_w = IO.pipe
-        stdout_r, stdout_w = IO.pipe
+        # runs as if no cgroup were requested when cgroups are unavailable.
+        cgroup = @cgroup = cgroup_for_spawn
+
+        # create pipes. a given :stdin_io or :stdout_io (such as one end of a
+        # pipe to another child) is connected directly instead and remains
+        # owned by the caller.
+        stdin_r, stdin_w = @options[:stdin_io] ? [@options[:stdin_io], nil] : IO.pipe
+        stdout_r, stdout_w = @options[:stdout_io] ? [nil, @options[:stdout_io]] : IO.pipe
         stderr_r, stderr_w = IO.pipe
         status_r, status_w = IO.pipe
 
         [stdin_r, stdin_w, stdout_r, stdout_w,
-         stderr_r, stderr_w, status_r, status_w].each {|fdes| fdes.sync = true}
+         stderr_r, stderr_w, status_r, status_w].compact.each {|fdes| fdes.sync = true}
 
         @pid = ::Kernel::fork do
+          stage = :setup_io
           begin
-            stdin_w.close
+            stdin_w.close if stdin_w
             ::STDIN.reopen stdin_r
 
-            stdout_r.close
+            stdout_r.close if stdout_r
             ::STDOUT.reopen stdout_w
 
             stderr_r.close
@@ -142,28 +272,46 @@ module RightScale
               end
             end
 
+            # join before anything else runs so that all of the child's
+            # usage is accounted by (and limited by) its cgroup.
+            stage = :cgroup
+            cgroup.join if cgroup
+
+            # apply before changing user in case raising priority (which
+            # requires privilege) was requested.
+            stage = :scheduling
+            scheduling.apply if scheduling
+
+            stage = :rlimits
+            rlimits.apply if rlimits
+
+            stage = :group
             if group = get_group
               ::Process.egid = group
               ::Process.gid = group
             end
 
+            stage = :user
             if user = get_user
               ::Process.euid = user
               ::Process.uid = user
             end
 
+            stage = :umask
             if umask = get_umask
               ::File.umask(umask)
             end
 
             # avoid chdir when pwd is already correct due to asinine printed
             # warning from chdir block for what is basically a no-op.
+            stage = :directory
             working_directory = @options[:directory]
             if working_directory &&
                ::File.expand_path(working_directory) != ::File.expand_path(::Dir.pwd)
               ::Dir.chdir(working_directory)
             end
 
+            stage = :environment
             environment_hash = {}
             environment_hash['LC_ALL'] = 'C' if @options[:locale]
             environment_hash.merge!(@options[:environment]) if @options[:environment]
@@ -171,6 +319,7 @@ module RightScale
               ::ENV[key.to_s] = value.nil? ? nil: value.to_s
             end
 
+            stage = :exec
             if cmd.kind_of?(Array)
               cmd = cmd.map { |c| c.to_s } #exec only likes string arguments
               exec(*cmd)
@@ -179,21 +328,17 @@ module RightScale
             end
             raise 'Unreachable code'
           rescue ::Exception => e
-            # note that Marshal.dump/load isn't reliable for all kinds of
-            # exceptions or else can be truncated by I/O buffering.
-            error_data = {
-              'class' => e.class.name,
-              'message' => e.message,
-              'backtrace' => e.backtrace
-            }
-            status_w.puts(::YAML.dump(error_data))
+            # one write of a record smaller than PIPE_BUF is atomic so the
+            # parent reads it whole (see ExecFailure).
+            status_w.syswrite(::RightScale::RightPopen::ExecFailure.encode(stage, e)) rescue nil
           end
           status_w.close
           exit!
         end
 
-        stdin_r.close
-        stdout_w.close
+        instrument(:forked)
+        stdin_r.close unless @options[:stdin_io]
+        stdout_w.close unless @options[:stdout_io]
         stderr_w.close
         status_w.close
         @stdin = stdin_w
@@ -201,15 +346,150 @@ module RightScale
         @stderr = stderr_r
         @status_fd = status_r
         start_timer
+        if sampler
+          sampler.start(@pid)
+          @sampler = sampler
+          @next_sample_at = @spawned_at + sampler.interval
+        end
+        instrument(:spawned)
         true
       rescue
         # catch-all for failure to spawn process ensuring a non-nil status. the
         # PID most likely is nil but the exit handler can be invoked for async.
         safe_close_io
         @status = ::RightScale::RightPopen::ProcessStatus.new(@pid, 1)
+        release_permit
+        release_cgroup
         raise
       end
 
+      protected
+
+      # === Return
+      # @return [Cgroup] cgroup for the child as given by the :cgroup option
+      #   or nil if none (or if cgroups are unavailable)
+      #
+      # === Raise
+      # @raise [ArgumentError] for invalid options
+      def cgroup_for_spawn
+        case cgroup = @options[:cgroup]
+        when nil, false
+          raise ::ArgumentError, 'cgroup_limits require a cgroup' if @options[:cgroup_limits]
+          nil
+        when ::RightScale::RightPopen::Cgroup
+          if @options[:cgroup_limits]
+            raise ::ArgumentError, 'cgroup_limits must be given to Cgroup.create for a shared cgroup'
+          end
+          cgroup
+        else
+          cgroup = ::RightScale::RightPopen::Cgroup.create(cgroup, @options[:cgroup_limits] || {})
+          @owns_cgroup = !!cgroup
+          cgroup
+        end
+      end
+
+      # kills the whole tree of processes at once when the child has a cgroup
+      # of its own; otherwise signals the child alone.
+      def send_interrupt(signal)
+        if 'KILL' == signal && @owns_cgroup && @cgroup.kill
+          true
+        else
+          super
+        end
+      end
+
+      def on_exit_detected
+        release_cgroup
+        super
+      end
+
+      # removes the child's own cgroup once it has exited, first killing any
+      # process it left behind if it was interrupted.
+      def release_cgroup
+        if @owns_cgroup
+          @owns_cgroup = false
+          @cgroup.remove(interrupted?)
+        end
+        true
+      end
+
+      # @return [IO] pidfd of the child or nil if unavailable
+      def exit_pidfd
+        if @exit_pidfd.nil?
+          @exit_pidfd = false
+          if (syscall = self.class.syscall_function) &&
+             (fd = syscall.call(PIDFD_OPEN_SYSCALL, @pid, 0)) >= 0
+            @exit_pidfd = ::IO.for_fd(fd)
+          end
+        end
+        @exit_pidfd || nil
+      end
+
+      def close_exit_pidfd
+        @exit_pidfd.close if @exit_pidfd && !@exit_pidfd.closed?
+        true
+      end
+
+      # reaps the child with its resource usage using wait4 (or else waitpid2
+      # when fiddle is unavailable). wait4 cannot be interrupted (by Thread#kill
+      # or at shutdown) so a blocking reap first waits for exit on the pidfd and
+      # then reaps without blocking. waitpid2 (without resource usage) blocks
+      # when there is no pidfd.
+      #
+      # === Parameters
+      # @param [Integer] flags as zero to block or WNOHANG
+      #
+      # === Return
+      # @return [ProcessStatus] status or nil if running (given WNOHANG)
+      #
+      # === Raise
+      # @raise [SystemCallError] on failure to wait
+      def reap(flags = 0)
+        details = { :spawned_at => @spawned_at, :output_counters => @output_counters }
+        wait4 = self.class.wait4_function
+        if wait4 && 0 == (flags & ::Process::WNOHANG)
+          if await_exit
+            flags |= ::Process::WNOHANG
+          else
+            wait4 = nil
+          end
+        end
+        if wait4
+          raw_status = [0].pack('i!')
+          usage = "\0" * (RUSAGE_LONG_COUNT * [0].pack('l!').bytesize)
+          while (result = wait4.call(@pid, raw_status, flags, usage)) < 0
+            errno = ::Fiddle.last_error
+            raise ::SystemCallError.new('wait4', errno) unless ::Errno::EINTR::Errno == errno
+          end
+          return nil if 0 == result
+          close_exit_pidfd
+          details[:exited_at] = ::RightScale::RightPopen.monotonic_time
+          details[:cgroup_stats] = @cgroup.stats if @cgroup
+          details[:rusage] = rusage_from(usage.unpack("l!#{RUSAGE_LONG_COUNT}"))
+          ::RightScale::RightPopen::ProcessStatus.from_raw_status(
+            @pid, raw_status.unpack('i!').first, details)
+        else
+          ignored, status = ::Process.waitpid2(@pid, flags)
+          return nil unless status
+          close_exit_pidfd
+          details[:exited_at] = ::RightScale::RightPopen.monotonic_time
+          details[:cgroup_stats] = @cgroup.stats if @cgroup
+          details[:raw_status] = status.to_i
+          ::RightScale::RightPopen::ProcessStatus.new(
+            @pid, status.exitstatus, status.termsig, details)
+        end
+      end
+
+      def rusage_from(values)
+        ::RightScale::RightPopen::ProcessStatus::Rusage.new(
+          values[0] + values[1] / 1_000_000.0,
+          values[2] + values[3] / 1_000_000.0,
+          values[4],
+          values[8], values[9],
+          values[11], values[12],
+          values[16], values[17])
+      end
+
       private
 
       def get_user
@@ -0,0 +1,144 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+
+module RightScale
+  module RightPopen
+
+    # Sets kernel-enforced resource limits (see setrlimit(2)) on a child
+    # process before exec so that the kernel, rather than the parent's watch,
+    # stops a child that exceeds them. limits are validated in the parent
+    # before fork so that invalid options raise to the caller; only the system
+    # calls are made in the child.
+    #
+    # a child killed by SIGXCPU (CPU time) or SIGXFSZ (file size) is reported
+    # as a timeout or as exceeding the size limit, respectively (see
+    # ProcessBase#timer_expired? and ProcessBase#size_limit_exceeded?). the
+    # same goes for a shell command that exits with 128 plus the signal since
+    # the signal then kills a command run by the shell rather than the shell.
+    class ResourceLimits
+
+      # limits that may be given, by name.
+      RESOURCE_NAMES = [:as, :core, :cpu, :fsize, :nofile, :nproc]
+
+      # signal sent by the kernel when a soft limit is exceeded.
+      SIGNAL_NAMES = { :cpu => 'XCPU', :fsize => 'XFSZ' }
+
+      # @return [TrueClass|FalseClass] true if any limit is given
+      def self.requested?(options)
+        rlimits = options[:rlimits]
+        !(rlimits.nil? || (rlimits.respond_to?(:empty?) && rlimits.empty?))
+      end
+
+      # @return [Symbol] resource name for the given key (as :cpu, 'CPU' or
+      #   :RLIMIT_CPU) or nil if unknown
+      def self.resource_name_for(key)
+        name = key.to_s.downcase.sub(/\Arlimit_/, '').to_sym
+        RESOURCE_NAMES.include?(name) ? name : nil
+      end
+
+      # @return [Hash] signal number by resource name for limits given in the
+      #   :rlimits option which the kernel enforces by signal
+      def self.signals_for(rlimits)
+        signals = {}
+        if rlimits.respond_to?(:keys)
+          rlimits.keys.each do |key|
+            name = resource_name_for(key)
+            if (signal_name = SIGNAL_NAMES[name]) && (signal = ::Signal.list[signal_name])
+              signals[name] = signal
+            end
+          end
+        end
+        signals
+      end
+
+      # === Parameters
+      # @param [Hash] options see RightScale.popen3_async for details
+      #
+      # === Raise
+      # @raise [ArgumentError] for invalid limits
+      # @raise [NotImplementedError] if unsupported on this system
+      def initialize(options)
+        rlimits = options[:rlimits]
+        unless rlimits.kind_of?(::Hash)
+          raise ::ArgumentError, "rlimits must be a Hash of limit by name: #{rlimits.inspect}"
+        end
+        unless ::Process.respond_to?(:setrlimit)
+          raise ::NotImplementedError, 'rlimits are not supported on this system'
+        end
+        @limits = rlimits.map do |key, value|
+          unless name = self.class.resource_name_for(key)
+            raise ::ArgumentError, "rlimits must be named from #{RESOURCE_NAMES.inspect}: #{key.inspect}"
+          end
+          constant_name = "RLIMIT_#{name.to_s.upcase}"
+          unless ::Process.const_defined?(constant_name)
+            raise ::NotImplementedError, "#{constant_name} is not supported on this system"
+          end
+          [::Process.const_get(constant_name)] + limits_for(name, value)
+        end
+      end
+
+      # Applies limits to the current (child) process. raises on failure (as
+      # for raising a hard limit without privilege), which is reported to the
+      # parent as for any failure to execute.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def apply
+        @limits.each { |resource, soft, hard| ::Process.setrlimit(resource, soft, hard) }
+        true
+      end
+
+      protected
+
+      # accepts a limit (as Integer or :infinity) or else [soft, hard]. a lone
+      # CPU limit leaves one more second before the hard limit so that the
+      # kernel sends SIGXCPU (which is reported) before SIGKILL.
+      def limits_for(name, value)
+        soft, hard = value.kind_of?(::Array) ? value : [value, nil]
+        soft = limit_for(name, soft, value)
+        if hard.nil?
+          hard = (:cpu == name && soft != ::Process::RLIM_INFINITY) ? soft + 1 : soft
+        else
+          hard = limit_for(name, hard, value)
+        end
+        if hard != ::Process::RLIM_INFINITY &&
+           (soft == ::Process::RLIM_INFINITY || soft > hard)
+          raise ::ArgumentError, "rlimits #{name} soft limit must not exceed hard limit: #{value.inspect}"
+        end
+        [soft, hard]
+      end
+
+      def limit_for(name, limit, value)
+        return ::Process::RLIM_INFINITY if :infinity == limit
+        unless limit.kind_of?(::Integer) && limit >= 0
+          raise ::ArgumentError,
+                "rlimits #{name} must be a non-negative Integer, :infinity or [soft, hard]: #{value.inspect}"
+        end
+        limit
+      end
+    end
+  end
+end
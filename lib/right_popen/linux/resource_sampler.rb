@@ -0,0 +1,266 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'etc'
+require 'right_popen'
+
+module RightScale
+  module RightPopen
+
+    # Periodically samples the memory, CPU and I/O usage of a child process
+    # (and optionally of its descendants) from /proc and checks them against
+    # the resource limits given in options.
+    #
+    # the /proc files of each sampled process are opened once and then reread
+    # from offset zero on every sample so that each sample costs a few reads
+    # instead of path lookups. an open /proc file refers to the process itself
+    # rather than to its PID so a reused PID is never sampled by mistake.
+    class ResourceSampler
+
+      LIMIT_NAMES = [:max_rss_bytes, :max_cpu_seconds, :max_io_bytes]
+
+      DEFAULT_INTERVAL_SECONDS = 1.0
+
+      # large enough for any of the /proc files read.
+      PROC_READ_SIZE = 4096
+
+      CLOCK_TICKS_PER_SECOND = (::Etc.sysconf(::Etc::SC_CLK_TCK) rescue nil) || 100
+      PAGE_SIZE = (::Etc.sysconf(::Etc::SC_PAGESIZE) rescue nil) || 4096
+
+      # resource usage of the child (and its descendants when sampling the
+      # process tree) at one point in time. cpu_seconds includes the time of
+      # descendants that have exited and been waited for. exceeded_limit is the
+      # name of the first limit exceeded by this sample (if any).
+      Sample = ::Struct.new(
+        :sampled_at,
+        :process_count,
+        :rss_bytes,
+        :cpu_seconds,
+        :io_read_bytes,
+        :io_write_bytes,
+        :exceeded_limit) do
+
+        # @return [Integer] total bytes read from and written to storage
+        def io_bytes; io_read_bytes + io_write_bytes; end
+      end
+
+      # the open /proc files of one sampled process.
+      class Source
+        attr_reader :pid, :io_read_bytes, :io_write_bytes
+
+        def initialize(pid)
+          @pid = pid
+          @io_read_bytes = 0
+          @io_write_bytes = 0
+          @stat = ::File.open("/proc/#{pid}/stat", 'rb')
+          begin
+            @statm = ::File.open("/proc/#{pid}/statm", 'rb')
+            @children = ::File.open("/proc/#{pid}/task/#{pid}/children", 'rb') rescue nil
+            @io = ::File.open("/proc/#{pid}/io", 'rb') rescue nil
+          rescue
+            close
+            raise
+          end
+        end
+
+        # @return [Array] tuple of [cpu_seconds, rss_bytes] or nil if gone
+        def read_usage
+          # fields following the command name in parentheses (which may itself
+          # contain spaces) starting from the process state.
+          stat = reread(@stat)
+          fields = stat[(stat.rindex(')') + 2)..-1].split(' ')
+          ticks = fields[11].to_i + fields[12].to_i + fields[13].to_i + fields[14].to_i
+          rss_pages = reread(@statm).split(' ')[1].to_i
+          if @io
+            begin
+              io = reread(@io)
+              @io_read_bytes = io[/^read_bytes:\s*(\d+)/, 1].to_i
+              @io_write_bytes = io[/^write_bytes:\s*(\d+)/, 1].to_i
+            rescue ::SystemCallError
+              # not permitted (e.g. once the child has switched user); I/O is
+              # counted as of the last successful read.
+              @io.close rescue nil
+              @io = nil
+            end
+          end
+          [ticks.to_f / CLOCK_TICKS_PER_SECOND, rss_pages * PAGE_SIZE]
+        rescue ::SystemCallError, ::EOFError, ::IOError
+          nil
+        end
+
+        # @return [Array] PIDs of the children of this process's main thread
+        def read_children
+          @children ? reread(@children).split(' ').map { |pid| pid.to_i } : []
+        rescue ::SystemCallError, ::EOFError, ::IOError
+          []
+        end
+
+        def close
+          [@stat, @statm, @children, @io].each { |file| file.close rescue nil if file }
+          true
+        end
+
+        protected
+
+        def reread(file)
+          file.sysseek(0)
+          file.sysread(PROC_READ_SIZE)
+        end
+      end
+
+      attr_reader :interval, :limits
+
+      # @return [TrueClass|FalseClass] true if sampling is needed for options
+      def self.requested?(options)
+        !!options[:resource_handler] || LIMIT_NAMES.any? { |name| !options[name].nil? }
+      end
+
+      # === Parameters
+      # @param [Hash] options see RightScale.popen3_async for details
+      #
+      # === Raise
+      # @raise [ArgumentError] for invalid options
+      def initialize(options)
+        @interval = options[:sample_interval_seconds] || DEFAULT_INTERVAL_SECONDS
+        unless @interval.kind_of?(::Numeric) && @interval > 0
+          raise ::ArgumentError, "sample_interval_seconds must be a positive number: #{@interval.inspect}"
+        end
+        @limits = {}
+        LIMIT_NAMES.each do |name|
+          next if (limit = options[name]).nil?
+          unless limit.kind_of?(::Numeric) && limit > 0
+            raise ::ArgumentError, "#{name} must be a positive number: #{limit.inspect}"
+          end
+          @limits[name] = limit
+        end
+        @tree = !!options[:sample_process_tree]
+        @sources = {}
+        @root_pid = nil
+        @departed_io_read_bytes = 0
+        @departed_io_write_bytes = 0
+      end
+
+      # Opens the /proc files of the given child.
+      #
+      # === Parameters
+      # @param [Integer] pid of child
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def start(pid)
+        @root_pid = pid
+        @sources[pid] = Source.new(pid)
+        true
+      end
+
+      # Samples resource usage.
+      #
+      # === Parameters
+      # @param [Float] now as monotonic seconds
+      #
+      # === Return
+      # @return [Sample] sample or nil if the child no longer exists
+      def sample(now = ::RightScale::RightPopen.monotonic_time)
+        return nil unless @sources[@root_pid]
+        discover_descendants if @tree
+        cpu_seconds = 0.0
+        rss_bytes = 0
+        io_read_bytes = @departed_io_read_bytes
+        io_write_bytes = @departed_io_write_bytes
+        @sources.values.each do |source|
+          if usage = source.read_usage
+            cpu_seconds += usage[0]
+            rss_bytes += usage[1]
+            io_read_bytes += source.io_read_bytes
+            io_write_bytes += source.io_write_bytes
+          elsif source.pid == @root_pid
+            close
+            return nil
+          else
+            # descendant has exited; its CPU time passes to its parent once it
+            # has been waited for but its I/O must be remembered here.
+            forget(source)
+            io_read_bytes += source.io_read_bytes
+            io_write_bytes += source.io_write_bytes
+          end
+        end
+        sample = Sample.new(
+          now, @sources.size, rss_bytes, cpu_seconds, io_read_bytes, io_write_bytes, nil)
+        sample.exceeded_limit = exceeded_limit(sample)
+        sample
+      end
+
+      # Closes all /proc files (idempotent).
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def close
+        @sources.values.each { |source| source.close }
+        @sources.clear
+        true
+      end
+
+      protected
+
+      # opens any descendant not yet known by walking down from the child.
+      def discover_descendants
+        pending = [@root_pid]
+        until pending.empty?
+          source = @sources[pending.shift]
+          source.read_children.each do |pid|
+            unless @sources[pid]
+              begin
+                @sources[pid] = Source.new(pid)
+              rescue ::SystemCallError
+                next  # already gone
+              end
+            end
+            pending << pid
+          end
+        end
+        true
+      end
+
+      def forget(source)
+        @sources.delete(source.pid)
+        source.close
+        @departed_io_read_bytes += source.io_read_bytes
+        @departed_io_write_bytes += source.io_write_bytes
+        true
+      end
+
+      def exceeded_limit(sample)
+        @limits.each do |name, limit|
+          value = case name
+                  when :max_rss_bytes   then sample.rss_bytes
+                  when :max_cpu_seconds then sample.cpu_seconds
+                  when :max_io_bytes    then sample.io_bytes
+                  end
+          return name if value > limit
+        end
+        nil
+      end
+    end
+  end
+end
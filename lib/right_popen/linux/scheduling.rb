@@ -0,0 +1,194 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'etc'
+require 'rbconfig'
+require 'right_popen'
+
+module RightScale
+  module RightPopen
+
+    # Constrains the CPU and I/O scheduling of a child process. options are
+    # validated (and the system calls resolved) in the parent before fork so
+    # that invalid options raise to the caller; only the system calls are made
+    # in the child before exec.
+    class Scheduling
+
+      OPTION_NAMES = [:cpu_affinity, :nice, :io_priority, :sched_policy]
+
+      # see sched.h
+      SCHED_POLICIES = {
+        :other => 0,
+        :batch => 3,
+        :idle  => 5,
+      }
+
+      # see ioprio.h
+      IO_PRIORITY_CLASSES = {
+        :realtime    => 1,
+        :best_effort => 2,
+        :idle        => 3,
+      }
+      IOPRIO_CLASS_SHIFT = 13
+      IOPRIO_WHO_PROCESS = 1
+
+      # the ioprio_set system call has no libc wrapper.
+      IOPRIO_SET_SYSCALLS = {
+        'x86_64'  => 251,
+        'i386'    => 289,
+        'i686'    => 289,
+        'aarch64' => 30,
+        'arm'     => 314,
+      }
+
+      # @return [TrueClass|FalseClass] true if any scheduling option is given
+      def self.requested?(options)
+        OPTION_NAMES.any? { |name| !options[name].nil? }
+      end
+
+      # === Parameters
+      # @param [Hash] options see RightScale.popen3_async for details
+      #
+      # === Raise
+      # @raise [ArgumentError] for invalid options
+      # @raise [NotImplementedError] if unsupported on this system
+      def initialize(options)
+        @cpu_mask = cpu_mask_for(options[:cpu_affinity])
+        @nice = nice_for(options[:nice])
+        @io_priority = io_priority_for(options[:io_priority])
+        @sched_policy = sched_policy_for(options[:sched_policy])
+        resolve_functions
+      end
+
+      # Applies scheduling to the current (child) process. raises on failure,
+      # which is reported to the parent as for any failure to execute.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def apply
+        if @cpu_mask
+          check('sched_setaffinity', @sched_setaffinity.call(0, @cpu_mask.bytesize, @cpu_mask))
+        end
+        if @sched_policy
+          # non-realtime policies require a static priority of zero.
+          check('sched_setscheduler', @sched_setscheduler.call(0, @sched_policy, [0].pack('i!')))
+        end
+        if @io_priority
+          check('ioprio_set', @syscall.call(@ioprio_set, IOPRIO_WHO_PROCESS, 0, @io_priority))
+        end
+        ::Process.setpriority(::Process::PRIO_PROCESS, 0, @nice) if @nice
+        true
+      end
+
+      protected
+
+      def cpu_mask_for(cpus)
+        return nil if cpus.nil?
+        cpus = [cpus] if cpus.kind_of?(::Integer)
+        count = ::Etc.respond_to?(:nprocessors) ? ::Etc.nprocessors : nil
+        if !cpus.kind_of?(::Array) || cpus.empty? ||
+           cpus.any? { |cpu| !cpu.kind_of?(::Integer) || cpu < 0 || (count && cpu >= count) }
+          raise ::ArgumentError, "cpu_affinity must be one or more CPU numbers from 0 to #{count ? count - 1 : 'N'}: #{cpus.inspect}"
+        end
+
+        # cpu_set_t is an array of unsigned long.
+        bits_per_word = 8 * [0].pack('L!').bytesize
+        words = ::Array.new(cpus.max / bits_per_word + 1, 0)
+        cpus.each { |cpu| words[cpu / bits_per_word] |= 1 << (cpu % bits_per_word) }
+        words.pack('L!*')
+      end
+
+      def nice_for(nice)
+        return nil if nice.nil?
+        unless nice.kind_of?(::Integer) && nice >= -20 && nice <= 19
+          raise ::ArgumentError, "nice must be an Integer from -20 to 19: #{nice.inspect}"
+        end
+        nice
+      end
+
+      # accepts the class alone (at its default level) or [class, level].
+      def io_priority_for(io_priority)
+        return nil if io_priority.nil?
+        klass, level = io_priority
+        level ||= 4
+        unless (klass_value = IO_PRIORITY_CLASSES[klass]) &&
+               level.kind_of?(::Integer) && level >= 0 && level <= 7
+          raise ::ArgumentError,
+                "io_priority must be one of #{IO_PRIORITY_CLASSES.keys.inspect} or else [class, level] with level from 0 to 7: #{io_priority.inspect}"
+        end
+        level = 0 if :idle == klass
+        (klass_value << IOPRIO_CLASS_SHIFT) | level
+      end
+
+      def sched_policy_for(sched_policy)
+        return nil if sched_policy.nil?
+        unless policy = SCHED_POLICIES[sched_policy]
+          raise ::ArgumentError, "sched_policy must be one of #{SCHED_POLICIES.keys.inspect}: #{sched_policy.inspect}"
+        end
+        policy
+      end
+
+      def resolve_functions
+        return true unless @cpu_mask || @sched_policy || @io_priority
+        begin
+          require 'fiddle'
+        rescue ::LoadError
+          raise ::NotImplementedError, 'cpu_affinity, io_priority and sched_policy require fiddle'
+        end
+        libc = ::Fiddle.dlopen(nil)
+        if @cpu_mask
+          @sched_setaffinity = ::Fiddle::Function.new(
+            libc['sched_setaffinity'],
+            [::Fiddle::TYPE_INT, ::Fiddle::TYPE_LONG, ::Fiddle::TYPE_VOIDP],
+            ::Fiddle::TYPE_INT)
+        end
+        if @sched_policy
+          @sched_setscheduler = ::Fiddle::Function.new(
+            libc['sched_setscheduler'],
+            [::Fiddle::TYPE_INT, ::Fiddle::TYPE_INT, ::Fiddle::TYPE_VOIDP],
+            ::Fiddle::TYPE_INT)
+        end
+        if @io_priority
+          unless @ioprio_set = IOPRIO_SET_SYSCALLS[::RbConfig::CONFIG['host_cpu']]
+            raise ::NotImplementedError, "io_priority is not supported on #{::RbConfig::CONFIG['host_cpu']}"
+          end
+          @syscall = ::Fiddle::Function.new(
+            libc['syscall'],
+            [::Fiddle::TYPE_LONG, ::Fiddle::TYPE_INT, ::Fiddle::TYPE_INT, ::Fiddle::TYPE_INT],
+            ::Fiddle::TYPE_LONG)
+        end
+        true
+      end
+
+      def check(name, result)
+        if result < 0
+          # raises the Errno subclass for the error number.
+          errno = ::Fiddle.respond_to?(:last_error) ? ::Fiddle.last_error : 0
+          raise ::SystemCallError.new(name, errno)
+        end
+        true
+      end
+    end
+  end
+end
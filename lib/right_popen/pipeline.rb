@@ -0,0 +1,260 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+
+module RightScale
+
+  module RightPopen
+
+    # Runs a pipeline of commands (as in cmd1 | cmd2 | cmd3) synchronously.
+    # the stdout of each stage is connected to the stdin of the next stage by
+    # a pipe that the parent does not read so data flows between the stages
+    # entirely in the kernel. only the stdout of the last stage and the stderr
+    # of every stage are read. the timeout, size limit and interrupt apply to
+    # all stages as one unit.
+    class Pipeline
+
+      # outcome of running a pipeline.
+      class Result
+        attr_reader :stdout, :stderrs, :statuses
+
+        # === Parameters
+        # @param [String] stdout of last stage
+        # @param [Array] stderrs as error text of each stage
+        # @param [Array] statuses as ProcessStatus of each stage
+        # @param [TrueClass|FalseClass] timed_out as true if the pipeline was interrupted by timeout
+        # @param [TrueClass|FalseClass] size_limit_exceeded as true if the pipeline was interrupted by size limit
+        def initialize(stdout, stderrs, statuses, timed_out, size_limit_exceeded)
+          @stdout = stdout
+          @stderrs = stderrs
+          @statuses = statuses
+          @timed_out = timed_out
+          @size_limit_exceeded = size_limit_exceeded
+        end
+
+        # @return [TrueClass|FalseClass] true if every stage succeeded
+        def success?
+          @statuses.all? { |status| status && status.success? }
+        end
+
+        # @return [TrueClass|FalseClass] true if interrupted by timeout
+        def timed_out?; @timed_out; end
+
+        # @return [TrueClass|FalseClass] true if interrupted by size limit
+        def size_limit_exceeded?; @size_limit_exceeded; end
+
+        # @return [Integer] index of first stage that failed or nil
+        def failed_stage
+          @statuses.index { |status| !(status && status.success?) }
+        end
+      end
+
+      attr_reader :cmds
+
+      # === Parameters
+      # @param [Array] cmds as shell command or binary to execute for each stage
+      # @param [Hash] options see RightScale.popen3_async for details; :input is
+      #   streamed to the first stage and handler options are ignored
+      def initialize(cmds, options = {})
+        raise ::ArgumentError, 'cmds must be a non-empty Array' if !cmds.kind_of?(::Array) || cmds.empty?
+        raise ::NotImplementedError if RUBY_PLATFORM =~ /mswin|mingw/
+        @cmds = cmds
+        @options = ::RightScale::RightPopen::DEFAULT_POPEN3_OPTIONS.merge(options)
+        @interrupted = false
+        ::RightScale::RightPopen.require_popen3_impl(:popen3_sync)
+      end
+
+      # Requests that all stages be interrupted (in increasing degrees of
+      # signalled severity). may be called from any thread.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def interrupt
+        @interrupted = true
+      end
+
+      # Spawns all stages and blocks until all have exited.
+      #
+      # === Return
+      # @return [Result] of pipeline
+      #
+      # === Raise
+      # @raise [ProcessError] if any stage failed to execute its command (once
+      #   all stages have exited)
+      def run
+        processes = []
+        links = []
+        target = ::RightScale::RightPopen::TargetProxy.new
+        stage_options = @options.merge(:input => nil, :timeout_seconds => nil)
+        begin
+          @cmds.each_with_index do |cmd, index|
+            options = stage_options.dup
+            options[:stdin_io] = links.last.first unless links.empty?
+            if index < @cmds.size - 1
+              # never inherited by other stages (even given :inherit_io) or
+              # else a stage would not read EOF.
+              links << ::IO.pipe.each { |io| io.close_on_exec = true }
+              options[:stdout_io] = links.last.last
+            end
+            process = ::RightScale::RightPopen::Process.new(options)
+            processes << process
+            process.spawn(cmd, target)
+          end
+        rescue ::Exception
+          links.flatten.each { |io| io.close rescue nil }
+          processes.each { |process| stop(process) }
+          raise
+        end
+
+        # the stages now hold the only ends of the pipes between them so that
+        # each stage reads EOF once the one before it exits.
+        links.flatten.each { |io| io.close rescue nil }
+        watch(processes)
+      end
+
+      protected
+
+      def watch(processes)
+        deadline = @options[:timeout_seconds] ?
+                   ::RightScale::RightPopen.monotonic_time + @options[:timeout_seconds] :
+                   nil
+        first = processes.first
+        last = processes.last
+        input = @options[:input] ? @options[:input].to_s.dup : nil
+        input.force_encoding(::Encoding::BINARY) if input
+        first.stdin.close unless input
+        @processes = processes
+        @stdout = ''
+        @stderrs = processes.map { '' }
+        @status_data = processes.map { '' }
+        @readers = {}
+        @readers[last.stdout] = [:stdout, nil]
+        processes.each_with_index do |process, index|
+          @readers[process.stderr] = [:stderr, index]
+          @readers[process.status_fd] = [:status, index]
+        end
+        exit_ios = processes.map { |process| process.exit_notification }
+        timed_out = false
+        size_limit_exceeded = false
+        interrupting = false
+        begin
+          # as with popen3_sync, stop reading once all stages have exited even
+          # if a background grandchild still holds one of the streams open.
+          while processes.any? { |process| process.alive? }
+            now = ::RightScale::RightPopen.monotonic_time
+            unless interrupting
+              if deadline && now >= deadline
+                interrupting = timed_out = true
+              elsif first.size_limit_exceeded?
+                interrupting = size_limit_exceeded = true
+              elsif @interrupted
+                interrupting = true
+              end
+            end
+            if interrupting
+              processes.each { |process| process.interrupt if process.alive? }
+            end
+
+            # wake periodically to check limits and for interrupt (which may
+            # be requested by another thread) and exactly at timeout.
+            wait_time = ::RightScale::RightPopen::ProcessBase::WATCH_INTERVAL
+            wait_time = [wait_time, deadline - now].min if deadline && !interrupting
+            wait_time = 0 if wait_time < 0
+            writers = (input && !first.stdin.closed?) ? [first.stdin] : []
+            watched = @readers.keys + exit_ios.compact.reject { |io| io.closed? }
+            ready = ::IO.select(watched, writers, nil, wait_time)
+            next unless ready
+            ready[0].each { |io| read(io, false) if @readers[io] }
+            exit_ios.each do |io|
+              io.close if io && !io.closed? && ready[0].include?(io)
+            end
+            unless ready[1].empty?
+              begin
+                written = first.stdin.write_nonblock(input)
+                input = input.byteslice(written, input.bytesize - written)
+              rescue ::IO::WaitWritable
+                # retry on next select
+              rescue ::Errno::EPIPE
+                input = ''
+              end
+              first.stdin.close if input.empty?
+            end
+          end
+          statuses = processes.map { |process| process.wait_for_exit_status }
+          @readers.keys.each { |io| read(io, true) }
+        ensure
+          processes.each { |process| process.safe_close_io }
+        end
+        @status_data.each do |data|
+          raise first.__send__(:exec_error_from, data) unless data.empty?
+        end
+        Result.new(@stdout, @stderrs, statuses, timed_out, size_limit_exceeded)
+      end
+
+      # reads what is available from the given stream (until it would block if
+      # draining) and forgets the stream at EOF.
+      def read(io, drain)
+        kind, index = @readers[io]
+        begin
+          while true
+            data = io.read_nonblock(::RightScale::RightPopen::ProcessBase::READ_BUFFER_SIZE)
+            case kind
+            when :stdout
+              @processes.last.count_output(:stdout_handler, data.bytesize)
+              @stdout << data
+            when :stderr
+              @processes[index].count_output(:stderr_handler, data.bytesize)
+              @stderrs[index] << data
+            else
+              @status_data[index] << data
+            end
+            break unless drain
+          end
+        rescue ::IO::WaitReadable
+          # retry on next select
+        rescue ::EOFError, ::IOError
+          @readers.delete(io)
+          io.close rescue nil
+        end
+        true
+      end
+
+      # interrupts a stage that was spawned before a later stage failed.
+      def stop(process)
+        if process.pid
+          process.signals_for_interrupt.each do |signal|
+            break unless process.alive?
+            ::Process.kill(signal, process.pid) rescue nil
+            sleep 0.1 if process.alive?
+          end
+          process.wait_for_exit_status
+        end
+        process.safe_close_io
+      rescue ::RightScale::RightPopen::ProcessError
+        # never started
+      end
+    end
+  end
+end
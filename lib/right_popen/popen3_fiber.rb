@@ -0,0 +1,183 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'io/wait'
+require 'thread'
+
+module RightScale::RightPopen
+
+  # See RightScale.popen3_async for details. runs the command on a non-blocking
+  # fiber of the current thread's Fiber.scheduler so that all waiting (pipe
+  # reads, stdin writes, exit and timeouts) goes through the scheduler hooks.
+  # the output streams are each read on their own (cheap) fiber because a
+  # fiber can only wait on one I/O object at a time.
+  def self.popen3_fiber_impl(cmd, target, options)
+    ::Fiber.schedule do
+      process = nil
+      begin
+        # create process.
+        process = ::RightScale::RightPopen::Process.new(options)
+        process.spawn(cmd, target)
+
+        # the status pipe reads EOF on successful exec or else receives the
+        # error from the child. the child exits in either case.
+        if status_fd_error = fiber_read_status(process.status_fd)
+          target.async_exception_handler(status_fd_error) rescue nil
+        else
+          process.instrument(:exec_completed)
+        end
+
+        target.pid_handler(process.pid)
+
+        # initial watch callback.
+        #
+        # note that we cannot abandon async watch; callback needs to interrupt
+        # in this case
+        target.watch_handler(process)
+
+        finished = ::Queue.new
+        [
+          [process.stdout, :stdout_handler],
+          [process.stderr, :stderr_handler],
+        ].each do |io, handler|
+          ::Fiber.schedule do
+            begin
+              fiber_read(process, io, target.method(handler))
+            rescue Exception => e
+              target.async_exception_handler(e) rescue nil
+            ensure
+              finished << io
+            end
+          end
+        end
+        if input_text = options[:input]
+          process.stdin.write(input_text)
+        end
+        process.stdin.close
+
+        fiber_watch_process(process, target)
+        2.times { finished.pop }
+        process.instrument(:drained)
+        target.timeout_handler rescue nil if process.timer_expired?
+        target.size_limit_handler rescue nil if process.size_limit_exceeded?
+        target.resource_limit_handler(process.resource_limit_sample) rescue nil if process.resource_limit_exceeded?
+        target.exit_handler(process.status) rescue nil
+        process.instrument_finished
+      rescue Exception => e
+        # the spawn method will signal the exit handler but not the pid handler
+        # in this case since there is no pid. any action (logging, etc.)
+        # associated with the failure will have to be driven by the exit
+        # handler.
+        if target
+          target.async_exception_handler(e) rescue nil
+          status = process && process.status
+          status ||= ::RightScale::RightPopen::ProcessStatus.new(nil, 1)
+          target.exit_handler(status) rescue nil
+        end
+      ensure
+        process.safe_close_io if process
+      end
+    end
+    true
+  end
+
+  # reads the status pipe to EOF.
+  #
+  # === Parameters
+  # @param [IO] status_fd to read
+  #
+  # === Return
+  # @return [ProcessError] error from child or nil
+  def self.fiber_read_status(status_fd)
+    data = status_fd.read
+    status_fd.close
+    if data && !data.empty?
+      return ::RightScale::RightPopen::ExecFailure.decode(data)
+    end
+    nil
+  end
+
+  # reads the given stream until EOF or until the process has exited and the
+  # stream has been drained of any buffered output. the latter handles the
+  # case of a background process inheriting the stream from the child.
+  #
+  # === Parameters
+  # @param [Process] process that was run
+  # @param [IO] io to read
+  # @param [Method] handler for data
+  #
+  # === Return
+  # true:: Always return true
+  def self.fiber_read(process, io, handler)
+    while true
+      data = io.read_nonblock(::RightScale::RightPopen::ProcessBase::READ_BUFFER_SIZE, :exception => false)
+      if data.nil?
+        break
+      elsif :wait_readable == data
+        break if process.status
+        io.wait_readable(::RightScale::RightPopen::ProcessBase::WATCH_INTERVAL)
+      else
+        process.count_output(handler.name, data.bytesize)
+        handler.call(data)
+      end
+    end
+    true
+  end
+
+  # waits for process exit on the child's pidfd so that the wait goes through
+  # the scheduler's io_wait hook; a process that needs watching is checked
+  # whenever that wait times out. without a pidfd (before linux 5.3) the exit
+  # wait goes through the scheduler's process_wait hook instead and the exit
+  # status has no resource usage.
+  #
+  # === Parameters
+  # @param [Process] process that was run
+  # @param [Object] target for handler calls
+  #
+  # === Return
+  # true:: Always return true
+  def self.fiber_watch_process(process, target)
+    if process.needs_watching?
+      while process.alive?
+        if sample = process.sample_resources
+          target.resource_handler(sample)
+        end
+        if process.interrupted? || process.timer_expired? ||
+           process.size_limit_exceeded? || process.resource_limit_exceeded?
+          process.interrupt
+        else
+          # cannot abandon async watch; callback needs to interrupt in this case
+          target.watch_handler(process)
+        end
+        # wake on exit or exactly at timeout or next interrupt escalation.
+        now = ::RightScale::RightPopen.monotonic_time
+        delay = [process.next_check_time(::RightScale::RightPopen::ProcessBase::WATCH_INTERVAL, now) - now, 0].max
+        sleep delay if process.await_exit(delay).nil?
+      end
+    end
+    process.wait_for_exit_status
+    true
+  end
+end
@@ -0,0 +1,477 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'thread'
+
+module RightScale::RightPopen
+
+  # See RightScale.popen3_reactor for details. spawns on the calling thread and
+  # then hands the child to the shared reactor thread.
+  def self.popen3_reactor_impl(cmd, target, options)
+    process = nil
+    begin
+      process = ::RightScale::RightPopen::Process.new(options)
+      process.spawn(cmd, target)
+      ::RightScale::RightPopen::Reactor.instance.add(process, target, options)
+    rescue Exception => e
+      # the spawn method will signal the exit handler but not the pid handler
+      # in this case since there is no pid. any action (logging, etc.)
+      # associated with the failure will have to be driven by the exit
+      # handler.
+      if target
+        target.async_exception_handler(e) rescue nil
+        status = process && process.status
+        status ||= ::RightScale::RightPopen::ProcessStatus.new(nil, 1)
+        target.exit_handler(status) rescue nil
+      end
+    end
+    true
+  end
+
+  # Multiplexes the pipes, exits and deadlines of all children started by
+  # popen3_reactor onto one background thread (so the thread count does not
+  # grow with the number of children) and posts handler callbacks to an
+  # executor. the default executor is a single dispatch thread. the deadlines
+  # are kept in a shared timer wheel so the thread wakes only for the earliest
+  # of them.
+  class Reactor
+
+    # longest time between checks for exit of a child that is not being
+    # watched and whose output streams are still open (i.e. a background
+    # process may have inherited them).
+    MAX_CHECK_INTERVAL = 1
+
+    @instance = nil
+    @instance_lock = ::Mutex.new
+
+    # @return [Reactor] shared instance for the current process (after fork, a
+    #   new instance is created because threads do not survive fork, as it is
+    #   if the thread of the last instance has died)
+    def self.instance
+      @instance_lock.synchronize do
+        unless @instance && @instance.pid == ::Process.pid && @instance.alive?
+          @instance = new
+        end
+        @instance
+      end
+    end
+
+    # default executor; runs tasks in order on one thread.
+    class DispatchQueue
+      def initialize
+        @queue = ::Queue.new
+        @thread = ::Thread.new do
+          while task = @queue.pop
+            task.call rescue nil
+          end
+        end
+      end
+
+      # === Parameters
+      # @param [Proc] task to run
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def post(&task)
+        @queue << task
+        true
+      end
+    end
+
+    # state of one child process in the reactor. callbacks for a child are
+    # run in order even if the executor runs tasks concurrently.
+    class Child
+
+      attr_reader :process, :target, :readers
+      attr_accessor :check_timer
+
+      def initialize(process, target, input, executor)
+        @process = process
+        @target = target
+        @executor = executor
+        @readers = {
+          process.stdout    => :stdout_handler,
+          process.stderr    => :stderr_handler,
+          process.status_fd => :status_fd,
+        }
+        @status_fd_data = ''
+        @failed = false
+        @input = nil
+        if input
+          @input = input.to_s.dup
+          @input.force_encoding(::Encoding::BINARY)
+        else
+          process.stdin.close
+        end
+        @merged_output = target.respond_to?(:merged_output?) && target.merged_output?
+        @callbacks = []
+        @callback_lock = ::Mutex.new
+        @callbacks_scheduled = false
+        @check_interval = ProcessBase::WATCH_INTERVAL
+        @check_timer = nil
+      end
+
+      # @return [IO] stdin if there is input left to write or else nil
+      def writer
+        @input ? @process.stdin : nil
+      end
+
+      # Queues a callback for this child's target.
+      #
+      # === Parameters
+      # @param [Symbol] handler_name to call
+      # @param [Array] args for handler
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def dispatch(handler_name, *args)
+        schedule = @callback_lock.synchronize do
+          @callbacks << [handler_name, args]
+          !@callbacks_scheduled && (@callbacks_scheduled = true)
+        end
+        @executor.post { run_callbacks } if schedule
+        true
+      end
+
+      # Reads available data from the given stream.
+      #
+      # === Parameters
+      # @param [IO] io to read
+      #
+      # === Return
+      # @return [TrueClass|FalseClass] true if all streams have closed, in which
+      #   case exit is very likely
+      def read(io)
+        key = @readers[io]
+        begin
+          data = io.read_nonblock(ProcessBase::READ_BUFFER_SIZE)
+          if key == :status_fd
+            @status_fd_data << data
+          else
+            @process.count_output(key, data.bytesize)
+            dispatch_output(key, data)
+          end
+        rescue ::IO::WaitReadable
+          # spurious wakeup
+        rescue ::EOFError
+          finish_reader(io)
+        end
+        @readers.empty?
+      end
+
+      # Writes as much remaining input as the pipe will take.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def write
+        begin
+          written = @process.stdin.write_nonblock(@input)
+          @input = @input.byteslice(written, @input.bytesize - written)
+          return true unless @input.empty?
+        rescue ::IO::WaitWritable
+          return true
+        rescue ::Errno::EPIPE
+          # child is not reading input.
+        end
+        @input = nil
+        @process.stdin.close rescue nil
+        true
+      end
+
+      # Checks for exit or for watch criteria.
+      #
+      # === Parameters
+      # @param [Float] now as monotonic seconds
+      #
+      # === Return
+      # @return [Float] monotonic time of next check or nil if finished
+      def check(now)
+        if @process.alive?
+          if @process.needs_watching?
+            if sample = @process.sample_resources(now)
+              dispatch(:resource_handler, sample)
+            end
+            if @process.timer_expired? || @process.size_limit_exceeded? ||
+               @process.resource_limit_exceeded?
+              @process.interrupt
+            else
+              # cannot abandon async watch; callback needs to interrupt in this case
+              dispatch(:watch_handler, @process)
+            end
+          else
+            @check_interval = [@check_interval * 2, MAX_CHECK_INTERVAL].min
+          end
+          @process.next_check_time(@check_interval, now)
+        else
+          finish
+          nil
+        end
+      end
+
+      # Drains any output left by the dead child and then queues the final
+      # callbacks.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def finish
+        @readers.keys.each do |io|
+          begin
+            while true
+              data = io.read_nonblock(ProcessBase::READ_BUFFER_SIZE)
+              if @readers[io] == :status_fd
+                @status_fd_data << data
+              else
+                @process.count_output(@readers[io], data.bytesize)
+                dispatch_output(@readers[io], data)
+              end
+            end
+          rescue ::IO::WaitReadable
+            # any remaining writer is a background process that inherited the
+            # stream; do not wait for it.
+            @readers.delete(io)
+          rescue ::EOFError, ::IOError, ::SystemCallError
+            finish_reader(io)
+          end
+        end
+        @input = nil
+        @process.instrument(:drained)
+        @process.safe_close_io
+        @process.wait_for_exit_status
+        dispatch(:timeout_handler) if @process.timer_expired?
+        dispatch(:size_limit_handler) if @process.size_limit_exceeded?
+        dispatch(:resource_limit_handler, @process.resource_limit_sample) if @process.resource_limit_exceeded?
+        dispatch(:exit_handler, @process.status)
+        @process.instrument_finished
+        true
+      end
+
+      # @return [TrueClass|FalseClass] true if the reactor failed for this child
+      def failed?; !!@failed; end
+
+      # Handles a failure of the reactor for this child.
+      #
+      # === Parameters
+      # @param [Exception] e that was raised
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def on_failure(e)
+        return true if @failed
+        @failed = true
+        @process.safe_close_io
+        dispatch(:async_exception_handler, e)
+        status = @process.status
+        status ||= ::RightScale::RightPopen::ProcessStatus.new(@process.pid, 1)
+        dispatch(:exit_handler, status)
+      end
+
+      protected
+
+      # tags merged output when read rather than when the callback runs.
+      def dispatch_output(handler_name, data)
+        if @merged_output
+          dispatch(
+            :merged_output_handler,
+            :stdout_handler == handler_name ? :stdout : :stderr,
+            @target.next_output_sequence,
+            ::RightScale::RightPopen.monotonic_nanoseconds,
+            data)
+        else
+          dispatch(handler_name, data)
+        end
+      end
+
+      def finish_reader(io)
+        key = @readers.delete(io)
+        io.close rescue nil
+        if key == :status_fd && !@status_fd_data.empty?
+          status_fd_error = ::RightScale::RightPopen::ExecFailure.decode(@status_fd_data)
+          dispatch(:async_exception_handler, status_fd_error)
+        elsif key == :status_fd
+          @process.instrument(:exec_completed)
+        end
+        true
+      end
+
+      def run_callbacks
+        while callback = next_callback
+          handler_name, args = callback
+          begin
+            @target.__send__(handler_name, *args)
+          rescue Exception => e
+            @target.async_exception_handler(e) rescue nil
+          end
+        end
+        true
+      end
+
+      def next_callback
+        @callback_lock.synchronize do
+          callback = @callbacks.shift
+          @callbacks_scheduled = false unless callback
+          callback
+        end
+      end
+    end
+
+    attr_reader :pid
+
+    # @return [TrueClass|FalseClass] true if the thread servicing children is
+    #   running
+    def alive?
+      @thread.alive?
+    end
+
+    def initialize
+      @pid = ::Process.pid
+      @lock = ::Mutex.new
+      @added = []
+      @children = {}
+      @timer_wheel = ::RightScale::RightPopen::TimerWheel.new
+      @wake_r, @wake_w = ::IO.pipe
+      @dispatch_queue = DispatchQueue.new
+      @thread = ::Thread.new { run }
+    end
+
+    # Adds a spawned child to the reactor.
+    #
+    # === Parameters
+    # @param [Process] process that was spawned
+    # @param [Object] target for handler calls
+    # @param [Hash] options see RightScale.popen3_reactor for details
+    #
+    # === Return
+    # @return [TrueClass] always true
+    def add(process, target, options)
+      child = Child.new(
+        process, target, options[:input], options[:executor] || @dispatch_queue)
+      child.dispatch(:pid_handler, process.pid)
+
+      # initial watch callback.
+      #
+      # note that we cannot abandon async watch; callback needs to interrupt
+      # in this case
+      child.dispatch(:watch_handler, process)
+      @lock.synchronize { @added << child }
+      @wake_w.write_nonblock('.') rescue nil
+      true
+    end
+
+    protected
+
+    def run
+      while true
+        begin
+          poll
+        rescue ::StandardError => e
+          recover(e)
+        end
+      end
+    end
+
+    # services children until the next stream is ready or timer is due.
+    def poll
+      added = @lock.synchronize do
+        result = @added
+        @added = []
+        result
+      end
+      added.each do |child|
+        @children[child] = true
+        guard(child) do
+          schedule_check(child, child.process.next_check_time(ProcessBase::WATCH_INTERVAL))
+        end
+      end
+      owners = {}
+      writers = {}
+      @children.each_key do |child|
+        child.readers.each_key { |io| owners[io] = child }
+        if writer = child.writer
+          writers[writer] = child
+        end
+      end
+      wait_time = nil
+      if next_deadline = @timer_wheel.next_deadline
+        wait_time = [next_deadline - ::RightScale::RightPopen.monotonic_time, 0].max
+      end
+      ready = ::IO.select(owners.keys << @wake_r, writers.keys, nil, wait_time)
+      if ready
+        ready[0].each do |io|
+          if io == @wake_r
+            @wake_r.read_nonblock(ProcessBase::READ_BUFFER_SIZE) rescue nil
+          else
+            child = owners[io]
+            guard(child) do
+              # check for exit now if the child has closed all its streams.
+              schedule_check(child, 0) if child.read(io)
+            end
+          end
+        end
+        ready[1].each { |io| guard(writers[io]) { |child| child.write } }
+      end
+      @timer_wheel.advance(::RightScale::RightPopen.monotonic_time)
+      true
+    end
+
+    # fails the children whose streams can no longer be selected (as when
+    # closed by a handler) so that the others are still serviced.
+    def recover(e)
+      broken = @children.keys.select do |child|
+        child.readers.keys.any? { |io| io.closed? } ||
+          ((writer = child.writer) && writer.closed?)
+      end
+      broken.each { |child| guard(child) { raise e } }
+
+      # avoid spinning on a failure that no child accounts for.
+      sleep ProcessBase::WATCH_INTERVAL if broken.empty?
+      true
+    end
+
+    # (re)schedules the check for exit and watch criteria of a child.
+    def schedule_check(child, check_time)
+      child.check_timer.cancel if child.check_timer
+      child.check_timer = @timer_wheel.schedule(check_time) do
+        child.check_timer = nil
+        guard(child) do
+          if next_check_time = child.check(::RightScale::RightPopen.monotonic_time)
+            schedule_check(child, next_check_time)
+          else
+            @children.delete(child)
+          end
+        end
+      end
+      true
+    end
+
+    # isolates a failure to the child being serviced.
+    def guard(child)
+      yield child unless child.failed?
+    rescue Exception => e
+      child.on_failure(e) rescue nil
+      child.check_timer.cancel if child.check_timer
+      @children.delete(child)
+    end
+  end
+end
@@ -33,4 +33,21 @@ module RightScale::RightPopen
     true
   end
 
+  # See RightScale.capture for details
+  def self.capture_impl(cmd, options)
+    # read output in bulk into scratch buffers which the capture target then
+    # appends to its own (geometrically grown) strings.
+    options = options.merge(
+      :stdout_buffer => '',
+      :stderr_buffer => '')
+    target = ::RightScale::RightPopen::CaptureTarget.new(options[:merged_output])
+    process = ::RightScale::RightPopen::Process.new(options)
+    if instrumentation = options[:instrumentation]
+      process.sync_all(cmd, instrumentation.wrap(target))
+    else
+      process.sync_all(cmd, target)
+    end
+    target.result
+  end
+
 end
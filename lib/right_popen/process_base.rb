@@ -24,14 +24,22 @@
 require 'rubygems'
 require 'right_popen'
 require 'thread'
-require 'yaml'
 
 module RightScale
   module RightPopen
     class ProcessBase
 
+      # size of each bulk read from an output stream; matches the default
+      # capacity of a Linux pipe.
+      READ_BUFFER_SIZE = 64 * 1024
+
+      # seconds between checks of watch criteria (timeout, size limit, etc.)
+      # while waiting for output or exit.
+      WATCH_INTERVAL = 0.1
+
       attr_reader :pid, :stdin, :stdout, :stderr, :status_fd, :status
-      attr_reader :start_time, :stop_time, :channels_to_finish
+      attr_reader :start_time, :stop_time, :deadline, :channels_to_finish
+      attr_reader :spawned_at, :output_counters
 
       # === Parameters
       # @param [Hash] options see RightScale.popen3_async for details
@@ -41,20 +49,43 @@ module RightScale
         @stdout = nil
         @stderr = nil
         @status_fd = nil
+        @exit_notification = nil
         @last_interrupt = nil
         @pid = nil
         @start_time = nil
         @stop_time = nil
+        @deadline = nil
         @watch_directory = nil
         @size_limit_bytes = nil
+        @rlimit_signals = nil
         @cmd = nil
         @target = nil
         @status = nil
         @channels_to_finish = nil
+        @sampler = nil
+        @next_sample_at = nil
+        @resource_limit_sample = nil
+        @instrumentation = nil
+        if @options[:instrumentation]
+          # attach to a copy so that options reused by the caller (as by a
+          # Coprocess on restart) give each child its own instrumentation.
+          @options = @options.dup
+          @instrumentation = ::RightScale::RightPopen::Instrumentation.attach(@options)
+        end
+        [:stdout_buffer, :stderr_buffer].each do |buffer_key|
+          if (buffer = @options[buffer_key]) &&
+             !(buffer.kind_of?(::String) && !buffer.frozen?)
+            raise ::ArgumentError, "#{buffer_key} must be a mutable String"
+          end
+        end
         @needs_watching = !!(
           @options[:timeout_seconds] ||
           @options[:size_limit_bytes] ||
-          @options[:watch_handler])
+          @options[:watch_handler] ||
+          @options[:resource_handler] ||
+          @options[:max_rss_bytes] ||
+          @options[:max_cpu_seconds] ||
+          @options[:max_io_bytes])
       end
 
       # Determines if the process is still running.
@@ -82,20 +113,46 @@ module RightScale
       # @return [TrueClass|FalseClass] true if needs watching
       def needs_watching?; @needs_watching; end
 
-      # Determines if timeout on child process has expired, if any.
+      # Determines if timeout on child process has expired, if any. the timeout
+      # is measured on the monotonic clock so it is not affected by changes to
+      # the system time. a child killed by the kernel for exceeding its CPU
+      # time limit (see :rlimits) has also timed out.
       #
       # === Return
       # @return [TrueClass|FalseClass] true if timer expired
       def timer_expired?
-        !!(@stop_time && Time.now >= @stop_time)
+        !!(@deadline && ::RightScale::RightPopen.monotonic_time >= @deadline) ||
+          killed_for_rlimit?(:cpu)
+      end
+
+      # Calculates when this process next needs to be checked given a polling
+      # interval, which is no later than the timeout (if any) so that timeouts
+      # are exact when driven by a timer.
+      #
+      # === Parameters
+      # @param [Numeric] interval in seconds
+      # @param [Float] now as monotonic seconds
+      #
+      # === Return
+      # @return [Float] monotonic seconds
+      def next_check_time(interval, now = ::RightScale::RightPopen.monotonic_time)
+        check_time = now + interval
+        [@deadline, @kill_at, @sampler && @next_sample_at].each do |event_time|
+          if event_time && event_time > now && event_time < check_time
+            check_time = event_time
+          end
+        end
+        check_time
       end
 
       # Determines if total size of files created by child process has exceeded
-      # the limit specified, if any.
+      # the limit specified, if any. a child killed by the kernel for exceeding
+      # its file size limit (see :rlimits) has also exceeded the size limit.
       #
       # === Return
       # @return [TrueClass|FalseClass] true if size limit exceeded
       def size_limit_exceeded?
+        return true if killed_for_rlimit?(:fsize)
         if @watch_directory
           globbie = ::File.join(@watch_directory, '**/*')
           size = 0
@@ -109,6 +166,45 @@ module RightScale
         end
       end
 
+      # @return [ResourceSampler::Sample] first sample to exceed a resource limit or nil
+      attr_reader :resource_limit_sample
+
+      # Determines if a sample of the resource usage of the child process has
+      # exceeded any of the resource limits specified.
+      #
+      # === Return
+      # @return [TrueClass|FalseClass] true if a resource limit was exceeded
+      def resource_limit_exceeded?; !!@resource_limit_sample; end
+
+      # Samples the resource usage of the child process when the next sample is
+      # due, if sampling is requested (linux only).
+      #
+      # === Parameters
+      # @param [Float] now as monotonic seconds
+      #
+      # === Return
+      # @return [ResourceSampler::Sample] sample or nil if not due
+      def sample_resources(now = ::RightScale::RightPopen.monotonic_time)
+        return nil unless @sampler && now >= @next_sample_at
+        @next_sample_at = now + @sampler.interval
+        if sample = @sampler.sample(now)
+          @resource_limit_sample ||= sample if sample.exceeded_limit
+        else
+          stop_sampling
+        end
+        sample
+      end
+
+      # Provides an I/O object that reads EOF once the child process has exited
+      # so that the sync loop can block until either output or exit occurs
+      # instead of polling for exit. the default is to poll.
+      #
+      # === Return
+      # @return [IO] exit notification or nil if unsupported
+      def exit_notification
+        nil
+      end
+
       # @return [TrueClass|FalseClass] interrupted as true if child process was interrupted by watcher
       def interrupted?; !!@last_interrupt; end
 
@@ -142,12 +238,17 @@ module RightScale
       def spawn(cmd, target)
         @cmd = cmd
         @target = target
-        @kill_time = nil
+        @kill_at = nil
         @pid = nil
         @status = nil
         @last_interrupt = nil
         @channels_to_finish = nil
         @wait_thread = nil
+        @exit_notification = nil
+        @spawned_at = nil
+        @resource_limit_sample = nil
+        instrument(:spawn_started)
+        @output_counters = ::RightScale::RightPopen::ProcessStatus::OutputCounters.new(0, 0, nil)
 
         if @size_limit_bytes = @options[:size_limit_bytes]
           @watch_directory = @options[:watch_directory] || @options[:directory] || ::Dir.pwd
@@ -174,11 +275,12 @@ module RightScale
         # note that calling IO.select on pipes which have already had all
         # of their output consumed can cause segfault (in Ubuntu?) so it is
         # important to keep track of when all I/O has been consumed.
-        @channels_to_finish = [
-          [:stdout_handler, @stdout],
-          [:stderr_handler, @stderr],
-        ]
+        #
+        # the status pipe comes first so that exec is seen before any output
+        # read in the same pass.
+        @channels_to_finish = []
         @channels_to_finish << [:status_fd, @status_fd] if @status_fd
+        @channels_to_finish << [:stdout_handler, @stdout] << [:stderr_handler, @stderr]
 
         # sync watch_handler has the option to abandon watch as soon as child
         # process comes alive and before streaming any output.
@@ -208,12 +310,37 @@ module RightScale
       def sync_exit_with_target
         abandon = false
         status_fd_data = []
+
+        # resolve handler methods once instead of once per chunk.
+        handler_methods = {
+          :stdout_handler => @target.method(:stdout_handler),
+          :stderr_handler => @target.method(:stderr_handler),
+        }
+        read_buffers = {
+          :stdout_handler => @options[:stdout_buffer],
+          :stderr_handler => @options[:stderr_buffer],
+        }
         begin
+          # block until output or exit unless there is something to watch. note
+          # that IO.select releases the interpreter lock while blocked.
+          exit_io = exit_notification
           while true
             channels_to_watch = @channels_to_finish.map { |ctf| ctf.last }
-            ready = ::IO.select(channels_to_watch, nil, nil, 0.1) rescue nil
+            if exit_io
+              channels_to_watch << exit_io
+              wait_time = (needs_watching? || interrupted?) ? WATCH_INTERVAL : nil
+            else
+              wait_time = WATCH_INTERVAL
+            end
+            if wait_time
+              # wake exactly at timeout or next interrupt escalation.
+              now = ::RightScale::RightPopen.monotonic_time
+              wait_time = next_check_time(wait_time, now) - now
+            end
+            ready = ::IO.select(channels_to_watch, nil, nil, wait_time) rescue nil
             dead = !alive?
             channels_to_read = ready && ready.first
+            channels_to_read.delete(exit_io) if channels_to_read && exit_io
             if dead && drain_all_upon_death?
               # finish reading all dead channels.
               channels_to_read = @channels_to_finish.map { |ctf| ctf.last }
@@ -222,41 +349,52 @@ module RightScale
               channels_to_read.each do |channel|
                 index = @channels_to_finish.index { |ctf| ctf.last == channel }
                 key = @channels_to_finish[index].first
-                data = dead ? channel.gets(nil) : channel.gets
-                if data
-                  if key == :status_fd
-                    status_fd_data << data
-                  else
-                    @target.method(key).call(data)
+                buffer = read_buffers[key]
+                begin
+                  # read in bulk, filling the caller's buffer in place (if any)
+                  # and handing the same object to the handler each time.
+                  # drain until EOF upon death.
+                  loop do
+                    data = buffer ?
+                           channel.readpartial(READ_BUFFER_SIZE, buffer) :
+                           channel.readpartial(READ_BUFFER_SIZE)
+                    if key == :status_fd
+                      status_fd_data << data
+                    else
+                      count_output(key, data.bytesize)
+                      handler_methods[key].call(data)
+                    end
+                    break unless dead
                   end
-                else
+                rescue ::EOFError
                   # nothing on channel indicates EOF
                   @channels_to_finish.delete_at(index)
+                  if key == :status_fd && status_fd_data.empty?
+                    instrument(:exec_completed)
+                  end
                 end
               end
             end
-            if dead
-              break
-            elsif (interrupted? || timer_expired? || size_limit_exceeded?)
+            break if dead
+            if sample = sample_resources
+              @target.resource_handler(sample)
+            end
+            if (interrupted? || timer_expired? || size_limit_exceeded? || resource_limit_exceeded?)
               interrupt
             elsif abandon = !@target.watch_handler(self)
               return true  # bypass any remaining callbacks
             end
           end
+          instrument(:drained)
           wait_for_exit_status
           unless status_fd_data.empty?
-            data = status_fd_data.join
-            error_data = ::YAML.load(data)
-            status_fd_error = ::RightScale::RightPopen::ProcessError.new(
-              "#{error_data['class']}: #{error_data['message']}")
-            if error_data['backtrace']
-              status_fd_error.set_backtrace(error_data['backtrace'])
-            end
-            raise status_fd_error
+            raise exec_error_from(status_fd_data.join)
           end
           @target.timeout_handler if timer_expired?
           @target.size_limit_handler if size_limit_exceeded?
+          @target.resource_limit_handler(@resource_limit_sample) if resource_limit_exceeded?
           @target.exit_handler(@status)
+          instrument_finished
         ensure
           # abandon will not close I/O objects; caller takes responsibility via
           # process object passed to watch_handler. if anyone calls interrupt
@@ -266,6 +404,24 @@ module RightScale
         true
       end
 
+      # Blocks until the child process has either executed the command or else
+      # failed to do so. this is only needed when not calling sync_all.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      #
+      # === Raise
+      # @raise [ProcessError] if child failed to execute the command
+      def wait_for_exec
+        if @status_fd && !@status_fd.closed?
+          data = @status_fd.read
+          @status_fd.close
+          raise exec_error_from(data) unless data.empty?
+          instrument(:exec_completed)
+        end
+        true
+      end
+
       # blocks waiting for process exit status.
       #
       # === Return
@@ -286,7 +442,7 @@ module RightScale
       # @return [TrueClass|FalseClass] true if process was alive and interrupted, false if dead before (first) interrupt
       def interrupt
         while alive?
-          if !@kill_time || Time.now >= @kill_time
+          if !@kill_at || ::RightScale::RightPopen.monotonic_time >= @kill_at
             # soft then hard interrupt (assumed to be called periodically until
             # process is gone).
             sigs = signals_for_interrupt
@@ -303,16 +459,87 @@ module RightScale
             @last_interrupt = next_interrupt
 
             # kill
-            result = ::Process.kill(next_interrupt, @pid) rescue nil
+            result = send_interrupt(next_interrupt)
             if result
-              @kill_time = Time.now + 3 # more seconds until next attempt
+              instrument(:interrupted, :signal => next_interrupt) if @instrumentation
+              @kill_at = ::RightScale::RightPopen.monotonic_time + 3 # more seconds until next attempt
               break
             end
+          else
+            # escalate on a later call instead of spinning until kill time.
+            break
           end
         end
         interrupted?
       end
 
+      # Counts output read from the child for its status.
+      #
+      # === Parameters
+      # @param [Symbol] handler_name as :stdout_handler or :stderr_handler
+      # @param [Integer] byte_count read
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def count_output(handler_name, byte_count)
+        counters = @output_counters
+        unless counters.first_byte_at
+          counters.first_byte_at = ::RightScale::RightPopen.monotonic_time
+          instrument(:first_output, nil, counters.first_byte_at) if @instrumentation
+        end
+        if :stdout_handler == handler_name
+          counters.stdout_bytes += byte_count
+        else
+          counters.stderr_bytes += byte_count
+        end
+        @instrumentation.count_read(handler_name, byte_count) if @instrumentation
+        true
+      end
+
+      # Emits an event for a phase of running this process to the
+      # :instrumentation subscriber (if any). see Instrumentation.
+      #
+      # === Parameters
+      # @param [Symbol] name of phase
+      # @param [Hash] payload for phase or nil
+      # @param [Float] at as monotonic seconds or nil for now
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def instrument(name, payload = nil, at = nil)
+        if instrumentation = @instrumentation
+          if at
+            instrumentation.emit(name, @pid, payload, at)
+          else
+            instrumentation.emit(name, @pid, payload)
+          end
+        end
+        true
+      end
+
+      # Emits the final event for this process with the counts of reads, bytes
+      # and handler calls (if instrumented).
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def instrument_finished
+        instrument(:finished, @instrumentation.counters) if @instrumentation
+        true
+      end
+
+      # Adopts a permit already granted by the :governor (as when admission was
+      # awaited without blocking) so that spawn does not wait for another.
+      #
+      # === Parameters
+      # @param [Governor::Permit] permit to release when child has exited
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def admit(permit)
+        @permit = permit
+        true
+      end
+
       # Safely closes any open I/O objects associated with this process.
       #
       # === Return
@@ -322,11 +549,81 @@ module RightScale
         @stdout.close rescue nil if @stdout && !@stdout.closed?
         @stderr.close rescue nil if @stderr && !@stderr.closed?
         @status_fd.close rescue nil if @status_fd && !@status_fd.closed?
+        @exit_notification.close rescue nil if @exit_notification && !@exit_notification.closed?
+        stop_sampling
         true
       end
 
       protected
 
+      # === Parameters
+      # @param [String] data from status_fd describing failure to execute
+      #
+      # === Return
+      # @return [ProcessError] error to raise
+      def exec_error_from(data)
+        ::RightScale::RightPopen::ExecFailure.decode(data)
+      end
+
+      # === Parameters
+      # @param [Symbol] name of resource limit enforced by signal
+      #
+      # === Return
+      # @return [TrueClass|FalseClass] true if the child was killed by the
+      #   signal sent by the kernel for exceeding the given resource limit. a
+      #   shell command is instead assumed to have been killed when the shell
+      #   exits with 128 plus the signal, as it does when the command it ran
+      #   was killed.
+      def killed_for_rlimit?(name)
+        return false unless @rlimit_signals && @status && (signal = @rlimit_signals[name])
+        signal == @status.termsig ||
+          (@cmd.kind_of?(::String) && (128 + signal) == @status.exitstatus)
+      end
+
+      # === Parameters
+      # @param [String] signal from signals_for_interrupt
+      #
+      # === Return
+      # @return [TrueClass|FalseClass] true if sent
+      def send_interrupt(signal)
+        !!(::Process.kill(signal, @pid) rescue nil)
+      end
+
+      # waits for admission by the :governor (if any) before spawning.
+      def acquire_permit
+        if @permit.nil? && (governor = @options[:governor])
+          @permit = governor.acquire(@options[:priority] || 0)
+        end
+        true
+      end
+
+      # frees the governor slot once the child has exited.
+      def release_permit
+        if permit = @permit
+          @permit = nil
+          permit.release
+        end
+        true
+      end
+
+      # releases what was held for the life of the child once its exit has been
+      # detected.
+      def on_exit_detected
+        release_permit
+        stop_sampling
+        instrument(:exit_detected, :exited_at => @status && @status.exited_at) if @instrumentation
+        true
+      end
+
+      # closes the /proc files held for sampling once the child has exited.
+      def stop_sampling
+        if sampler = @sampler
+          @sampler = nil
+          sampler.close
+        end
+        true
+      end
+
       def start_timer
         # start timer when process comes alive (ruby processes are slow to
         # start in Windows, etc.).
@@ -334,9 +631,13 @@ module RightScale
           raise ::RightScale::RightPopen::ProcessError, 'Process not started'
         end
         @start_time = ::Time.now
+        @spawned_at = ::RightScale::RightPopen.monotonic_time
         @stop_time  = @options[:timeout_seconds] ?
                       (@start_time + @options[:timeout_seconds]) :
                       nil
+        @deadline   = @options[:timeout_seconds] ?
+                      (::RightScale::RightPopen.monotonic_time + @options[:timeout_seconds]) :
+                      nil
       end
     end
   end
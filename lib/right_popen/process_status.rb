@@ -30,18 +30,116 @@ module RightScale
 
     # Quacks like Process::Status, which we cannot instantiate ourselves because
     # has no public new method for cases where we need to create our own.
+    #
+    # on Linux, also carries the resource usage of the child (when reaped with
+    # wait4), spawn, first output and exit times on the monotonic clock and
+    # the count of bytes read from each output stream and, when placed in a
+    # cgroup, the usage accounted by the cgroup.
     class ProcessStatus
 
+      # resource usage of an exited child; see getrusage(2). times are in
+      # seconds and max_rss is in kilobytes.
+      Rusage = ::Struct.new(
+        :user_time, :system_time, :max_rss,
+        :minor_faults, :major_faults,
+        :input_blocks, :output_blocks,
+        :voluntary_context_switches, :involuntary_context_switches)
+
+      # output received from a child, which is shared with its status and
+      # is final by the time the exit handler is called.
+      OutputCounters = ::Struct.new(:stdout_bytes, :stderr_bytes, :first_byte_at)
+
       attr_reader :pid, :exitstatus, :termsig
+      attr_reader :rusage, :spawned_at, :exited_at
+
+      # @return [Cgroup::Stats] usage accounted by the child's cgroup (for the
+      #   whole batch when the cgroup is shared) or nil if not in a cgroup
+      attr_reader :cgroup_stats
 
       # === Parameters
       # @param [Integer] pid as process identifier
       # @param [Integer] exitstatus as process exit code or nil
       # @param [Integer] termination signal or nil
-      def initialize(pid, exitstatus, termsig=nil)
+      # @param [Hash] details of exit
+      # @option details [Rusage] :rusage of child or nil if unknown
+      # @option details [Float] :spawned_at as monotonic seconds
+      # @option details [Float] :exited_at as monotonic seconds
+      # @option details [OutputCounters] :output_counters for child
+      # @option details [Integer] :raw_status from wait
+      # @option details [Cgroup::Stats] :cgroup_stats of the child's cgroup
+      def initialize(pid, exitstatus, termsig=nil, details = {})
         @pid = pid
         @exitstatus = exitstatus
         @termsig = termsig
+        @rusage = details[:rusage]
+        @spawned_at = details[:spawned_at]
+        @exited_at = details[:exited_at]
+        @output_counters = details[:output_counters]
+        @raw_status = details[:raw_status]
+        @cgroup_stats = details[:cgroup_stats]
+      end
+
+      # Decodes a raw wait status; see waitpid(2).
+      #
+      # === Parameters
+      # @param [Integer] pid as process identifier
+      # @param [Integer] raw_status from wait
+      # @param [Hash] details see initialize
+      #
+      # === Return
+      # @return [ProcessStatus] status
+      def self.from_raw_status(pid, raw_status, details = {})
+        termsig = raw_status & 0x7f
+        if 0 == termsig
+          new(pid, (raw_status >> 8) & 0xff, nil, details.merge(:raw_status => raw_status))
+        else
+          new(pid, nil, termsig, details.merge(:raw_status => raw_status))
+        end
+      end
+
+      # @return [Integer] bytes read from stdout
+      def stdout_bytes
+        @output_counters ? @output_counters.stdout_bytes : 0
+      end
+
+      # @return [Integer] bytes read from stderr
+      def stderr_bytes
+        @output_counters ? @output_counters.stderr_bytes : 0
+      end
+
+      # @return [Float] monotonic seconds when first output was read or nil
+      def first_byte_at
+        @output_counters ? @output_counters.first_byte_at : nil
+      end
+
+      # @return [Float] seconds from spawn to exit or nil if unknown
+      def elapsed_seconds
+        (@spawned_at && @exited_at) ? (@exited_at - @spawned_at) : nil
+      end
+
+      # Simulates Process::Status.signaled?
+      #
+      # === Returns
+      # @return [TrueClass|FalseClass] true if terminated by signal
+      def signaled?
+        !@termsig.nil?
+      end
+
+      # Simulates Process::Status.inspect
+      #
+      # === Returns
+      # @return [String] summary of status
+      def inspect
+        outcome = @termsig ? "signal #{@termsig}" : "exit #{@exitstatus.inspect}"
+        "#<#{self.class.name}: pid #{@pid.inspect} #{outcome}>"
+      end
+
+      # Simulates Process::Status.to_i
+      #
+      # === Returns
+      # @return [Integer] raw wait status
+      def to_i
+        @raw_status || (@termsig ? @termsig : ((@exitstatus || 0) & 0xff) << 8)
       end
 
       # Simulates Process::Status.exited? which seems like a weird method since
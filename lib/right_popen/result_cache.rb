@@ -0,0 +1,429 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'digest/sha1'
+require 'thread'
+
+module RightScale
+
+  module RightPopen
+
+    # Provides the :cache option for idempotent commands. concurrent identical
+    # invocations share one child process (single-flight) and the handler
+    # events of that child (output, status, etc.) are replayed to the handlers
+    # of every caller. completed results are kept in a bounded LRU until their
+    # time-to-live expires.
+    #
+    # sync and async callers never share a child because a sync caller blocks
+    # until the child completes, which would deadlock on the thread where an
+    # async leader's events are delivered.
+    class ResultCache
+
+      DEFAULT_MAX_ENTRIES = 256
+      DEFAULT_MAX_ENTRY_BYTES = 1024 * 1024
+
+      # events recorded from one child process.
+      class Entry
+        attr_reader :key, :events, :error, :expires_at
+
+        def initialize(key, max_bytes, cache = nil)
+          @key = key
+          @max_bytes = max_bytes
+          @cache = cache
+          @byte_count = 0
+          @events = []
+          @error = nil
+          @cacheable = true
+          @completed = false
+          @expires_at = nil
+          @waiters = []
+          @follower_count = 0
+          @detached = false
+          @lock = ::Mutex.new
+        end
+
+        # Counts a caller that will replay this entry. called with the cache
+        # locked so that no follower joins once detached.
+        #
+        # === Return
+        # @return [TrueClass] always true
+        def join
+          @follower_count += 1
+          true
+        end
+
+        # Marks this entry as removed from its cache so that no follower can
+        # join. called with the cache locked.
+        #
+        # === Return
+        # @return [TrueClass] always true
+        def detach
+          @detached = true
+        end
+
+        # @return [TrueClass|FalseClass] true if completed
+        def completed?
+          @lock.synchronize { @completed }
+        end
+
+        # @return [TrueClass|FalseClass] true if completed and cacheable
+        def cacheable?; @cacheable; end
+
+        # Records a handler event. output is recorded for callers already
+        # waiting but a result that is too large is neither cached nor offered
+        # to new callers, and is no longer recorded once no caller waits.
+        #
+        # === Parameters
+        # @param [Symbol] handler_name of event
+        # @param [Array] args for handler
+        #
+        # === Return
+        # @return [TrueClass] always true
+        def record(handler_name, *args)
+          case handler_name
+          when :stdout_handler, :stderr_handler, :merged_output_handler
+            @byte_count += args.last.bytesize
+            if @byte_count > @max_bytes && @cacheable
+              @cacheable = false
+              @cache ? @cache.detach(self) : detach
+            end
+            if @detached && 0 == @follower_count
+              @events.clear
+              return true
+            end
+
+            # the caller's buffer may be reused for the next chunk.
+            args = args[0...-1] << args.last.dup
+          when :async_exception_handler, :timeout_handler, :size_limit_handler,
+               :resource_limit_handler
+            @cacheable = false
+          end
+          @events << [handler_name, args]
+          true
+        end
+
+        # Records an exception raised to the caller.
+        #
+        # === Parameters
+        # @param [Exception] error raised
+        #
+        # === Return
+        # @return [TrueClass] always true
+        def fail(error)
+          @error = error
+          @cacheable = false
+          true
+        end
+
+        # Completes this entry and notifies any waiters.
+        #
+        # === Parameters
+        # @param [Numeric] ttl as seconds to keep result
+        #
+        # === Return
+        # @return [TrueClass] always true
+        def complete(ttl)
+          waiters = @lock.synchronize do
+            @expires_at = ::RightScale::RightPopen.monotonic_time + ttl
+            @completed = true
+            result = @waiters
+            @waiters = []
+            result
+          end
+          waiters.each { |waiter| waiter.call(self) rescue nil }
+          true
+        end
+
+        # Calls back once this entry is completed, which may be immediately.
+        #
+        # === Parameters
+        # @param [Proc] waiter to call with entry
+        #
+        # === Return
+        # @return [TrueClass] always true
+        def on_complete(&waiter)
+          call_now = @lock.synchronize do
+            @waiters << waiter unless @completed
+            @completed
+          end
+          waiter.call(self) if call_now
+          true
+        end
+
+        # Replays the recorded events to the given target.
+        #
+        # === Parameters
+        # @param [Object] target that implements all handlers (see TargetProxy)
+        #
+        # === Return
+        # @return [TrueClass] always true
+        def replay(target)
+          @events.each { |handler_name, args| target.__send__(handler_name, *args) }
+          true
+        end
+      end
+
+      # forwards handler calls to the leading caller's target while recording
+      # them for any others.
+      class RecordingTarget
+        def initialize(target, entry, cache, ttl)
+          @target = target
+          @entry = entry
+          @cache = cache
+          @ttl = ttl
+        end
+
+        ::RightScale::RightPopen::TargetProxy::HANDLER_NAME_TO_PARAMETER_COUNT.each do |handler_name, parameter_count|
+          next if [:exit_handler, :watch_handler].include?(handler_name)
+          parameter_list = (1..parameter_count).map { |i| "p#{i}" }.join(', ')
+          class_eval <<EOF
+def #{handler_name.to_s}(#{parameter_list})
+  @entry.record(#{([handler_name.inspect] + [parameter_list]).reject { |s| s.empty? }.join(', ')})
+  @target.#{handler_name.to_s}(#{parameter_list})
+end
+EOF
+        end
+
+        def watch_handler(p1)
+          @target.watch_handler(p1)
+        end
+
+        def exit_handler(p1)
+          @entry.record(:exit_handler, p1)
+          @target.exit_handler(p1)
+        ensure
+          @cache.complete(@entry, @ttl)
+        end
+      end
+
+      @default = nil
+      @default_lock = ::Mutex.new
+
+      # @return [ResultCache] shared by callers not giving a :store
+      def self.default
+        @default_lock.synchronize { @default ||= new }
+      end
+
+      # Runs the command (as the leader) or else waits for the identical
+      # command already running or replays a cached result.
+      #
+      # === Parameters
+      # @param [Symbol] synchronicity as :popen3_sync or :popen3_async
+      # @param [String|Array] cmd as shell command or binary to execute
+      # @param [Object] target that implements all handlers (see TargetProxy)
+      # @param [Hash] options see RightScale.popen3_async for details
+      # @yield [target] runs the command with a recording target as leader
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def self.coalesce(synchronicity, cmd, target, options)
+        cache_options = options[:cache]
+        unless cache_options.kind_of?(::Hash)
+          raise ::ArgumentError, 'cache must be a Hash'
+        end
+        if options[:watch_handler]
+          # watching (and abandoning) is specific to each caller.
+          raise ::ArgumentError, 'cache cannot be combined with watch_handler'
+        end
+        cache = cache_options[:store] || default
+        ttl = cache_options[:ttl] || 0
+        raise ::ArgumentError, 'ttl is invalid' if ttl < 0
+        key = "#{synchronicity}:#{cache_options[:key] || key_for(cmd, options)}"
+        entry, leader = cache.checkout(key)
+        if leader
+          begin
+            yield RecordingTarget.new(target, entry, cache, ttl)
+          rescue ::Exception => e
+            entry.fail(e)
+            cache.complete(entry, ttl)
+            raise
+          end
+        elsif :popen3_sync == synchronicity
+          completed = ::Queue.new
+          entry.on_complete { completed << true }
+          completed.pop
+          raise entry.error if entry.error
+          entry.replay(target)
+        else
+          entry.on_complete do
+            defer_async do
+              if entry.error
+                target.async_exception_handler(entry.error) rescue nil
+                target.exit_handler(::RightScale::RightPopen::ProcessStatus.new(nil, 1)) rescue nil
+              else
+                entry.replay(target) rescue nil
+              end
+            end
+          end
+        end
+        true
+      end
+
+      # Computes the cache key for identical invocations from the command, the
+      # environment overlay, working directory, identity, input and every
+      # option that changes how the child is run, limited or interrupted.
+      #
+      # === Parameters
+      # @param [String|Array] cmd as shell command or binary to execute
+      # @param [Hash] options see RightScale.popen3_async for details
+      #
+      # === Return
+      # @return [String] key
+      def self.key_for(cmd, options)
+        environment = (options[:environment] || {}).map do |key, value|
+          [key.to_s, value.nil? ? nil : value.to_s]
+        end.sort_by { |pair| pair.first }
+        input = options[:input]
+        parts = [
+          cmd,
+          environment,
+          ::File.expand_path(options[:directory] || ::Dir.pwd),
+          options[:user], options[:group], options[:umask],
+          options[:locale], options[:inherit_io],
+          options[:timeout_seconds], options[:size_limit_bytes], options[:watch_directory],
+          options[:max_rss_bytes], options[:max_cpu_seconds], options[:max_io_bytes],
+          options[:sample_interval_seconds], options[:sample_process_tree],
+          options[:cpu_affinity], options[:nice], options[:io_priority], options[:sched_policy],
+          options[:rlimits] ? options[:rlimits].map { |key, value| [key.to_s, value] }.sort_by { |pair| pair.first } : nil,
+          options[:cgroup_limits] ? options[:cgroup_limits].map { |key, value| [key.to_s, value] }.sort_by { |pair| pair.first } : nil,
+          input ? ::Digest::SHA1.hexdigest(input.to_s) : nil,
+        ]
+        ::Digest::SHA1.hexdigest(::Marshal.dump(parts))
+      end
+
+      # runs the block on the thread where async handlers would normally be
+      # called.
+      def self.defer_async(&block)
+        if defined?(::EM) && ::EM.reactor_running?
+          ::EM.next_tick(&block)
+        else
+          block.call
+        end
+        true
+      end
+
+      attr_reader :max_entries, :max_entry_bytes
+
+      # === Parameters
+      # @param [Integer] max_entries to keep before evicting least recently used
+      # @param [Integer] max_entry_bytes of output to cache for one command
+      def initialize(max_entries = DEFAULT_MAX_ENTRIES, max_entry_bytes = DEFAULT_MAX_ENTRY_BYTES)
+        raise ::ArgumentError.new('max_entries is invalid') unless (@max_entries = max_entries) > 0
+        raise ::ArgumentError.new('max_entry_bytes is invalid') unless (@max_entry_bytes = max_entry_bytes) >= 0
+        @entries = {}
+        @lock = ::Mutex.new
+      end
+
+      # @return [Integer] count of entries (running or cached)
+      def size
+        @lock.synchronize { @entries.size }
+      end
+
+      # Finds a running or unexpired entry for the given key or else creates
+      # one for the caller to run.
+      #
+      # === Parameters
+      # @param [String] key for command
+      #
+      # === Return
+      # @return [Array] tuple of [entry, true if caller is leader]
+      def checkout(key)
+        @lock.synchronize do
+          if entry = @entries.delete(key)
+            if entry.completed? && entry.expires_at <= ::RightScale::RightPopen.monotonic_time
+              entry = nil
+            else
+              # reinsert as most recently used.
+              @entries[key] = entry
+              entry.join
+              return [entry, false]
+            end
+          end
+          entry = Entry.new(key, @max_entry_bytes, self)
+          @entries[key] = entry
+          evict
+          [entry, true]
+        end
+      end
+
+      # Removes the given running entry so that no further caller shares it.
+      #
+      # === Parameters
+      # @param [Entry] entry to remove
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def detach(entry)
+        @lock.synchronize do
+          @entries.delete(entry.key) if @entries[entry.key].equal?(entry)
+          entry.detach
+        end
+      end
+
+      # Completes the given entry and drops it unless it can be cached.
+      #
+      # === Parameters
+      # @param [Entry] entry to complete
+      # @param [Numeric] ttl as seconds to keep result
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def complete(entry, ttl)
+        unless entry.cacheable? && ttl > 0
+          @lock.synchronize do
+            @entries.delete(entry.key) if @entries[entry.key].equal?(entry)
+          end
+        end
+        entry.complete(ttl)
+      end
+
+      # Forgets all cached results.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def clear
+        @lock.synchronize { @entries.clear }
+        true
+      end
+
+      protected
+
+      # evicts the least recently used completed entries beyond max_entries. a
+      # running entry is never evicted so that its callers still share it.
+      def evict
+        excess = @entries.size - @max_entries
+        if excess > 0
+          @entries.keys.each do |key|
+            if @entries[key].completed?
+              @entries.delete(key)
+              break if (excess -= 1) == 0
+            end
+          end
+        end
+        true
+      end
+    end
+  end
+end
@@ -0,0 +1,155 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'stringio'
+require 'tempfile'
+require 'tmpdir'
+
+module RightScale
+
+  module RightPopen
+
+    # Provides an output handler implementation that captures all output (from
+    # a child process) in memory up to a threshold and then spills everything
+    # to an anonymous temporary file so that memory use is bounded regardless of
+    # how much output is produced. the file is unlinked as soon as it is created
+    # and so is released by the OS when closed (or when this process exits).
+    class SpillingOutputBuffer
+
+      DEFAULT_THRESHOLD_BYTES = 1024 * 1024
+
+      attr_reader :threshold_bytes, :directory, :byte_count
+
+      # === Parameters
+      # @param [Integer] threshold_bytes to hold in memory before spilling to file
+      # @param [String] directory for temporary file or nil for system default
+      def initialize(threshold_bytes = DEFAULT_THRESHOLD_BYTES, directory = nil)
+        raise ArgumentError.new('threshold_bytes is invalid') unless (@threshold_bytes = threshold_bytes) >= 0
+        @directory = directory || ::Dir.tmpdir
+        @buffer = ''
+        @buffer.force_encoding(::Encoding::BINARY)
+        @file = nil
+        @rewound = false
+        @byte_count = 0
+      end
+
+      # @return [TrueClass|FalseClass] true if output has been spilled to file
+      def spilled?; !!@file; end
+
+      # Buffers data in memory or else appends it to the spill file.
+      #
+      # === Parameters
+      # @param [String] data of any kind
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def buffer_data(data)
+        raise ::RightScale::RightPopen::ProcessError, 'Buffer is closed' unless @buffer || @file
+        data = data.to_s
+        @byte_count += data.bytesize
+        if @file
+          if @rewound
+            # append after any reads via to_io.
+            @file.seek(0, ::IO::SEEK_END)
+            @rewound = false
+          end
+          @file.write(data)
+        elsif @byte_count > @threshold_bytes
+          @file = create_spill_file
+          @file.write(@buffer)
+          @file.write(data)
+          @buffer = nil
+        else
+          @buffer << data
+        end
+        true
+      end
+
+      # Provides read access to the captured output from the beginning. the
+      # spill file (if any) is shared with this buffer and so should not be
+      # closed by the caller; use close instead.
+      #
+      # === Return
+      # @return [IO|StringIO] readable stream positioned at start of output
+      def to_io
+        if @file
+          @file.flush
+          @file.rewind
+          @rewound = true
+          @file
+        else
+          ::StringIO.new(@buffer.dup.freeze)
+        end
+      end
+
+      # Reads all captured output. note that this defeats the purpose of the
+      # spill file for very large outputs; prefer to_io in that case.
+      #
+      # === Return
+      # @return [String] all captured output as binary
+      def read
+        to_io.read
+      end
+
+      # Releases the memory buffer and spill file, if any.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def close
+        @buffer = nil
+        if @file
+          @file.close rescue nil
+          @file = nil
+        end
+        true
+      end
+
+      protected
+
+      # Linux can create a file that never has a name (O_TMPFILE) but not all
+      # file systems support it, so fall back to a named temp file that is
+      # unlinked immediately.
+      def create_spill_file
+        file = nil
+        if defined?(::File::TMPFILE)
+          begin
+            file = ::File.open(@directory, ::File::RDWR | ::File::TMPFILE, 0600)
+          rescue ::SystemCallError
+            file = nil
+          end
+        end
+        unless file
+          # note that the Tempfile object must be retained because it closes
+          # the underlying file when finalized.
+          file = ::Tempfile.new('right_popen', @directory)
+          file.unlink
+        end
+        file.binmode
+        file.sync = false
+        file
+      end
+    end
+  end
+end
@@ -33,7 +33,10 @@ module RightScale
 
       HANDLER_NAME_TO_PARAMETER_COUNT = {
         :exit_handler            => 1,
+        :merged_output_handler   => 4,
         :pid_handler             => 1,
+        :resource_handler        => 1,
+        :resource_limit_handler  => 1,
         :size_limit_handler      => 0,
         :stderr_handler          => 1,
         :stdout_handler          => 1,
@@ -64,6 +67,90 @@ else
 end
 EOF
           end
+
+        # optionally deliver the output of both streams to one handler in the
+        # order read, tagging each chunk with its stream, a sequence number
+        # and the monotonic time of the read in nanoseconds.
+        if @merged_output_handler_method
+          if @stdout_handler_method || @stderr_handler_method
+            raise ::ArgumentError, 'merged_output_handler cannot be combined with stdout_handler or stderr_handler'
+          end
+          @output_sequence = 0
+          instance_eval <<EOF
+def stdout_handler(p1)
+  merged_output_handler(:stdout, @output_sequence += 1, ::RightScale::RightPopen.monotonic_nanoseconds, p1)
+end
+def stderr_handler(p1)
+  merged_output_handler(:stderr, @output_sequence += 1, ::RightScale::RightPopen.monotonic_nanoseconds, p1)
+end
+EOF
+        end
+
+        # optionally realign output chunks so that none ends inside of a UTF-8
+        # sequence. any bytes still carried forward are flushed to the output
+        # handlers before the exit handler is called.
+        if options[:utf8_chunks] && @merged_output_handler_method
+          @stdout_handler_aligner = ::RightScale::RightPopen::Utf8ChunkAligner.new
+          @stderr_handler_aligner = ::RightScale::RightPopen::Utf8ChunkAligner.new
+          exit_call = @exit_handler_method ? '@exit_handler_method.call(p1)' : 'true'
+          instance_eval <<EOF
+def merged_output_handler(p1, p2, p3, p4)
+  data = (:stdout == p1 ? @stdout_handler_aligner : @stderr_handler_aligner).align(p4)
+  @merged_output_handler_method.call(p1, p2, p3, data) unless data.empty?
+end
+def exit_handler(p1)
+  [[:stdout, @stdout_handler_aligner], [:stderr, @stderr_handler_aligner]].each do |stream, aligner|
+    data = aligner.flush
+    unless data.empty?
+      @merged_output_handler_method.call(
+        stream, next_output_sequence, ::RightScale::RightPopen.monotonic_nanoseconds, data)
+    end
+  end
+  #{exit_call}
+end
+EOF
+        elsif options[:utf8_chunks]
+          aligned_handler_names = [:stdout_handler, :stderr_handler].select do |handler_name|
+            instance_variable_get("@#{handler_name.to_s}_method")
+          end
+          aligned_handler_names.each do |handler_name|
+            instance_eval <<EOF
+@#{handler_name.to_s}_aligner = ::RightScale::RightPopen::Utf8ChunkAligner.new
+def #{handler_name.to_s}(p1)
+  data = @#{handler_name.to_s}_aligner.align(p1)
+  @#{handler_name.to_s}_method.call(data) unless data.empty?
+end
+EOF
+          end
+          unless aligned_handler_names.empty?
+            flush_list = aligned_handler_names.map do |handler_name|
+              "data = @#{handler_name.to_s}_aligner.flush\n" +
+              "@#{handler_name.to_s}_method.call(data) unless data.empty?\n"
+            end.join
+            exit_call = @exit_handler_method ? '@exit_handler_method.call(p1)' : 'true'
+            instance_eval <<EOF
+def exit_handler(p1)
+#{flush_list}#{exit_call}
+end
+EOF
+          end
+        end
+      end
+
+      # @return [TrueClass|FalseClass] true if output is delivered to the
+      #   merged_output_handler
+      def merged_output?
+        !!@merged_output_handler_method
+      end
+
+      # Takes the next sequence number for merged output, which allows a
+      # reader on another thread (see popen3_reactor) to tag each chunk when
+      # read and deliver it later by calling merged_output_handler.
+      #
+      # === Return
+      # @return [Integer] sequence number
+      def next_output_sequence
+        @output_sequence += 1
       end
     end
 
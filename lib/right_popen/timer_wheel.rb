@@ -0,0 +1,261 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+
+module RightScale
+
+  module RightPopen
+
+    # Provides a hierarchical timer wheel keyed on the monotonic clock so that
+    # the deadlines (timeout, interrupt escalation, watch) of any number of
+    # child processes can be driven by a single wakeup for the earliest of
+    # them. scheduling and cancelling are constant time; a cancelled timer is
+    # removed from its slot at once (and so releases its callback) because the
+    # slot may be skipped by advance and not visited again. each level holds
+    # SLOT_COUNT slots covering SLOT_COUNT times the span of a slot in the
+    # level below; timers are cascaded down a level as their slot comes due.
+    #
+    # not thread-safe; use from the one thread driving the wheel.
+    class TimerWheel
+
+      SLOT_BITS = 6
+      SLOT_COUNT = 1 << SLOT_BITS
+      SLOT_MASK = SLOT_COUNT - 1
+      DEFAULT_RESOLUTION = 0.01
+      DEFAULT_LEVEL_COUNT = 4
+      TICK_TOLERANCE = 1e-6
+
+      # scheduled callback; see TimerWheel#schedule
+      class Timer
+        attr_reader :deadline, :tick
+
+        # slot holding this timer so that cancelling can remove it.
+        attr_accessor :slot
+
+        def initialize(wheel, deadline, tick, callback)
+          @wheel = wheel
+          @deadline = deadline
+          @tick = tick
+          @callback = callback
+          @cancelled = false
+          @fired = false
+        end
+
+        # @return [TrueClass|FalseClass] true if cancelled
+        def cancelled?; @cancelled; end
+
+        # @return [TrueClass|FalseClass] true if neither fired nor cancelled
+        def pending?; !(@cancelled || @fired); end
+
+        # Cancels this timer if still pending.
+        #
+        # === Return
+        # @return [TrueClass] always true
+        def cancel
+          if pending?
+            @cancelled = true
+            @callback = nil
+            @wheel.__send__(:cancelled, self)
+          end
+          true
+        end
+
+        # @return [Object] result of callback
+        def fire
+          @fired = true
+          @callback.call
+        end
+      end
+
+      attr_reader :resolution, :size
+
+      # === Parameters
+      # @param [Float] resolution as seconds per tick
+      # @param [Integer] level_count for range of deadlines (with the default
+      #   resolution, four levels cover about 46 hours before clamping)
+      # @param [Float] now as monotonic seconds to start from
+      def initialize(resolution = DEFAULT_RESOLUTION,
+                     level_count = DEFAULT_LEVEL_COUNT,
+                     now = ::RightScale::RightPopen.monotonic_time)
+        raise ArgumentError.new('resolution is invalid') unless (@resolution = resolution.to_f) > 0
+        raise ArgumentError.new('level_count is invalid') unless (@level_count = level_count) > 0
+        @levels = ::Array.new(@level_count) { ::Array.new(SLOT_COUNT) { {} } }
+        @current_tick = tick_for(now)
+        @max_delta = (1 << (SLOT_BITS * @level_count)) - 1
+        @expired = []
+        @size = 0
+      end
+
+      # @return [TrueClass|FalseClass] true if no timers are pending
+      def empty?; 0 == @size; end
+
+      # Schedules a callback.
+      #
+      # === Parameters
+      # @param [Float] deadline as monotonic seconds
+      # @param [Proc] callback to call when deadline has passed
+      #
+      # === Return
+      # @return [Timer] for cancelling
+      def schedule(deadline, &callback)
+        raise ArgumentError.new('callback is required') unless callback
+        timer = Timer.new(self, deadline, tick_for(deadline, true), callback)
+        place(timer)
+        @size += 1
+        timer
+      end
+
+      # Finds the earliest time at which advance has something to do, which is
+      # either a deadline or else the time to cascade a higher level slot
+      # (after which the next call gives a more precise answer).
+      #
+      # === Return
+      # @return [Float] monotonic seconds or nil if empty
+      def next_deadline
+        tick = next_event_tick
+        tick ? tick * @resolution : nil
+      end
+
+      # Advances the wheel to the given time and fires all timers that are due
+      # in deadline order (to within the resolution). callbacks may schedule
+      # or cancel timers.
+      #
+      # === Parameters
+      # @param [Float] now as monotonic seconds
+      #
+      # === Return
+      # @return [Integer] count of timers fired
+      def advance(now = ::RightScale::RightPopen.monotonic_time)
+        target_tick = tick_for(now)
+        fired = fire_all(@expired)
+        while @current_tick < target_tick && !empty?
+          # skip over ticks having nothing to fire or cascade.
+          if (next_tick = next_event_tick) && next_tick > @current_tick + 1
+            @current_tick = [next_tick, target_tick].min - 1
+          end
+          @current_tick += 1
+          # cascading places timers due on this tick with those already due.
+          cascade
+          fired += fire_all(@levels[0][@current_tick & SLOT_MASK], @expired)
+        end
+        @current_tick = target_tick if @current_tick < target_tick
+        fired
+      end
+
+      protected
+
+      # note the tolerance when rounding down so that advancing to a time given
+      # by next_deadline always reaches the intended tick.
+      def tick_for(time, round_up = false)
+        ticks = time / @resolution
+        round_up ? ticks.ceil : (ticks + TICK_TOLERANCE).floor
+      end
+
+      def next_event_tick
+        return nil if empty?
+        return @current_tick if @expired.any? { |timer| timer.pending? }
+        earliest = nil
+        @level_count.times do |level|
+          shift = SLOT_BITS * level
+          base = @current_tick >> shift
+          slots = @levels[level]
+          (1..SLOT_COUNT).each do |offset|
+            slot_tick = (base + offset) << shift
+            break if earliest && slot_tick >= earliest
+            unless slots[(base + offset) & SLOT_MASK].empty?
+              earliest = slot_tick
+              break
+            end
+          end
+        end
+        earliest
+      end
+
+      def place(timer)
+        delta = timer.tick - @current_tick
+        if delta <= 0
+          timer.slot = nil
+          @expired << timer
+        else
+          tick = timer.tick
+          if delta > @max_delta
+            # clamp to the most distant slot; cascading will place it again.
+            tick = @current_tick + @max_delta
+            delta = @max_delta
+          end
+          level = 0
+          level += 1 while delta >= (1 << (SLOT_BITS * (level + 1)))
+          slot = @levels[level][(tick >> (SLOT_BITS * level)) & SLOT_MASK]
+          slot[timer] = true
+          timer.slot = slot
+        end
+        true
+      end
+
+      # moves timers from each higher level slot that begins at the current
+      # tick down to the levels below.
+      def cascade
+        (1...@level_count).each do |level|
+          shift = SLOT_BITS * level
+          break unless (@current_tick & ((1 << shift) - 1)) == 0
+          slot = @levels[level][(@current_tick >> shift) & SLOT_MASK]
+          next if slot.empty?
+          timers = slot.keys
+          slot.clear
+          timers.each { |timer| place(timer) }
+        end
+        true
+      end
+
+      def fire_all(*slots)
+        timers = []
+        slots.each do |slot|
+          next if slot.empty?
+          timers.concat(slot.kind_of?(::Hash) ? slot.keys : slot)
+          slot.clear
+        end
+        return 0 if timers.empty?
+        fired = 0
+        timers.sort_by { |timer| timer.deadline }.each do |timer|
+          if timer.tick > @current_tick
+            # was clamped to the most distant slot.
+            place(timer) if timer.pending?
+          elsif timer.pending?
+            @size -= 1
+            timer.fire
+            fired += 1
+          end
+        end
+        fired
+      end
+
+      def cancelled(timer)
+        timer.slot.delete(timer) if timer.slot
+        timer.slot = nil
+        @size -= 1
+      end
+    end
+  end
+end
@@ -0,0 +1,225 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+require 'json'
+
+module RightScale
+
+  module RightPopen
+
+    # Records the activity of child processes (phases, reads, handler calls and
+    # interrupts) into a fixed-size ring buffer in memory for export as Chrome
+    # Trace Event JSON, which can be opened in chrome://tracing or Perfetto to
+    # see how children and their handlers overlapped in time. give the same
+    # tracer as the :instrumentation option of every child to be traced.
+    #
+    # recording stores four values into preallocated arrays without a lock or
+    # any allocation. the interpreter lock keeps the slot index consistent but
+    # an export taken while children are running may include a slot that is
+    # still being written. once the buffer is full, the oldest events are
+    # overwritten.
+    class Tracer
+
+      DEFAULT_CAPACITY = 65536
+
+      attr_reader :capacity
+
+      # === Parameters
+      # @param [Integer] capacity as count of events retained
+      def initialize(capacity = DEFAULT_CAPACITY)
+        unless capacity.kind_of?(::Integer) && capacity > 0
+          raise ::ArgumentError, "capacity must be a positive Integer: #{capacity.inspect}"
+        end
+        @capacity = capacity
+        @origin = ::RightScale::RightPopen.monotonic_time
+        clear
+      end
+
+      # Records one event; see Instrumentation.
+      #
+      # === Parameters
+      # @param [Symbol] name of phase, stream or handler
+      # @param [Instrumentation] instrumentation of child
+      # @param [Float] at as monotonic seconds
+      # @param [Object] detail of event or nil
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def record(name, instrumentation, at, detail)
+        index = @next
+        @next = index + 1
+        index %= @capacity
+        @names[index] = name
+        @sources[index] = instrumentation
+        @times[index] = at
+        @details[index] = detail
+        true
+      end
+
+      # Records an Instrumentation::Event (as when used as a plain subscriber).
+      #
+      # === Parameters
+      # @param [Instrumentation::Event] event to record
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def call(event)
+        record(event.name, nil, event.at, event.payload)
+      end
+
+      # @return [Integer] count of events retained
+      def size
+        [@next, @capacity].min
+      end
+
+      # Discards all recorded events.
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def clear
+        @names = ::Array.new(@capacity)
+        @sources = ::Array.new(@capacity)
+        @times = ::Array.new(@capacity)
+        @details = ::Array.new(@capacity)
+        @next = 0
+        true
+      end
+
+      # Converts the retained events to Chrome Trace Event format with a track
+      # for each child (showing its phases, reads and interrupts) and a track
+      # for each handler of each child (showing the time taken by each call).
+      #
+      # === Return
+      # @return [Hash] trace ready to be converted to JSON
+      def to_chrome_trace
+        trace_events = []
+        tracks = {}
+        phases = {}
+        os_pid = ::Process.pid
+        track_for = lambda do |source, handler_name|
+          key = [source.object_id, handler_name]
+          unless tid = tracks[key]
+            tid = tracks[key] = tracks.size + 1
+            child = (source && source.pid) ? "child #{source.pid}" : 'child'
+            trace_events << {
+              'ph' => 'M', 'name' => 'thread_name', 'pid' => os_pid, 'tid' => tid,
+              'args' => { 'name' => handler_name ? "#{child} #{handler_name}" : child } }
+            trace_events << {
+              'ph' => 'M', 'name' => 'thread_sort_index', 'pid' => os_pid, 'tid' => tid,
+              'args' => { 'sort_index' => tid } }
+          end
+          tid
+        end
+        each_event do |name, source, at, detail|
+          event = { 'name' => name.to_s, 'pid' => os_pid, 'ts' => microseconds(at) }
+          case name
+          when :stdout, :stderr
+            event.merge!('ph' => 'i', 's' => 't', 'tid' => track_for.call(source, nil),
+                         'args' => { 'bytes' => detail })
+          else
+            if name.to_s.end_with?('_handler')
+              event.merge!('ph' => 'X', 'tid' => track_for.call(source, name),
+                           'dur' => detail * 1_000_000)
+            else
+              (phases[source] ||= {})[name] = at
+              event.merge!('ph' => 'i', 's' => 't', 'tid' => track_for.call(source, nil))
+              if detail.kind_of?(::Hash)
+                event['args'] = ::Hash[detail.map { |key, value| [key.to_s, value] }]
+              end
+            end
+          end
+          trace_events << event
+        end
+
+        # spans between phases of each child.
+        phases.each do |source, times|
+          [
+            ['popen', :started, :finished],
+            ['spawn', :spawn_started, :spawned],
+            ['run', :spawned, :exit_detected],
+          ].each do |span_name, from, to|
+            if times[from] && times[to]
+              trace_events << {
+                'name' => span_name, 'ph' => 'X', 'pid' => os_pid,
+                'tid' => track_for.call(source, nil),
+                'ts' => microseconds(times[from]),
+                'dur' => (times[to] - times[from]) * 1_000_000 }
+            end
+          end
+        end
+        { 'traceEvents' => trace_events, 'displayTimeUnit' => 'ms' }
+      end
+
+      # Writes the retained events to the given file as Chrome Trace Event JSON.
+      # the file is replaced atomically.
+      #
+      # === Parameters
+      # @param [String] path of file
+      #
+      # === Return
+      # @return [String] path of file
+      def dump(path)
+        temp_path = "#{path}.#{::Process.pid}.tmp"
+        ::File.open(temp_path, 'w') { |f| f.write(::JSON.generate(to_chrome_trace)) }
+        ::File.rename(temp_path, path)
+        path
+      end
+
+      # Dumps the retained events to the given file whenever this process
+      # receives the given signal (in place of any existing handler).
+      #
+      # === Parameters
+      # @param [String] path of file
+      # @param [String] signal name
+      #
+      # === Return
+      # @return [TrueClass] always true
+      def dump_on_signal(path, signal = 'USR2')
+        ::Signal.trap(signal) do
+          # a trap handler cannot synchronize so dump on another thread.
+          ::Thread.new { dump(path) rescue nil }
+        end
+        true
+      end
+
+      protected
+
+      # yields retained events from oldest to newest.
+      def each_event
+        last = @next
+        first = [last - @capacity, 0].max
+        (first...last).each do |sequence|
+          index = sequence % @capacity
+          yield(@names[index], @sources[index], @times[index], @details[index])
+        end
+        true
+      end
+
+      def microseconds(at)
+        (at - @origin) * 1_000_000
+      end
+    end
+  end
+end
@@ -0,0 +1,115 @@
+#--
+# Copyright (c) 2013 RightScale Inc
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+# WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'rubygems'
+require 'right_popen'
+
+module RightScale
+
+  module RightPopen
+
+    # Realigns chunks of output (from a child process) so that no chunk ends
+    # inside of a multibyte UTF-8 sequence. the incomplete tail of a chunk is
+    # carried forward and prepended to the next chunk. each aligned chunk is
+    # tagged as UTF-8 when valid or else as binary so that handlers do not need
+    # to re-scan the data.
+    class Utf8ChunkAligner
+
+      # maximum number of bytes that can be carried forward (i.e. the longest
+      # UTF-8 sequence minus one).
+      MAX_TAIL_SIZE = 3
+
+      attr_reader :tail
+
+      def initialize
+        @tail = nil
+      end
+
+      # Aligns the given chunk by carrying forward any incomplete trailing
+      # sequence.
+      #
+      # === Parameters
+      # @param [String] data as raw chunk
+      #
+      # === Return
+      # @return [String] aligned chunk, which is empty if all bytes were carried
+      def align(data)
+        data = data.dup.force_encoding(::Encoding::BINARY)
+        if @tail
+          data = @tail << data
+          @tail = nil
+        end
+        tail_offset = incomplete_tail_offset(data)
+        if tail_offset
+          @tail = data.byteslice(tail_offset, data.bytesize - tail_offset)
+          data = data.byteslice(0, tail_offset)
+        end
+        tag(data)
+      end
+
+      # Releases any bytes still carried forward. the result is tagged binary
+      # because a carried tail is by definition an incomplete sequence.
+      #
+      # === Return
+      # @return [String] remaining bytes or empty
+      def flush
+        data = @tail || ''
+        @tail = nil
+        tag(data)
+      end
+
+      protected
+
+      # @return [Integer] byte offset of an incomplete trailing sequence or nil
+      def incomplete_tail_offset(data)
+        size = data.bytesize
+        lower = [size - MAX_TAIL_SIZE, 0].max
+        offset = size - 1
+        while offset >= lower
+          byte = data.getbyte(offset)
+          if byte < 0x80
+            # ascii cannot begin a tail.
+            return nil
+          elsif byte >= 0xC0
+            # lead byte; the sequence is incomplete if it needs more bytes than
+            # remain in the chunk.
+            needed = (byte >= 0xF0) ? 4 : ((byte >= 0xE0) ? 3 : 2)
+            return (size - offset < needed) ? offset : nil
+          end
+          # continuation byte; keep looking for the lead byte.
+          offset -= 1
+        end
+        nil
+      end
+
+      # note that String#valid_encoding? is implemented natively by the ruby VM
+      # and scans ascii runs a word at a time, which is as fast as we can get
+      # without a native extension.
+      def tag(data)
+        data.force_encoding(::Encoding::UTF_8)
+        data.force_encoding(::Encoding::BINARY) unless data.valid_encoding?
+        data
+      end
+    end
+  end
+end
@@ -24,6 +24,7 @@
 require 'rubygems'
 require 'eventmachine'
 require 'right_popen'
+require 'right_popen/async_timers'
 
 module RightScale::RightPopen
 
@@ -248,7 +249,7 @@ module RightScale::RightPopen
   end
 
   # watches process for interrupt criteria. doubles the wait time up to a
-  # maximum of 1 second for next wait.
+  # maximum of 1 second for next wait. see schedule_async_timer.
   #
   # === Parameters
   # @param [Process] process that was run
@@ -258,7 +259,7 @@ module RightScale::RightPopen
   # === Return
   # true:: Always return true
   def self.watch_process(process, wait_time, target)
-    ::EM::Timer.new(wait_time) do
+    ::RightScale::RightPopen.schedule_async_timer(process.next_check_time(wait_time)) do
       begin
         if process.alive?
           if process.timer_expired? || process.size_limit_exceeded?
@@ -0,0 +1,139 @@
+#--  -*- mode: ruby; encoding: utf-8 -*-
+# Copyright: Copyright (c) 2013 RightScale, Inc.
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# 'Software'), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+# CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+# TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#++
+
+require 'thread'
+
+module RightScale
+  module RightPopen
+
+    # minimal Fiber.scheduler (ruby 3.0+) for specs so that the fiber-based
+    # async implementation can be tested without an async framework gem. runs
+    # all scheduled fibers to completion when closed.
+    class SpecFiberScheduler
+
+      def initialize
+        @readable = {}
+        @writable = {}
+        @waiting = {}
+        @blocked = 0
+        @ready = []
+        @lock = ::Mutex.new
+        @urgent_r, @urgent_w = ::IO.pipe
+      end
+
+      def run
+        while !@readable.empty? || !@writable.empty? || !@waiting.empty? || @blocked > 0 || !ready_empty?
+          timeout = nil
+          unless @waiting.empty?
+            timeout = [@waiting.values.min - now, 0].max
+          end
+          readable, writable = ::IO.select(@readable.keys + [@urgent_r], @writable.keys, [], timeout)
+          resumable = []
+          (readable || []).each do |io|
+            if io == @urgent_r
+              @urgent_r.read_nonblock(1024, :exception => false)
+            else
+              resumable << @readable.delete(io)
+            end
+          end
+          (writable || []).each { |io| resumable << @writable.delete(io) }
+          current = now
+          @waiting.select { |fiber, wake_at| wake_at <= current }.each_key do |fiber|
+            @waiting.delete(fiber)
+            resumable << fiber
+          end
+          @lock.synchronize do
+            resumable.concat(@ready)
+            @ready.clear
+          end
+          resumable.compact.uniq.each { |fiber| fiber.resume if fiber.alive? }
+        end
+      end
+
+      def close
+        run
+      ensure
+        @urgent_r.close rescue nil
+        @urgent_w.close rescue nil
+      end
+
+      def fiber(&block)
+        fiber = ::Fiber.new(:blocking => false, &block)
+        fiber.resume
+        fiber
+      end
+
+      def io_wait(io, events, timeout)
+        fiber = ::Fiber.current
+        @readable[io] = fiber if (events & ::IO::READABLE) != 0
+        @writable[io] = fiber if (events & ::IO::WRITABLE) != 0
+        @waiting[fiber] = now + timeout if timeout
+        ::Fiber.yield
+        ready = @readable[io] != fiber && @writable[io] != fiber
+        @readable.delete(io) if @readable[io] == fiber
+        @writable.delete(io) if @writable[io] == fiber
+        @waiting.delete(fiber)
+        ready ? events : false
+      end
+
+      def kernel_sleep(duration = nil)
+        @waiting[::Fiber.current] = now + duration if duration
+        ::Fiber.yield
+        true
+      end
+
+      def block(blocker, timeout = nil)
+        @blocked += 1
+        @waiting[::Fiber.current] = now + timeout if timeout
+        ::Fiber.yield
+      ensure
+        @blocked -= 1
+        @waiting.delete(::Fiber.current)
+      end
+
+      def unblock(blocker, fiber)
+        @lock.synchronize { @ready << fiber }
+        @urgent_w.write_nonblock('.', :exception => false)
+      end
+
+      # polls rather than blocking a helper thread on waitpid.
+      def process_wait(pid, flags)
+        while (status = ::Process::Status.wait(pid, flags | ::Process::WNOHANG)).nil?
+          return nil if (flags & ::Process::WNOHANG) != 0
+          kernel_sleep(0.01)
+        end
+        status
+      end
+
+      private
+
+      def ready_empty?
+        @lock.synchronize { @ready.empty? }
+      end
+
+      def now
+        ::Process.clock_gettime(::Process::CLOCK_MONOTONIC)
+      end
+    end
+  end
+end
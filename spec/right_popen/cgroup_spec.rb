@@ -0,0 +1,130 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+require ::File.expand_path('../../fiber_scheduler', __FILE__)
+
+describe 'RightScale::RightPopen::Cgroup' do
+
+  let(:cgroup_class) { ::RightScale::RightPopen::Cgroup }
+
+  # the cgroup v2 mount is the delegated parent when running as root.
+  let(:parent) { cgroup_class.mount_point }
+
+  before(:each) do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+  end
+
+  def require_writable_cgroups
+    if parent && (cgroup = cgroup_class.create(parent))
+      cgroup.remove
+    else
+      pending 'No writable cgroup v2 hierarchy'
+    end
+  end
+
+  # a killed orphan may remain a zombie until init reaps it.
+  def pid_alive?(pid)
+    state = ::File.read("/proc/#{pid}/stat").split(') ').last.to_s[0, 1]
+    state != 'Z'
+  rescue ::Errno::ENOENT
+    false
+  end
+
+  it 'should account usage of the child in a cgroup of its own' do
+    require_writable_cgroups
+    stdout, _, status = ::RightScale::RightPopen.capture(
+      [RUBY_CMD, '-e', 'print ::File.read("/proc/self/cgroup"); x = 0; 300000.times { x += 1 }'],
+      :cgroup => parent)
+    status.success?.should be_true
+    path = stdout[/^0::(.*)$/, 1]
+    path.should =~ /right_popen-#{::Process.pid}-\d+\z/
+    stats = status.cgroup_stats
+    stats.cpu_usage_usec.should > 0
+    stats.cpu_usage_usec.should >= stats.cpu_user_usec
+    ::File.directory?(::File.join(parent, path)).should be_false
+  end
+
+  it 'should kill the whole tree with the child when interrupted' do
+    require_writable_cgroups
+    started_at = ::Time.now
+    stdout, _, _ = ::RightScale::RightPopen.capture(
+      ['sh', '-c', 'sleep 100 & echo $!; sleep 100 & echo $!; wait'],
+      :cgroup => parent, :timeout_seconds => 0.5)
+    (::Time.now - started_at).should < 5
+    pids = stdout.split.map { |pid| pid.to_i }
+    pids.size.should == 2
+    sleep 0.1 if pids.any? { |pid| pid_alive?(pid) }
+    pids.select { |pid| pid_alive?(pid) }.should == []
+  end
+
+  it 'should share a batch cgroup among children until removed' do
+    require_writable_cgroups
+    cgroup = cgroup_class.create(parent)
+    begin
+      2.times do
+        stdout, _, status = ::RightScale::RightPopen.capture(['cat', '/proc/self/cgroup'], :cgroup => cgroup)
+        stdout.should =~ /^0::.*#{::File.basename(cgroup.path)}$/
+        status.cgroup_stats.cpu_usage_usec.should > 0
+      end
+      ::File.directory?(cgroup.path).should be_true
+      cgroup.populated?.should be_false
+    ensure
+      cgroup.remove.should be_true
+    end
+    ::File.directory?(cgroup.path).should be_false
+  end
+
+  it 'should fall back to running without a cgroup when unavailable' do
+    nosuchparent = ::File.join(parent || '/sys/fs/cgroup', 'right_popen-nosuchparent')
+    stdout, _, status = ::RightScale::RightPopen.capture(['echo', 'hello'], :cgroup => nosuchparent)
+    stdout.should == "hello\n"
+    status.success?.should be_true
+    status.cgroup_stats.should be_nil
+  end
+
+  it 'should fall back when a limit cannot be applied' do
+    require_writable_cgroups
+    if ::File.read(::File.join(parent, 'cgroup.subtree_control')) =~ /\bpids\b/
+      pending 'pids controller is enabled so pids.max applies'
+    end
+    stdout, _, status = ::RightScale::RightPopen.capture(
+      ['echo', 'hello'], :cgroup => parent, :cgroup_limits => { :pids_max => 16 })
+    stdout.should == "hello\n"
+    status.cgroup_stats.should be_nil
+  end
+
+  it 'should raise for invalid limits before fork' do
+    [
+      { :memory_min => 1 },
+      { :memory_max => -1 },
+      { :cpu_max => :half },
+    ].each do |limits|
+      expect do
+        ::RightScale::RightPopen.capture(['true'], :cgroup => parent || '/', :cgroup_limits => limits)
+      end.to raise_exception(::ArgumentError, /cgroup_limits/)
+    end
+    expect do
+      ::RightScale::RightPopen.capture(['true'], :cgroup_limits => { :pids_max => 16 })
+    end.to raise_exception(::ArgumentError, /cgroup_limits require a cgroup/)
+    cgroup_class.limit_values_for(:cpu_max => 0.5, :memory_max => 'max').should ==
+      [['cpu.max', '50000 100000'], ['memory.max', 'max']]
+  end
+
+  it 'should raise invalid limits to the caller of popen3_async' do
+    pending 'Requires ruby 3.0+' unless ::Fiber.respond_to?(:set_scheduler)
+    errors = []
+    ::Thread.new do
+      ::Fiber.set_scheduler(::RightScale::RightPopen::SpecFiberScheduler.new)
+      [
+        { :cgroup => parent || '/', :cgroup_limits => { :memory_min => 1 } },
+        { :cgroup_limits => { :pids_max => 16 } },
+      ].each do |options|
+        begin
+          ::RightScale::RightPopen.popen3_async('true', { :target => ::Object.new }.merge(options))
+        rescue ::ArgumentError => e
+          errors << e.message
+        end
+      end
+    end.join
+    errors.size.should == 2
+    errors.each { |message| message.should =~ /cgroup_limits/ }
+  end
+end
@@ -0,0 +1,59 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+require 'stringio'
+require 'zlib'
+
+describe RightScale::RightPopen::CompressedOutputBuffer do
+
+  let(:lines) { (1..1000).map { |i| "line #{i} of some fairly repetitive output\n" } }
+  let(:text)  { lines.join }
+
+  context 'given a default buffer' do
+    subject { described_class.new }
+
+    it 'should accumulate gzip output and count bytes' do
+      lines.each { |line| subject.compress_data(line).should be_true }
+      subject.finish.should be_true
+      subject.finished?.should be_true
+      subject.raw_byte_count.should == text.bytesize
+      subject.compressed_byte_count.should == subject.compressed_text.bytesize
+      (subject.compressed_byte_count < subject.raw_byte_count / 5).should be_true
+      ::Zlib::GzipReader.new(::StringIO.new(subject.compressed_text)).read.should == text
+    end
+
+    it 'should refuse data after finish' do
+      subject.finish
+      expect { subject.compress_data('late') }.
+        to raise_exception(::RightScale::RightPopen::ProcessError)
+    end
+  end
+
+  context 'given a sink and deflate format' do
+    let(:sink) { ::StringIO.new }
+    subject { described_class.new(sink, :deflate) }
+
+    it 'should write compressed blocks to sink' do
+      lines.each { |line| subject.compress_data(line) }
+      subject.finish
+      subject.compressed_text.should be_empty
+      sink.string.bytesize.should == subject.compressed_byte_count
+      ::Zlib::Inflate.inflate(sink.string).should == text
+    end
+  end
+
+  context 'given a block handler' do
+    it 'should yield compressed blocks' do
+      blocks = []
+      buffer = described_class.new { |block| blocks << block }
+      lines.each { |line| buffer.compress_data(line) }
+      buffer.finish
+      blocks.should_not be_empty
+      blocks.join.bytesize.should == buffer.compressed_byte_count
+    end
+  end
+
+  it 'should reject unknown formats' do
+    expect { described_class.new(nil, :bogus) }.to raise_exception(::ArgumentError)
+  end
+
+end
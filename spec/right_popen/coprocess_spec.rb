@@ -0,0 +1,130 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe RightScale::RightPopen::Coprocess do
+
+  def script_path_for(name)
+    ::File.expand_path(::File.join(::File.dirname(__FILE__), 'scripts', "#{name}.rb"))
+  end
+
+  let(:command) { [RUBY_CMD, script_path_for('coprocess')] }
+  let(:options) { {} }
+
+  subject { described_class.new(command, options) }
+
+  before(:each) do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+  end
+
+  after(:each) { subject.close }
+
+  it 'should serve many requests from one child' do
+    responses = (1..5).map { |i| subject.request("request #{i}") }
+    pid = subject.pid
+    pid.should > 0
+    responses.should == (1..5).map { |i| "#{pid}:request #{i}" }
+    subject.start_count.should == 1
+    subject.request_count.should == 5
+  end
+
+  context 'with length framing' do
+    let(:command) { [RUBY_CMD, script_path_for('coprocess'), 'length'] }
+    let(:options) { { :framing => :length } }
+
+    it 'should pass binary data and newlines' do
+      data = "multiple\nlines\0" + (0..255).map { |i| i.chr }.join
+      data.force_encoding(::Encoding::BINARY)
+      subject.request(data).should == "#{subject.pid}:#{data}"
+      big = 'x' * 1024 * 1024
+      subject.request(big).bytesize.should == big.bytesize + subject.pid.to_s.size + 1
+    end
+  end
+
+  context 'with max_requests' do
+    let(:options) { { :max_requests => 2 } }
+
+    it 'should restart the child after max_requests' do
+      pids = (1..5).map { subject.request('hello').split(':').first.to_i }
+      pids.uniq.size.should == 3
+      subject.start_count.should == 3
+    end
+  end
+
+  context 'with a target' do
+    let(:target) do
+      ::Class.new do
+        attr_reader :pids, :statuses, :stderr_text
+        def initialize; @pids = []; @statuses = []; @stderr_text = ''; end
+        def on_pid(pid); @pids << pid; end
+        def on_exit(status); @statuses << status; end
+        def on_stderr(data); @stderr_text << data; end
+      end.new
+    end
+    let(:options) do
+      { :target         => target,
+        :pid_handler    => :on_pid,
+        :exit_handler   => :on_exit,
+        :stderr_handler => :on_stderr }
+    end
+
+    it 'should restart the child after it crashes' do
+      first_pid = subject.request('hello').split(':').first.to_i
+      expect { subject.request('crash') }.
+        to raise_exception(::RightScale::RightPopen::ProcessError, /exited during request/)
+      target.statuses.size.should == 1
+      target.statuses.first.exitstatus.should == 99
+      subject.request('hello').should_not == "#{first_pid}:hello"
+      target.pids.size.should == 2
+    end
+
+    it 'should pass stderr to handler' do
+      subject.request('stderr').should == "#{subject.pid}:stderr"
+      subject.request('hello')
+      target.stderr_text.should == "to stderr\n"
+    end
+
+    it 'should stop the child when a request times out' do
+      started_at = ::Time.now
+      expect { subject.request('sleep', 0.2) }.
+        to raise_exception(described_class::TimeoutError)
+      (::Time.now - started_at).should < 2
+      target.statuses.size.should == 1
+      target.statuses.first.success?.should be_false
+      subject.request('hello').should == "#{subject.pid}:hello"
+    end
+  end
+
+  it 'should raise for invalid executables' do
+    coprocess = described_class.new(['nosuchexecutable'])
+    expect { coprocess.request('hello') }.
+      to raise_exception(::RightScale::RightPopen::ProcessError, /nosuchexecutable/)
+    coprocess.alive?.should be_false
+  end
+
+  it 'should refuse requests once closed' do
+    subject.request('hello')
+    subject.close
+    subject.alive?.should be_false
+    expect { subject.request('hello') }.
+      to raise_exception(::RightScale::RightPopen::ProcessError, /closed/)
+  end
+
+  context RightScale::RightPopen::CoprocessPool do
+    subject { RightScale::RightPopen::CoprocessPool.new(command, :pool_size => 2) }
+
+    it 'should serve concurrent requests from a fixed number of children' do
+      responses = ::Queue.new
+      threads = (1..4).map do |i|
+        ::Thread.new do
+          5.times { |j| responses << subject.request("request #{i}.#{j}") }
+        end
+      end
+      threads.each { |thread| thread.join }
+      pids = []
+      pids << responses.pop.split(':').first.to_i until responses.empty?
+      pids.size.should == 20
+      pids.uniq.size.should <= 2
+      subject.pids.sort.should == pids.uniq.sort
+    end
+  end
+
+end
@@ -0,0 +1,49 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe RightScale::RightPopen::ExecFailure do
+
+  def popen3_sync_error(cmd, options = {})
+    ::RightScale::RightPopen.popen3_sync(cmd, { :target => ::Object.new }.merge(options))
+    nil
+  rescue ::RightScale::RightPopen::ProcessError => e
+    e
+  end
+
+  it 'should round trip a system call error as a fixed size record' do
+    record = described_class.encode(:exec, ::Errno::ENOENT.new('nosuchexecutable'))
+    record.bytesize.should == described_class::RECORD_SIZE
+    error = described_class.decode(record)
+    error.kind_of?(::RightScale::RightPopen::ProcessError).should be_true
+    error.message.should == 'Errno::ENOENT: No such file or directory - nosuchexecutable'
+    error.stage.should == :exec
+    error.errno.should == ::Errno::ENOENT::Errno
+  end
+
+  it 'should truncate long messages and omit errno for other errors' do
+    record = described_class.encode(:user, ::ArgumentError.new('x' * 1000))
+    record.bytesize.should == described_class::RECORD_SIZE
+    error = described_class.decode(record)
+    error.message.bytesize.should == described_class::MESSAGE_SIZE
+    error.message.should =~ /\AArgumentError: xxx/
+    error.stage.should == :user
+    error.errno.should be_nil
+  end
+
+  it 'should not trust an unrecognized record' do
+    error = described_class.decode("--- !ruby/object:Object {}\n")
+    error.message.should =~ /unrecognized status/
+    error.stage.should be_nil
+  end
+
+  it 'should report the stage at which the child failed' do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+    error = popen3_sync_error(['nosuchexecutable'])
+    error.message.should =~ /nosuchexecutable/
+    error.stage.should == :exec
+    error.errno.should == ::Errno::ENOENT::Errno
+
+    error = popen3_sync_error('true', :directory => '/nosuchdirectory')
+    error.message.should =~ /nosuchdirectory/
+    error.stage.should == :directory
+  end
+end
@@ -0,0 +1,125 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+require 'tmpdir'
+
+describe RightScale::RightPopen::Governor do
+
+  let(:directory) { ::Dir.mktmpdir }
+  let(:options)   { { :directory => directory, :max_children => 2 } }
+
+  subject { described_class.new(options) }
+
+  before(:each) do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+  end
+
+  after(:each) { ::FileUtils.rm_rf(directory) }
+
+  it 'should cap concurrent permits across governors sharing a name' do
+    # each governor stands in for a separate agent process.
+    other = described_class.new(options)
+    first = subject.acquire
+    second = other.acquire
+    expect { subject.acquire(0, 0.1) }.to raise_error(described_class::AdmissionTimeout)
+    second.release
+    third = subject.acquire(0, 1)
+    third.released?.should be_false
+    [first, third].each { |permit| permit.release }
+    subject.stats[:timed_out].should == 1
+    subject.stats[:admitted].should == 2
+  end
+
+  it 'should not share slots between different names' do
+    other = described_class.new(options.merge(:name => 'other', :max_children => 1))
+    2.times { subject.acquire }
+    other.acquire(0, 0.1).should be_kind_of(described_class::Permit)
+  end
+
+  it 'should admit waiting requests in priority order' do
+    held = 2.times.map { subject.acquire }
+    admitted = ::Queue.new
+    threads = [[1, :low], [5, :high], [1, :low2]].map do |priority, name|
+      thread = ::Thread.new do
+        permit = subject.acquire(priority)
+        admitted << name
+        permit.release
+      end
+      sleep 0.05
+      thread
+    end
+    subject.stats[:waiting].should == 3
+    held.each { |permit| permit.release }
+    threads.each { |thread| thread.join }
+    3.times.map { admitted.pop }.should == [:high, :low, :low2]
+    stats = subject.stats
+    stats[:waiting].should == 0
+    stats[:max_wait_seconds].should > 0.05
+    stats[:mean_wait_seconds].should <= stats[:max_wait_seconds]
+  end
+
+  it 'should keep its default directory and lock files private' do
+    path = ::File.join(directory, 'private')
+    described_class.private_directory(path).should == path
+    (::File.stat(path).mode & 0777).should == 0700
+    ::File.chmod(0755, path)
+    expect { described_class.private_directory(path) }.
+      to raise_exception(::RightScale::RightPopen::ProcessError, /not private/)
+    link = ::File.join(directory, 'link')
+    ::File.chmod(0700, path)
+    ::File.symlink(path, link)
+    expect { described_class.private_directory(link) }.
+      to raise_exception(::RightScale::RightPopen::ProcessError, /not private/)
+
+    subject.acquire.release
+    slots = ::Dir.glob(::File.join(directory, 'default.slot*'))
+    slots.should_not be_empty
+    slots.each { |slot| (::File.stat(slot).mode & 0777).should == 0600 }
+  end
+
+  it 'should not open lock files through a symlink' do
+    victim = ::File.join(directory, 'victim')
+    ::File.open(victim, 'w') { |f| f.write('unchanged') }
+    ::File.symlink(victim, ::File.join(directory, 'default.slot0'))
+    governor = described_class.new(:directory => directory, :max_children => 1)
+    expect { governor.acquire(0, 0.1) }.to raise_exception(::SystemCallError)
+    ::File.read(victim).should == 'unchanged'
+  end
+
+  context 'with spawns_per_second' do
+    let(:options) { { :directory => directory, :max_children => 10, :spawns_per_second => 20, :burst => 1 } }
+
+    it 'should limit the rate of permits' do
+      started_at = ::RightScale::RightPopen.monotonic_time
+      4.times { subject.acquire.release }
+      (::RightScale::RightPopen.monotonic_time - started_at).should >= 0.14
+    end
+  end
+
+  context 'with popen3_sync' do
+    let(:options) { { :directory => directory, :max_children => 1 } }
+
+    it 'should hold a slot for the life of each child' do
+      runs = ::Queue.new
+      threads = 3.times.map do
+        ::Thread.new do
+          times = []
+          target = ::Object.new
+          target.define_singleton_method(:on_pid) { |pid| times << ::RightScale::RightPopen.monotonic_time }
+          target.define_singleton_method(:on_exit) { |status| times << ::RightScale::RightPopen.monotonic_time }
+          ::RightScale::RightPopen.popen3_sync(
+            'sleep 0.2',
+            :target       => target,
+            :pid_handler  => :on_pid,
+            :exit_handler => :on_exit,
+            :governor     => subject)
+          runs << times
+        end
+      end
+      threads.each { |thread| thread.join }
+      intervals = 3.times.map { runs.pop }.sort_by { |times| times.first }
+      intervals.each_cons(2) { |a, b| b.first.should >= a.last }
+      subject.stats[:admitted].should == 3
+      subject.acquire(0, 0.1).release
+    end
+  end
+
+end
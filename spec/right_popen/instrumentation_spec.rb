@@ -0,0 +1,87 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe RightScale::RightPopen::Instrumentation do
+
+  let(:events) { [] }
+  let(:subscriber) { lambda { |event| events << event } }
+
+  before(:each) do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+  end
+
+  def names
+    events.map { |event| event.name }
+  end
+
+  it 'should report each phase of popen3_sync in order' do
+    target = ::Object.new
+    target.define_singleton_method(:on_stdout) { |data| true }
+    ::RightScale::RightPopen.popen3_sync(
+      'echo hello',
+      :target          => target,
+      :stdout_handler  => :on_stdout,
+      :instrumentation => subscriber)
+    names.should == [
+      :started, :options_merged, :target_built, :spawn_started, :gc_finished,
+      :forked, :spawned, :exec_completed, :first_output, :exit_detected,
+      :drained, :finished]
+    times = events.map { |event| event.at }
+    times.should == times.sort
+    events.first.pid.should be_nil
+    events.last.pid.should be_kind_of(::Integer)
+    events.find { |event| :exit_detected == event.name }.payload[:exited_at].should be_kind_of(::Float)
+    counters = events.last.payload
+    counters[:reads].should >= 1
+    counters[:bytes].should == 6
+    counters[:handler_calls].should >= 3  # pid, watch, stdout and exit
+  end
+
+  it 'should count reads and bytes for capture' do
+    stdout, _, status = ::RightScale::RightPopen.capture(
+      'head -c 100000 /dev/zero', :instrumentation => subscriber)
+    status.success?.should be_true
+    stdout.bytesize.should == 100000
+    names.first.should == :started
+    events.last.payload[:bytes].should == 100000
+  end
+
+  it 'should not report exec for a command that cannot execute' do
+    expect do
+      ::RightScale::RightPopen.popen3_sync(
+        ['nosuchexecutable'], :target => ::Object.new, :instrumentation => subscriber)
+    end.to raise_error(::RightScale::RightPopen::ProcessError)
+    names.should include(:exit_detected)
+    names.should_not include(:exec_completed)
+  end
+
+  it 'should require a callable subscriber' do
+    expect { described_class.new(::Object.new) }.to raise_error(::ArgumentError)
+  end
+
+  it 'should not attach without a subscriber' do
+    options = { :instrumentation => nil }
+    described_class.attach(options).should be_nil
+    options[:instrumentation].should be_nil
+  end
+
+  it 'should give each child of a restarted coprocess its own instrumentation' do
+    recorded = []
+    recorder = ::Object.new
+    recorder.define_singleton_method(:call) { |event| true }
+    recorder.define_singleton_method(:record) do |name, instrumentation, at, detail|
+      recorded << [instrumentation, instrumentation.pid] if :spawned == name
+    end
+    options = { :max_requests => 1, :instrumentation => recorder }
+    script_path = ::File.expand_path(::File.join(::File.dirname(__FILE__), 'scripts', 'coprocess.rb'))
+    coprocess = ::RightScale::RightPopen::Coprocess.new([RUBY_CMD, script_path], options)
+    begin
+      pids = (1..2).map { coprocess.request('hello').split(':').first.to_i }
+      recorded.map { |instrumentation, pid| pid }.should == pids
+      recorded.map { |instrumentation, pid| instrumentation }.uniq.size.should == 2
+    ensure
+      coprocess.close
+    end
+    options[:instrumentation].equal?(recorder).should be_true
+  end
+
+end
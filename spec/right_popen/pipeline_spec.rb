@@ -0,0 +1,66 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe RightScale::RightPopen::Pipeline do
+
+  before(:each) do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+  end
+
+  it 'should connect the stages' do
+    result = ::RightScale::RightPopen.pipeline(
+      ["printf 'b\\na\\nc\\n'", 'sort', ['tr', 'a-z', 'A-Z']])
+    result.stdout.should == "A\nB\nC\n"
+    result.stderrs.should == ['', '', '']
+    result.statuses.map { |status| status.pid }.uniq.size.should == 3
+    result.success?.should be_true
+    result.failed_stage.should be_nil
+  end
+
+  it 'should stream input to the first stage' do
+    result = ::RightScale::RightPopen.pipeline(['cat', 'wc -c'], :input => 'x' * 100_000)
+    result.stdout.strip.should == '100000'
+  end
+
+  it 'should pass large output between stages' do
+    result = ::RightScale::RightPopen.pipeline(['head -c 5000000 /dev/zero', 'wc -c'])
+    result.stdout.strip.should == '5000000'
+    result.success?.should be_true
+  end
+
+  it 'should report stderr and status of each stage' do
+    result = ::RightScale::RightPopen.pipeline(
+      ['echo one >&2; echo data', 'cat; echo two >&2; exit 3', 'cat'])
+    result.stdout.should == "data\n"
+    result.stderrs.should == ["one\n", "two\n", '']
+    result.statuses.map { |status| status.exitstatus }.should == [0, 3, 0]
+    result.success?.should be_false
+    result.failed_stage.should == 1
+  end
+
+  it 'should interrupt all stages on timeout' do
+    started_at = ::Time.now
+    result = ::RightScale::RightPopen.pipeline(
+      ['sleep 10', 'sleep 10'], :timeout_seconds => 0.3)
+    (::Time.now - started_at).should < 5
+    result.timed_out?.should be_true
+    result.statuses.each { |status| status.success?.should be_false }
+  end
+
+  it 'should interrupt all stages when asked from another thread' do
+    pipeline = described_class.new(['sleep 10', 'cat', 'cat'])
+    interrupter = ::Thread.new { sleep 0.2; pipeline.interrupt }
+    started_at = ::Time.now
+    result = pipeline.run
+    interrupter.join
+    (::Time.now - started_at).should < 5
+    result.timed_out?.should be_false
+    result.statuses.first.success?.should be_false
+  end
+
+  it 'should raise for a stage that cannot execute' do
+    expect do
+      ::RightScale::RightPopen.pipeline([['echo', 'hello'], ['nosuchexecutable']])
+    end.to raise_exception(::RightScale::RightPopen::ProcessError, /nosuchexecutable/)
+  end
+
+end
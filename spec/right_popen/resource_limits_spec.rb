@@ -0,0 +1,108 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+require ::File.expand_path('../../fiber_scheduler', __FILE__)
+require 'tmpdir'
+
+describe 'RightScale::RightPopen::ResourceLimits' do
+
+  before(:each) do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+  end
+
+  def run(cmd, options)
+    target = ::Object.new
+    target.define_singleton_method(:output) { @output ||= '' }
+    target.define_singleton_method(:on_output) { |data| output << data }
+    target.define_singleton_method(:on_timeout) { @timed_out = true }
+    target.define_singleton_method(:on_size_limit) { @size_limit_exceeded = true }
+    target.define_singleton_method(:on_exit) { |status| @status = status }
+    ::RightScale::RightPopen.popen3_sync(
+      cmd,
+      {
+        :target             => target,
+        :stdout_handler     => :on_output,
+        :timeout_handler    => :on_timeout,
+        :size_limit_handler => :on_size_limit,
+        :exit_handler       => :on_exit,
+      }.merge(options))
+    target
+  end
+
+  it 'should set limits in the child before exec' do
+    target = run(
+      ['sh', '-c', 'ulimit -n; ulimit -c; ulimit -Hn'],
+      :rlimits => { :nofile => [64, 128], :RLIMIT_CORE => 0 })
+    target.output.split.should == ['64', '0', '128']
+    target.instance_variable_get(:@status).success?.should be_true
+  end
+
+  it 'should report SIGXCPU as a timeout without watching' do
+    started_at = ::Time.now
+    target = run([RUBY_CMD, '-e', 'loop {}'], :rlimits => { :cpu => 1 })
+    (::Time.now - started_at).should < 5
+    target.instance_variable_get(:@timed_out).should be_true
+    target.instance_variable_get(:@size_limit_exceeded).should be_nil
+    target.instance_variable_get(:@status).termsig.should == ::Signal.list['XCPU']
+  end
+
+  it 'should report SIGXFSZ as exceeding the size limit' do
+    ::Dir.mktmpdir do |dir|
+      target = run(
+        ['dd', 'if=/dev/zero', "of=#{::File.join(dir, 'big')}", 'bs=4096', 'count=16'],
+        :rlimits => { 'fsize' => 8192 })
+      target.instance_variable_get(:@size_limit_exceeded).should be_true
+      target.instance_variable_get(:@timed_out).should be_nil
+      ::File.size(::File.join(dir, 'big')).should == 8192
+    end
+  end
+
+  it 'should report SIGXFSZ of a command run by the shell as exceeding the size limit' do
+    ::Dir.mktmpdir do |dir|
+      # the shell outlives dd and exits with 128 plus the signal.
+      target = run(
+        "dd if=/dev/zero of=#{::File.join(dir, 'big')} bs=4096 count=16 2>/dev/null; exit $?",
+        :rlimits => { 'fsize' => 8192 })
+      target.instance_variable_get(:@status).exitstatus.should == 128 + ::Signal.list['XFSZ']
+      target.instance_variable_get(:@size_limit_exceeded).should be_true
+      target.instance_variable_get(:@timed_out).should be_nil
+    end
+  end
+
+  it 'should raise for invalid limits before fork' do
+    [
+      { :stack => 1 },
+      { :cpu => -1 },
+      { :nofile => [128, 64] },
+      { :nofile => 'many' },
+      [:cpu, 1],
+    ].each do |rlimits|
+      expect { run('true', :rlimits => rlimits) }.to raise_exception(::ArgumentError, /rlimits/)
+    end
+  end
+
+  it 'should raise invalid limits to the caller of popen3_async' do
+    pending 'Requires ruby 3.0+' unless ::Fiber.respond_to?(:set_scheduler)
+    error = nil
+    ::Thread.new do
+      ::Fiber.set_scheduler(::RightScale::RightPopen::SpecFiberScheduler.new)
+      begin
+        ::RightScale::RightPopen.popen3_async('true', :target => ::Object.new, :rlimits => { :stack => 1 })
+      rescue ::ArgumentError => e
+        error = e
+      end
+    end.join
+    error.message.should =~ /rlimits/
+  end
+
+  it 'should report failure to set a limit as failure to execute' do
+    # even a privileged user cannot exceed the system maximum.
+    beyond_maximum = ::File.read('/proc/sys/fs/nr_open').to_i + 1
+    error = nil
+    begin
+      run('true', :rlimits => { :nofile => beyond_maximum })
+    rescue ::RightScale::RightPopen::ProcessError => e
+      error = e
+    end
+    error.stage.should == :rlimits
+    error.errno.should == ::Errno::EPERM::Errno
+  end
+end
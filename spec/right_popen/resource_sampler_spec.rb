@@ -0,0 +1,77 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe 'RightScale::RightPopen::ResourceSampler' do
+
+  let(:sampler_class) { ::RightScale::RightPopen::ResourceSampler }
+
+  before(:each) do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+    ::RightScale::RightPopen.require_popen3_impl(:popen3_sync)
+    @pids = []
+  end
+
+  after(:each) do
+    @pids.each do |pid|
+      ::Process.kill('KILL', -pid) rescue nil
+      ::Process.kill('KILL', pid) rescue nil
+      ::Process.wait(pid) rescue nil
+    end
+  end
+
+  def spawn_child(cmd)
+    pid = ::Process.spawn(cmd, :pgroup => true)
+    @pids << pid
+    pid
+  end
+
+  it 'should only be requested for a resource handler or limit' do
+    sampler_class.requested?({}).should be_false
+    sampler_class.requested?(:sample_interval_seconds => 1).should be_false
+    sampler_class.requested?(:resource_handler => :on_resource).should be_true
+    sampler_class.requested?(:max_io_bytes => 1).should be_true
+  end
+
+  it 'should raise for invalid options' do
+    expect { sampler_class.new(:sample_interval_seconds => 0) }.to raise_error(::ArgumentError)
+    expect { sampler_class.new(:max_rss_bytes => -1) }.to raise_error(::ArgumentError)
+    expect { sampler_class.new(:max_cpu_seconds => 'x') }.to raise_error(::ArgumentError)
+  end
+
+  it 'should sample the child until it exits' do
+    pid = spawn_child('exec sleep 10')
+    sampler = sampler_class.new({})
+    sampler.start(pid)
+    sample = sampler.sample
+    sample.process_count.should == 1
+    sample.rss_bytes.should > 0
+    sample.cpu_seconds.should >= 0
+    sample.io_bytes.should >= 0
+    sample.exceeded_limit.should be_nil
+    ::Process.kill('KILL', pid)
+    ::Process.wait(pid)
+    sampler.sample.should be_nil
+  end
+
+  it 'should include descendants when sampling the process tree' do
+    pid = spawn_child('sleep 10 & sleep 10 & wait')
+    sleep 0.2
+    single = sampler_class.new({})
+    single.start(pid)
+    single.sample.process_count.should == 1
+    tree = sampler_class.new(:sample_process_tree => true)
+    tree.start(pid)
+    sample = tree.sample
+    sample.process_count.should == 3
+    sample.rss_bytes.should > single.sample.rss_bytes
+    [single, tree].each { |sampler| sampler.close }
+  end
+
+  it 'should report the limit that was exceeded' do
+    pid = spawn_child('exec sleep 10')
+    sampler = sampler_class.new(:max_cpu_seconds => 10, :max_rss_bytes => 1)
+    sampler.start(pid)
+    sampler.sample.exceeded_limit.should == :max_rss_bytes
+    sampler.close
+  end
+
+end
@@ -0,0 +1,156 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe RightScale::RightPopen::ResultCache do
+
+  # collects the handler events of one caller.
+  class ResultCacheSpecTarget
+    attr_reader :pids, :output, :status
+    def initialize; @pids = []; @output = ''; @status = nil; end
+    def on_pid(pid); @pids << pid; end
+    def on_stdout(data); @output << data; end
+    def on_exit(status); @status = status; end
+  end
+
+  let(:store) { described_class.new(4) }
+
+  def run_cached(cmd, cache_options = {}, options = {})
+    target = ResultCacheSpecTarget.new
+    ::RightScale::RightPopen.popen3_sync(
+      cmd,
+      { :target         => target,
+        :pid_handler    => :on_pid,
+        :stdout_handler => :on_stdout,
+        :exit_handler   => :on_exit,
+        :cache          => { :store => store }.merge(cache_options) }.merge(options))
+    target
+  end
+
+  context 'store' do
+    subject { store }
+
+    it 'should evict the least recently used entry' do
+      entries = (1..4).map do |i|
+        entry, leader = subject.checkout("key#{i}")
+        leader.should be_true
+        subject.complete(entry, 60)
+        entry
+      end
+      subject.checkout('key1').should == [entries[0], false]
+      subject.checkout('key5').last.should be_true
+      subject.size.should == 4
+      subject.checkout('key2').last.should be_true
+      subject.checkout('key1').last.should be_false
+    end
+
+    it 'should not evict running entries' do
+      running = (1..3).map { |i| subject.checkout("running#{i}").first }
+      completed = subject.checkout('completed').first
+      subject.complete(completed, 60)
+      subject.checkout('key5').last.should be_true
+      subject.size.should == 4
+      subject.checkout('completed').last.should be_true
+      subject.checkout('key6').last.should be_true
+      subject.size.should == 6
+      running.each { |entry| subject.checkout(entry.key).should == [entry, false] }
+    end
+
+    it 'should stop sharing and recording output beyond max_entry_bytes' do
+      store = described_class.new(4, 10)
+      entry = store.checkout('key').first
+      entry.record(:stdout_handler, 'x' * 20)
+      entry.events.should be_empty
+      store.size.should == 0
+      store.checkout('key').last.should be_true
+
+      entry = store.checkout('followed').first
+      store.checkout('followed').should == [entry, false]
+      entry.record(:stdout_handler, 'x' * 20)
+      entry.events.should == [[:stdout_handler, ['x' * 20]]]
+      store.checkout('followed').last.should be_true
+    end
+
+    it 'should expire entries after their ttl' do
+      entry = subject.checkout('key').first
+      subject.complete(entry, 0.05)
+      subject.checkout('key').last.should be_false
+      sleep 0.1
+      subject.checkout('key').last.should be_true
+    end
+
+    it 'should not keep results that are not cacheable' do
+      entry = subject.checkout('key').first
+      entry.record(:timeout_handler)
+      subject.complete(entry, 60)
+      subject.size.should == 0
+    end
+  end
+
+  context 'popen3_sync' do
+    before(:each) do
+      pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+    end
+
+    let(:command) { ['sh', '-c', 'echo $$; sleep 0.3'] }
+
+    it 'should share one child among concurrent identical invocations' do
+      results = ::Queue.new
+      threads = (1..3).map do
+        ::Thread.new { results << run_cached(command) }
+      end
+      threads.each { |thread| thread.join }
+      targets = (1..3).map { results.pop }
+      pids = targets.map { |target| target.pids }.flatten.uniq
+      pids.size.should == 1
+      targets.each do |target|
+        target.output.should == "#{pids.first}\n"
+        target.status.exitstatus.should == 0
+      end
+      store.size.should == 0
+    end
+
+    it 'should serve a completed result until its ttl expires' do
+      first = run_cached(command, :ttl => 0.5)
+      second = run_cached(command, :ttl => 0.5)
+      second.pids.should == first.pids
+      second.output.should == first.output
+      second.status.success?.should be_true
+      sleep 0.6
+      third = run_cached(command, :ttl => 0.5)
+      third.pids.should_not == first.pids
+    end
+
+    it 'should not share children given different input or environment' do
+      first = run_cached(command, { :ttl => 5 }, :input => 'one')
+      run_cached(command, { :ttl => 5 }, :input => 'two').pids.should_not == first.pids
+      run_cached(command, { :ttl => 5 }, :environment => { 'X' => '1' }).pids.should_not == first.pids
+      run_cached(command, { :ttl => 5 }, :input => 'one').pids.should == first.pids
+    end
+
+    it 'should not share children given different limits or scheduling' do
+      first = run_cached(command, { :ttl => 5 }, :max_rss_bytes => 1 << 30)
+      second = run_cached(command, { :ttl => 5 }, :max_rss_bytes => 1 << 31)
+      second.pids.should_not == first.pids
+      run_cached(command, { :ttl => 5 }, :max_rss_bytes => 1 << 30, :nice => 5).pids.should_not == first.pids
+      run_cached(command, { :ttl => 5 }, :max_rss_bytes => 1 << 30).pids.should == first.pids
+      store.size.should == 3
+    end
+
+    it 'should not cache timed out results' do
+      first = run_cached(['sh', '-c', 'echo $$; sleep 5'], { :ttl => 5 }, :timeout_seconds => 0.2)
+      first.status.success?.should be_false
+      store.size.should == 0
+    end
+
+    it 'should not share children between sync and async callers' do
+      run_cached(command, :ttl => 5)
+      store.instance_variable_get(:@entries).keys.first.should =~ /\Apopen3_sync:/
+    end
+
+    it 'should refuse to combine cache with watch_handler' do
+      expect do
+        run_cached(command, {}, :watch_handler => :on_pid)
+      end.to raise_error(::ArgumentError, /watch_handler/)
+    end
+  end
+
+end
@@ -61,6 +61,22 @@ describe RightScale::RightPopen do
         runner_status.pid.should > 0
       end
 
+      it "should report resource usage, timings and byte counts in status" do
+        pending 'not implemented for windows' if windows?
+        command = "\"#{RUBY_CMD}\" \"#{script_path_for('produce_output')}\" \"#{STANDARD_MESSAGE}\" \"#{ERROR_MESSAGE}\""
+        runner_status = runner.run_right_popen3(synchronicity, command)
+        status = runner_status.status
+        status.exitstatus.should == 0
+        status.stdout_bytes.should == STANDARD_MESSAGE.bytesize + 1
+        status.stderr_bytes.should == ERROR_MESSAGE.bytesize + 1
+        status.spawned_at.should <= status.first_byte_at
+        status.first_byte_at.should <= status.exited_at
+        status.elapsed_seconds.should > 0
+        status.rusage.user_time.should > 0
+        status.rusage.max_rss.should > 0
+        status.rusage.minor_faults.should > 0
+      end
+
       it "should return the right status" do
         ruby = ::RbConfig.respond_to?(:ruby) ?
           ::RbConfig.ruby :
@@ -147,6 +163,32 @@ describe RightScale::RightPopen do
         status.pid.should > 0
       end
 
+      if :sync == synchronicity
+        it "should deliver output through caller-supplied buffers" do
+          count = LARGE_OUTPUT_COUNTER
+          command = "\"#{RUBY_CMD}\" \"#{script_path_for('produce_mixed_output')}\" #{count}"
+          stdout_buffer = ''
+          stderr_buffer = ''
+          status = runner.run_right_popen3(synchronicity, command, :stdout_buffer => stdout_buffer, :stderr_buffer => stderr_buffer)
+          status.status.exitstatus.should == 0
+
+          expected_output = ''
+          expected_error = ''
+          count.times do |i|
+            expected_output << "stdout #{i}\n"
+            (expected_error << "stderr #{i}\n") if 0 == i % 10
+          end
+          status.output_text.should == expected_output
+          status.error_text.should == expected_error
+        end
+
+        it "should reject frozen output buffers" do
+          command = "\"#{RUBY_CMD}\" \"#{script_path_for('produce_output')}\""
+          expect { runner.run_right_popen3(synchronicity, command, :stdout_buffer => ''.freeze) }.
+            to raise_exception(::ArgumentError, /stdout_buffer/)
+        end
+      end
+
       it "should preserve interleaved output when yielding CPU on consumer thread" do
         lines = 11
         exit_code = 42
@@ -357,6 +399,21 @@ describe RightScale::RightPopen do
         end
       end
 
+      it "should interrupt watched child at resource limit" do
+        pending 'not implemented for windows' if windows?
+        command = [RUBY_CMD, '-e', 'loop {}']
+        runner_status = runner.run_right_popen3(
+          synchronicity, command,
+          :expect_resource_limit => true, :max_cpu_seconds => 0.2,
+          :sample_interval_seconds => 0.05, :timeout => 10)
+        runner_status.status.success?.should be_false
+        runner_status.did_timeout.should be_false
+        runner_status.resource_samples.should_not be_empty
+        runner_status.resource_samples.last.rss_bytes.should > 0
+        runner_status.resource_limit_sample.exceeded_limit.should == :max_cpu_seconds
+        runner_status.resource_limit_sample.cpu_seconds.should > 0.2
+      end
+
       it "should handle child processes that close stdout but keep running" do
         pending 'not implemented for windows' if windows? && :sync != synchronicity
         command = "\"#{RUBY_CMD}\" \"#{script_path_for('stdout')}\""
@@ -406,4 +463,271 @@ describe RightScale::RightPopen do
 
     end # synchronicity
   end # each synchronicity
+
+  it 'should not hold the interpreter open after a handler raises' do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+    script = <<-EOS
+      require 'right_popen'
+      target = ::Object.new
+      def target.on_out(data); sleep 0.5; raise 'handler failed'; end
+      ::RightScale::RightPopen.popen3_sync(
+        'echo hi; sleep 6', :target => target, :stdout_handler => :on_out)
+    EOS
+    lib_path = ::File.expand_path('../../../lib', __FILE__)
+    started_at = ::Time.now
+    _, stderr_text, status = described_class.capture([RUBY_CMD, '-I', lib_path, '-e', script])
+    (::Time.now - started_at).should < 3
+    stderr_text.should =~ /handler failed/
+    status.success?.should be_false
+  end
+
+  context '.capture' do
+    it 'should return output and status' do
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('produce_output')}\" \"#{STANDARD_MESSAGE}\" \"#{ERROR_MESSAGE}\""
+      stdout_text, stderr_text, status = described_class.capture(command)
+      stdout_text.should == STANDARD_MESSAGE + "\n"
+      stderr_text.should == ERROR_MESSAGE + "\n"
+      status.exitstatus.should == 0
+      status.stdout_bytes.should == stdout_text.bytesize
+      status.stderr_bytes.should == stderr_text.bytesize
+    end
+
+    it 'should capture large output and pass input' do
+      count = LARGE_OUTPUT_COUNTER
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('produce_stdout_only')}\" #{count}"
+      stdout_text, stderr_text, status = described_class.capture(command)
+      stdout_text.should == (0...count).map { |i| "stdout #{i}\n" }.join
+      stderr_text.should be_empty
+
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('increment')}\""
+      stdout_text, _, status = described_class.capture(command, :input => "42\n")
+      stdout_text.should == "43\n"
+      status.success?.should be_true
+    end
+
+    it 'should interrupt when timeout expires' do
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('sleeper')}\" 10"
+      _, _, status = described_class.capture(command, :timeout_seconds => 0.1)
+      status.success?.should be_false
+    end
+
+    it 'should raise ENOENT for invalid executables' do
+      expect { described_class.capture(['nosuchexecutable']) }.
+        to raise_exception(::RightScale::RightPopen::ProcessError, /nosuchexecutable/)
+    end
+  end
+
+  context 'merged output' do
+    before(:each) do
+      pending 'Not supported on Windows' if windows?
+    end
+
+    let(:command) { ['sh', '-c', 'echo out1; sleep 0.1; echo err1 1>&2; sleep 0.1; echo out2'] }
+    let(:expected_chunks) { [[:stdout, 1, "out1\n"], [:stderr, 2, "err1\n"], [:stdout, 3, "out2\n"]] }
+    let(:chunks) { [] }
+    let(:target) do
+      collected = chunks
+      target = ::Object.new
+      target.define_singleton_method(:on_output) do |stream, sequence, timestamp_ns, data|
+        collected << [stream, sequence, timestamp_ns, data.dup]
+      end
+      target
+    end
+
+    def should_be_in_order_read(chunks)
+      chunks.map { |chunk| [chunk[0], chunk[1], chunk[3]] }.should == expected_chunks
+      timestamps = chunks.map { |chunk| chunk[2] }
+      timestamps.sort.should == timestamps
+      (timestamps.last - timestamps.first).should >= 100_000_000
+    end
+
+    it 'should deliver both streams to one handler in the order read' do
+      described_class.popen3_sync(command, :target => target, :merged_output_handler => :on_output)
+      should_be_in_order_read(chunks)
+    end
+
+    it 'should tag merged output when read by the reactor' do
+      exited = ::Queue.new
+      target.define_singleton_method(:on_exit) { |status| exited << status }
+      described_class.popen3_reactor(
+        command,
+        :target                => target,
+        :merged_output_handler => :on_output,
+        :exit_handler          => :on_exit)
+      exited.pop.success?.should be_true
+      should_be_in_order_read(chunks)
+    end
+
+    it 'should capture merged output alongside each stream' do
+      merged = []
+      stdout_text, stderr_text, status = described_class.capture(command, :merged_output => merged)
+      status.success?.should be_true
+      stdout_text.should == "out1\nout2\n"
+      stderr_text.should == "err1\n"
+      should_be_in_order_read(merged.map { |chunk| chunk.to_a })
+    end
+
+    it 'should not combine merged output with separate stream handlers' do
+      expect do
+        described_class.popen3_sync(
+          command,
+          :target                => target,
+          :merged_output_handler => :on_output,
+          :stdout_handler        => :on_output)
+      end.to raise_exception(::ArgumentError, /merged_output_handler/)
+    end
+  end
+
+  context 'async with a Fiber.scheduler' do
+    before(:each) do
+      pending 'Requires ruby 3.0+ on Linux' if windows? || !::Fiber.respond_to?(:set_scheduler)
+    end
+
+    it 'should run many commands concurrently without EventMachine' do
+      command = "echo out; echo err >&2; sleep 0.2; exit 3"
+      started_at = ::Time.now
+      results = runner.run_right_popen3(:fiber, command, :repeats => 20)
+      (::Time.now - started_at).should < 2
+      results.size.should == 20
+      results.each do |runner_status|
+        runner_status.output_text.should == "out\n"
+        runner_status.error_text.should == "err\n"
+        runner_status.status.exitstatus.should == 3
+        runner_status.pid.should > 0
+      end
+    end
+
+    it 'should stream input and large output' do
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('increment')}\""
+      runner_status = runner.run_right_popen3(:fiber, command, :input => "42\n")
+      runner_status.output_text.should == "43\n"
+      runner_status.status.success?.should be_true
+
+      count = LARGE_OUTPUT_COUNTER
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('produce_stdout_only')}\" #{count}"
+      runner_status = runner.run_right_popen3(:fiber, command)
+      runner_status.output_text.should == (0...count).map { |i| "stdout #{i}\n" }.join
+      runner_status.status.success?.should be_true
+    end
+
+    it 'should interrupt when timeout expires' do
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('sleeper')}\" 10"
+      runner_status = runner.run_right_popen3(:fiber, command, :timeout => 0.1, :expect_timeout => true)
+      runner_status.did_timeout.should be_true
+      runner_status.status.success?.should be_false
+    end
+
+    it 'should raise ENOENT for invalid executables' do
+      expect { runner.run_right_popen3(:fiber, ['nosuchexecutable']) }.
+        to raise_exception(::RightScale::RightPopen::ProcessError, /nosuchexecutable/)
+    end
+  end
+
+  context 'reactor' do
+    before(:each) do
+      pending 'Not supported on Windows' if windows?
+    end
+
+    it 'should run many commands concurrently on one reactor thread' do
+      command = "echo out; echo err >&2; sleep 0.2; exit 3"
+      thread_count = ::Thread.list.size
+      started_at = ::Time.now
+      results = runner.run_right_popen3(:reactor, command, :repeats => 20)
+      (::Time.now - started_at).should < 2
+      results.size.should == 20
+      ::Thread.list.size.should <= thread_count + 2
+      results.each do |runner_status|
+        runner_status.output_text.should == "out\n"
+        runner_status.error_text.should == "err\n"
+        runner_status.status.exitstatus.should == 3
+        runner_status.pid.should > 0
+      end
+    end
+
+    it 'should stream input and large output' do
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('increment')}\""
+      runner_status = runner.run_right_popen3(:reactor, command, :input => "42\n")
+      runner_status.output_text.should == "43\n"
+      runner_status.status.success?.should be_true
+
+      count = LARGE_OUTPUT_COUNTER
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('produce_stdout_only')}\" #{count}"
+      runner_status = runner.run_right_popen3(:reactor, command)
+      runner_status.output_text.should == (0...count).map { |i| "stdout #{i}\n" }.join
+      runner_status.status.success?.should be_true
+    end
+
+    it 'should interrupt when timeout expires' do
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('sleeper')}\" 10"
+      runner_status = runner.run_right_popen3(:reactor, command, :timeout => 0.1, :expect_timeout => true)
+      runner_status.did_timeout.should be_true
+      runner_status.status.success?.should be_false
+    end
+
+    it 'should raise ENOENT for invalid executables' do
+      expect { runner.run_right_popen3(:reactor, ['nosuchexecutable']) }.
+        to raise_exception(::RightScale::RightPopen::ProcessError, /nosuchexecutable/)
+    end
+
+    it 'should call handlers in order on the given executor' do
+      executor = ::Class.new do
+        attr_reader :task_count
+        def initialize; @task_count = 0; end
+        def post(&task); @task_count += 1; ::Thread.new { task.call }; true; end
+      end.new
+      count = LARGE_OUTPUT_COUNTER
+      command = "\"#{RUBY_CMD}\" \"#{script_path_for('produce_stdout_only')}\" #{count}"
+      runner_status = runner.run_right_popen3(:reactor, command, :executor => executor)
+      runner_status.output_text.should == (0...count).map { |i| "stdout #{i}\n" }.join
+      runner_status.status.success?.should be_true
+      executor.task_count.should > 0
+    end
+
+    it 'should fail only the child whose stream was closed by a handler' do
+      exited = ::Queue.new
+      errors = []
+      target = ::Object.new
+      target.define_singleton_method(:on_watch) { |process| process.stdout.close unless process.stdout.closed? }
+      target.define_singleton_method(:on_error) { |e| errors << e }
+      target.define_singleton_method(:on_exit) { |status| exited << status }
+      described_class.popen3_reactor(
+        ['sh', '-c', 'sleep 0.5; echo done'],
+        :target                  => target,
+        :watch_handler           => :on_watch,
+        :async_exception_handler => :on_error,
+        :exit_handler            => :on_exit)
+      exited.pop
+      errors.first.kind_of?(::IOError).should be_true
+
+      runner_status = runner.run_right_popen3(:reactor, 'echo out')
+      runner_status.output_text.should == "out\n"
+    end
+
+    it 'should count output drained after exit is detected' do
+      described_class.require_popen3_impl(:popen3_reactor)
+      output = ''
+      handler = ::Object.new
+      handler.define_singleton_method(:on_stdout) { |data| output << data }
+      options = described_class::DEFAULT_POPEN3_OPTIONS.merge(
+        :target => handler, :stdout_handler => :on_stdout)
+      target = ::RightScale::RightPopen::TargetProxy.new(options)
+      process = ::RightScale::RightPopen::Process.new(options)
+      process.spawn(['echo', 'drained'], target)
+      sleep 0.01 while process.alive?
+      executor = ::Object.new
+      executor.define_singleton_method(:post) { |&task| task.call; true }
+      ::RightScale::RightPopen::Reactor::Child.new(process, target, nil, executor).finish
+      output.should == "drained\n"
+      process.status.stdout_bytes.should == output.bytesize
+      process.status.first_byte_at.should_not be_nil
+    end
+
+    it 'should replace a reactor whose thread has died' do
+      reactor = ::RightScale::RightPopen::Reactor.instance
+      reactor.instance_variable_get(:@thread).kill.join
+      runner_status = runner.run_right_popen3(:reactor, 'echo out')
+      runner_status.output_text.should == "out\n"
+      ::RightScale::RightPopen::Reactor.instance.should_not == reactor
+    end
+  end
 end # RightScale::RightPopen
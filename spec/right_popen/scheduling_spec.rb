@@ -0,0 +1,53 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe 'RightScale::RightPopen::Scheduling' do
+
+  before(:each) do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+  end
+
+  def capture(cmd, options)
+    stdout, stderr, status = ::RightScale::RightPopen.capture(cmd, options)
+    stderr.should == ''
+    status.success?.should be_true
+    stdout
+  end
+
+  it 'should set nice' do
+    capture(['sh', '-c', 'cut -d " " -f 19 /proc/$$/stat'], :nice => 10).strip.should == '10'
+  end
+
+  it 'should set cpu affinity' do
+    capture(['grep', 'Cpus_allowed_list', '/proc/self/status'], :cpu_affinity => [0]).
+      split(':').last.strip.should == '0'
+  end
+
+  it 'should set sched policy' do
+    capture(['grep', 'policy', '/proc/self/sched'], :sched_policy => :batch).
+      split(':').last.strip.should == '3'
+    capture(['grep', 'policy', '/proc/self/sched'], :sched_policy => :idle).
+      split(':').last.strip.should == '5'
+  end
+
+  it 'should set io priority' do
+    if ::File.executable?('/usr/bin/ionice')
+      capture(['sh', '-c', 'ionice -p $$'], :io_priority => [:best_effort, 7]).strip.should == 'best-effort: prio 7'
+      capture(['sh', '-c', 'ionice -p $$'], :io_priority => :idle).strip.should == 'idle'
+    end
+  end
+
+  it 'should raise for invalid options before fork' do
+    [
+      { :nice => 42 },
+      { :cpu_affinity => [] },
+      { :cpu_affinity => [-1] },
+      { :io_priority => [:best_effort, 8] },
+      { :io_priority => :fast },
+      { :sched_policy => :fifo },
+    ].each do |options|
+      expect { ::RightScale::RightPopen.capture('true', options) }.
+        to raise_error(::ArgumentError)
+    end
+  end
+
+end
@@ -0,0 +1,33 @@
+# serves requests framed by line (default) or by length (when the first
+# argument is 'length'). each response is prefixed by the PID so that specs
+# can tell which child served it. special requests: 'crash' exits without
+# responding, 'sleep' never responds and 'stderr' writes to stderr first.
+$stdout.sync = true
+$stdout.binmode
+$stdin.binmode
+length_framing = 'length' == ARGV[0]
+while true
+  if length_framing
+    header = $stdin.read(4)
+    break unless header
+    request = $stdin.read(header.unpack('N').first)
+  else
+    request = $stdin.gets
+    break unless request
+    request.chomp!
+  end
+  case request
+  when 'crash'
+    exit 99
+  when 'sleep'
+    sleep 60
+  when 'stderr'
+    $stderr.puts 'to stderr'
+  end
+  response = "#{Process.pid}:#{request}"
+  if length_framing
+    $stdout.write([response.bytesize].pack('N') + response)
+  else
+    $stdout.puts response
+  end
+end
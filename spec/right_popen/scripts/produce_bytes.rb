@@ -0,0 +1,9 @@
+byte_count = ARGV[0] ? ARGV[0].to_i : 1024 * 1024
+stream = ('stderr' == ARGV[1]) ? STDERR : STDOUT
+line_length = ARGV[2] ? [ARGV[2].to_i, 1].max : 80
+
+line = ('x' * (line_length - 1)) + "\n"
+line_count, remainder = byte_count.divmod(line.bytesize)
+line_count.times { stream.write(line) }
+stream.write(line[0, remainder]) if remainder > 0
+stream.flush
@@ -0,0 +1,13 @@
+# writes the given count of chunks of the given size to stdout, flushing each
+# so that the parent reads (about) one chunk per read. optionally pauses
+# between chunks.
+chunk_count = ARGV[0] ? ARGV[0].to_i : 1000
+chunk_size = ARGV[1] ? [ARGV[1].to_i, 1].max : 64
+pause_seconds = ARGV[2] ? ARGV[2].to_f : 0
+
+STDOUT.sync = true
+chunk = ('x' * (chunk_size - 1)) + "\n"
+chunk_count.times do
+  STDOUT.write(chunk)
+  sleep pause_seconds if pause_seconds > 0
+end
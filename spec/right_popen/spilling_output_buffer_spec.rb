@@ -0,0 +1,39 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe RightScale::RightPopen::SpillingOutputBuffer do
+
+  let(:threshold_bytes) { 1024 }
+  let(:line)            { "#{'x' * 99}\n" }
+
+  subject { described_class.new(threshold_bytes) }
+
+  after(:each) { subject.close }
+
+  it 'should keep small output in memory' do
+    5.times { subject.buffer_data(line).should be_true }
+    subject.spilled?.should be_false
+    subject.byte_count.should == line.bytesize * 5
+    subject.read.should == line * 5
+  end
+
+  it 'should spill large output to an anonymous file' do
+    100.times { subject.buffer_data(line) }
+    subject.spilled?.should be_true
+    subject.byte_count.should == line.bytesize * 100
+    io = subject.to_io
+    io.read(line.bytesize).should == line
+    subject.read.should == line * 100
+    ::Dir.glob(::File.join(subject.directory, 'right_popen*')).should be_empty
+  end
+
+  it 'should refuse data after close' do
+    subject.close
+    expect { subject.buffer_data(line) }.
+      to raise_exception(::RightScale::RightPopen::ProcessError)
+  end
+
+  it 'should reject an invalid threshold' do
+    expect { described_class.new(-1) }.to raise_exception(::ArgumentError)
+  end
+
+end
@@ -0,0 +1,100 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe RightScale::RightPopen::TimerWheel do
+
+  let(:start)      { 1000.0 }
+  let(:resolution) { 0.01 }
+  let(:fired)      { [] }
+
+  subject { described_class.new(resolution, 4, start) }
+
+  def schedule_at(seconds_from_start, name = seconds_from_start)
+    subject.schedule(start + seconds_from_start) { fired << name }
+  end
+
+  it 'should fire timers in deadline order across levels' do
+    [30, 0.05, 700, 1.5, 0.5].each { |seconds| schedule_at(seconds) }
+    subject.size.should == 5
+    subject.advance(start + 0.04).should == 0
+    subject.advance(start + 1).should == 2
+    fired.should == [0.05, 0.5]
+    subject.advance(start + 1000).should == 3
+    fired.should == [0.05, 0.5, 1.5, 30, 700]
+    subject.empty?.should be_true
+    subject.next_deadline.should be_nil
+  end
+
+  it 'should report the earliest deadline or the next cascade' do
+    schedule_at(0.25)
+    schedule_at(0.1)
+    subject.next_deadline.should be_within(0.001).of(start + 0.1)
+
+    wheel = described_class.new(resolution, 4, start)
+    wheel.schedule(start + 100) { fired << 100 }
+    wakeups = []
+    while deadline = wheel.next_deadline
+      deadline.should <= start + 100 + resolution
+      wakeups << deadline
+      wheel.advance(deadline)
+    end
+    fired.should == [100]
+    wakeups.size.should < 4
+    wakeups.last.should be_within(resolution).of(start + 100)
+  end
+
+  it 'should fire overdue timers on next advance' do
+    schedule_at(-5, :overdue)
+    subject.next_deadline.should <= start
+    subject.advance(start).should == 1
+    fired.should == [:overdue]
+  end
+
+  it 'should fire timers cascaded onto the current tick in the same advance' do
+    # a timer one level-1 slot out cascades onto the tick on which it is due.
+    wheel = described_class.new(1.0, 4, 0.0)
+    wheel.schedule(64.0) { fired << 64 }
+    wheel.next_deadline.should be_within(0.001).of(64.0)
+    wheel.advance(64.0).should == 1
+    fired.should == [64]
+    wheel.empty?.should be_true
+    wheel.next_deadline.should be_nil
+  end
+
+  it 'should not fire cancelled timers' do
+    timer = schedule_at(0.2, :cancelled)
+    schedule_at(0.3, :kept)
+    timer.cancel.should be_true
+    timer.pending?.should be_false
+    subject.size.should == 1
+    subject.advance(start + 1).should == 1
+    fired.should == [:kept]
+  end
+
+  it 'should release cancelled timers from their slots' do
+    held = ::Object.new
+    timers = [0.2, 30, 700].map { |seconds| subject.schedule(start + seconds) { fired << held } }
+    timers.each { |timer| timer.cancel }
+    subject.empty?.should be_true
+    subject.instance_variable_get(:@levels).flatten.all? { |slot| slot.empty? }.should be_true
+    subject.advance(start + 1000).should == 0
+    fired.should be_empty
+  end
+
+  it 'should clamp deadlines beyond the last level' do
+    wheel = described_class.new(resolution, 1, start)
+    wheel.schedule(start + 5) { fired << 5 }
+    while deadline = wheel.next_deadline
+      wheel.advance(deadline)
+    end
+    fired.should == [5]
+  end
+
+  it 'should allow callbacks to schedule timers' do
+    schedule_at(0.1)
+    subject.schedule(start + 0.2) { schedule_at(0.3, :rescheduled) }
+    subject.advance(start + 0.25)
+    subject.advance(start + 0.35)
+    fired.should == [0.1, :rescheduled]
+  end
+
+end
@@ -0,0 +1,74 @@
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+require 'json'
+require 'tmpdir'
+
+describe RightScale::RightPopen::Tracer do
+
+  subject { described_class.new(1024) }
+
+  before(:each) do
+    pending 'Not supported on Windows' if ::RightScale::RightPopen::SpecHelper.windows?
+  end
+
+  def run_child(cmd, tracer)
+    target = ::Object.new
+    target.define_singleton_method(:on_stdout) { |data| true }
+    target.define_singleton_method(:on_exit) { |status| true }
+    ::RightScale::RightPopen.popen3_sync(
+      cmd,
+      :target          => target,
+      :stdout_handler  => :on_stdout,
+      :exit_handler    => :on_exit,
+      :instrumentation => tracer)
+  end
+
+  it 'should export a track for each child and each of its handlers' do
+    2.times { run_child('echo hello', subject) }
+    trace = subject.to_chrome_trace
+    events = trace['traceEvents']
+    track_names = events.select { |e| 'thread_name' == e['name'] }.map { |e| e['args']['name'] }
+    track_names.grep(/\Achild \d+\z/).size.should == 2
+    track_names.grep(/\Achild \d+ stdout_handler\z/).size.should == 2
+    track_names.grep(/\Achild \d+ exit_handler\z/).size.should == 2
+    spans = events.select { |e| 'X' == e['ph'] }
+    %w(popen spawn run stdout_handler exit_handler).each do |name|
+      spans.select { |e| name == e['name'] }.size.should == 2
+    end
+    spans.each { |e| e['dur'].should >= 0 }
+    reads = events.select { |e| 'stdout' == e['name'] }
+    reads.map { |e| e['args']['bytes'] }.should == [6, 6]
+  end
+
+  it 'should record interrupts' do
+    target = ::Object.new
+    ::RightScale::RightPopen.popen3_sync(
+      'sleep 10', :target => target, :timeout_seconds => 0.1, :instrumentation => subject)
+    interrupt = subject.to_chrome_trace['traceEvents'].find { |e| 'interrupted' == e['name'] }
+    interrupt['args']['signal'].should == 'INT'
+  end
+
+  it 'should keep only the newest events' do
+    tracer = described_class.new(3)
+    5.times { |i| tracer.record(:"phase#{i}", nil, ::RightScale::RightPopen.monotonic_time, nil) }
+    tracer.size.should == 3
+    names = tracer.to_chrome_trace['traceEvents'].select { |e| 'i' == e['ph'] }.map { |e| e['name'] }
+    names.should == %w(phase2 phase3 phase4)
+  end
+
+  it 'should dump JSON to a file on a signal' do
+    ::Dir.mktmpdir do |dir|
+      path = ::File.join(dir, 'trace.json')
+      old_handler = ::Signal.trap('USR2', 'DEFAULT')
+      begin
+        run_child('echo hello', subject)
+        subject.dump_on_signal(path, 'USR2')
+        ::Process.kill('USR2', ::Process.pid)
+        50.times { break if ::File.file?(path); sleep 0.05 }
+        ::JSON.parse(::File.read(path))['traceEvents'].should_not be_empty
+      ensure
+        ::Signal.trap('USR2', old_handler || 'DEFAULT')
+      end
+    end
+  end
+
+end
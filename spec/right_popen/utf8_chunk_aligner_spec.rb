@@ -0,0 +1,67 @@
+# encoding: utf-8
+require ::File.expand_path(::File.join(::File.dirname(__FILE__), '..', 'spec_helper'))
+
+describe RightScale::RightPopen::Utf8ChunkAligner do
+
+  let(:text)  { "café € \u{1F600} naïve\n" * 3 }
+  let(:bytes) { text.dup.force_encoding(::Encoding::BINARY) }
+
+  it 'should never split a multibyte sequence at any chunk size' do
+    (1..7).each do |chunk_size|
+      aligner = described_class.new
+      chunks = []
+      offset = 0
+      while offset < bytes.bytesize
+        chunk = aligner.align(bytes.byteslice(offset, chunk_size))
+        chunks << chunk unless chunk.empty?
+        offset += chunk_size
+      end
+      aligner.flush.should be_empty
+      chunks.each do |chunk|
+        chunk.encoding.should == ::Encoding::UTF_8
+        chunk.valid_encoding?.should be_true
+      end
+      chunks.join.should == text
+    end
+  end
+
+  it 'should tag invalid data as binary' do
+    aligner = described_class.new
+    chunk = aligner.align("abc\xFFdef".force_encoding(::Encoding::BINARY))
+    chunk.encoding.should == ::Encoding::BINARY
+    chunk.bytesize.should == 7
+  end
+
+  it 'should flush an incomplete trailing sequence as binary' do
+    aligner = described_class.new
+    aligner.align("abc\xE2\x82".force_encoding(::Encoding::BINARY)).should == 'abc'
+    aligner.tail.bytesize.should == 2
+    tail = aligner.flush
+    tail.encoding.should == ::Encoding::BINARY
+    tail.bytesize.should == 2
+    aligner.tail.should be_nil
+  end
+
+  context 'given a target proxy' do
+    let(:target) do
+      flexmock('target', :on_stdout => true, :on_exit => true)
+    end
+
+    it 'should realign chunks and flush before exit' do
+      proxy = ::RightScale::RightPopen::TargetProxy.new(
+        :target         => target,
+        :stdout_handler => :on_stdout,
+        :exit_handler   => :on_exit,
+        :utf8_chunks    => true)
+      status = ::RightScale::RightPopen::ProcessStatus.new(123, 0)
+      target.should_receive(:on_stdout).with("caf").once.ordered
+      target.should_receive(:on_stdout).with("é").once.ordered
+      target.should_receive(:on_stdout).with("\xC3".force_encoding(::Encoding::BINARY)).once.ordered
+      target.should_receive(:on_exit).with(status).once.ordered
+      proxy.stdout_handler("caf\xC3".force_encoding(::Encoding::BINARY))
+      proxy.stdout_handler("\xA9\xC3".force_encoding(::Encoding::BINARY))
+      proxy.exit_handler(status)
+    end
+  end
+
+end
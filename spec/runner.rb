@@ -23,6 +23,7 @@
 
 require 'rubygems'
 require 'eventmachine'
+require ::File.expand_path('../fiber_scheduler', __FILE__)
 
 module RightScale
   module RightPopen
@@ -42,11 +43,14 @@ module RightScale
 
           @expect_timeout    = options[:expect_timeout]
           @expect_size_limit = options[:expect_size_limit]
+          @expect_resource_limit = options[:expect_resource_limit]
           @async_exception   = nil
+          @resource_samples  = []
         end
 
         attr_accessor :output_text, :error_text, :status, :pid
         attr_accessor :did_timeout, :did_size_limit, :async_exception
+        attr_accessor :resource_samples, :resource_limit_sample
 
         def on_read_stdout(data)
           sleep @force_yield if @force_yield
@@ -75,6 +79,16 @@ module RightScale
           @callback.call(self) if @expect_size_limit
         end
 
+        def on_resource(sample)
+          @resource_samples << sample
+        end
+
+        def on_resource_limit(sample)
+          puts "\n** Failed to run #{@command.inspect}: Resource limit" unless @expect_resource_limit
+          @resource_limit_sample = sample
+          @callback.call(self) if @expect_resource_limit
+        end
+
         def on_exit(status)
           @status = status
           @callback.call(self)
@@ -106,12 +120,22 @@ module RightScale
           :watch_directory  => runner_options[:watch_directory],
           :user             => runner_options[:user],
           :group            => runner_options[:group],
+          :stdout_buffer    => runner_options[:stdout_buffer],
+          :stderr_buffer    => runner_options[:stderr_buffer],
+          :executor         => runner_options[:executor],
         }
+        [:max_rss_bytes, :max_cpu_seconds, :max_io_bytes, :sample_interval_seconds].each do |name|
+          popen3_options[name] = runner_options[name] if runner_options[name]
+        end
         case synchronicity
         when :sync
           run_right_popen3_sync(command, runner_options, popen3_options, &callback)
         when :async
           run_right_popen3_async(command, runner_options, popen3_options, &callback)
+        when :fiber
+          run_right_popen3_fiber(command, runner_options, popen3_options, &callback)
+        when :reactor
+          run_right_popen3_reactor(command, runner_options, popen3_options, &callback)
         else
           raise "unknown synchronicity = #{synchronicity.inspect}"
         end
@@ -159,6 +183,46 @@ module RightScale
         @stats.size < 2 ? @stats.first : @stats
       end
 
+      # runs all repeats concurrently on a thread having a Fiber.scheduler and
+      # then calls back for each outside of the scheduler so that failed
+      # expectations are not swallowed as handler exceptions.
+      def run_right_popen3_fiber(command, runner_options, popen3_options, &callback)
+        @stats = []
+        ::Thread.new do
+          ::Fiber.set_scheduler(::RightScale::RightPopen::SpecFiberScheduler.new)
+          runner_options[:repeats].times do
+            do_right_popen3_async(command, runner_options, popen3_options) do |runner_status|
+              @stats << runner_status
+            end
+          end
+        end.join
+        @stats.each do |runner_status|
+          raise runner_status.async_exception if runner_status.async_exception
+          callback.call(runner_status) if callback
+        end
+        @stats.uniq!
+        @stats.size < 2 ? @stats.first : @stats
+      end
+
+      # runs all repeats concurrently on the reactor and then calls back for each
+      # on the calling thread once all have exited.
+      def run_right_popen3_reactor(command, runner_options, popen3_options, &callback)
+        @stats = []
+        exited = ::Queue.new
+        runner_options[:repeats].times do
+          do_right_popen3(:reactor, command, runner_options, popen3_options) do |runner_status|
+            # also called back on timeout or size limit before exit.
+            exited << runner_status if runner_status.status
+          end
+        end
+        runner_options[:repeats].times { @stats << exited.pop }
+        @stats.each do |runner_status|
+          raise runner_status.async_exception if runner_status.async_exception
+          callback.call(runner_status) if callback
+        end
+        @stats.size < 2 ? @stats.first : @stats
+      end
+
       def do_right_popen3(synchronicity, command, runner_options, popen3_options, &callback)
         runner_status = RunnerStatus.new(command, runner_options, &callback)
         popen3_options = {
@@ -168,6 +232,8 @@ module RightScale
           :pid_handler             => :on_pid,
           :timeout_handler         => :on_timeout,
           :size_limit_handler      => :on_size_limit,
+          :resource_handler        => :on_resource,
+          :resource_limit_handler  => :on_resource_limit,
           :exit_handler            => :on_exit,
           :async_exception_handler => :on_async_exception
         }.merge(popen3_options)
@@ -176,6 +242,8 @@ module RightScale
           result = ::RightScale::RightPopen.popen3_sync(command, popen3_options)
         when :async
           result = ::RightScale::RightPopen.popen3_async(command, popen3_options)
+        when :reactor
+          result = ::RightScale::RightPopen.popen3_reactor(command, popen3_options)
         else
           raise "Uknown synchronicity = #{synchronicity.inspect}"
         end